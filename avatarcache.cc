@@ -0,0 +1,246 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#include "avatarcache.hh"
+#include "common.hh"
+
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QDir>
+#include <QFile>
+#include <QSaveFile>
+
+static const quint32 fileVersion = 1;
+static const int saveDelay = 2000;
+
+AvatarCache::AvatarCache(QObject *parent) :
+    QObject(parent)
+{
+    m_saveTimer.setSingleShot(true);
+    m_saveTimer.setInterval(saveDelay);
+    connect(&m_saveTimer, &QTimer::timeout, this, &AvatarCache::save);
+}
+
+AvatarCache::~AvatarCache()
+{
+    if (m_saveTimer.isActive()) {
+        save();
+    }
+}
+
+bool AvatarCache::open(const QString &path)
+{
+    m_path = path;
+    m_tokens.clear();
+
+    if (!QDir().mkpath(path)) {
+        qCWarning(general) << "Could not create the avatar cache" << path;
+        return false;
+    }
+
+    QFile file(path + QLatin1String("/tokens.dat"));
+    if (!file.exists()) {
+        return true;
+    }
+
+    if (!file.open(QIODevice::ReadOnly)) {
+        qCWarning(general) << "Could not open the avatar tokens" << file.fileName() << file.errorString();
+        return false;
+    }
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_0);
+
+    quint32 version;
+    QHash<QString, QString> tokens;
+    stream >> version;
+    if (version != fileVersion) {
+        qCWarning(general) << "Ignoring avatar tokens of unknown version" << version;
+        return false;
+    }
+
+    stream >> tokens;
+    if (stream.status() != QDataStream::Ok) {
+        qCWarning(general) << "Ignoring corrupt avatar tokens";
+        return false;
+    }
+
+    m_tokens = tokens;
+    qCDebug(general) << "Avatar cache knows the tokens of" << m_tokens.count() << "contacts";
+    return true;
+}
+
+void AvatarCache::save()
+{
+    m_saveTimer.stop();
+
+    if (m_path.isEmpty()) {
+        return;
+    }
+
+    QSaveFile file(m_path + QLatin1String("/tokens.dat"));
+    if (!file.open(QIODevice::WriteOnly)) {
+        qCWarning(general) << "Could not save the avatar tokens" << file.fileName() << file.errorString();
+        return;
+    }
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_0);
+    stream << fileVersion << m_tokens;
+
+    if (!file.commit()) {
+        qCWarning(general) << "Could not save the avatar tokens" << file.fileName() << file.errorString();
+    }
+}
+
+QString AvatarCache::token(const QString &jid) const
+{
+    return m_tokens.value(jid);
+}
+
+bool AvatarCache::setToken(const QString &jid, const QString &token)
+{
+    auto it = m_tokens.find(jid);
+    if (it == m_tokens.end()) {
+        if (token.isEmpty()) {
+            return false;
+        }
+        m_tokens.insert(jid, token);
+    } else {
+        if (it.value() == token) {
+            return false;
+        }
+        if (token.isEmpty()) {
+            m_tokens.erase(it);
+        } else {
+            it.value() = token;
+        }
+    }
+
+    scheduleSave();
+    return true;
+}
+
+bool AvatarCache::contains(const QString &token) const
+{
+    return isValidToken(token) && !m_path.isEmpty() && QFile::exists(fileName(token));
+}
+
+bool AvatarCache::load(const QString &token, QByteArray *data, QString *mimeType) const
+{
+    if (!isValidToken(token) || m_path.isEmpty()) {
+        return false;
+    }
+
+    QFile file(fileName(token));
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_0);
+
+    quint32 version;
+    stream >> version;
+    if (version != fileVersion) {
+        return false;
+    }
+
+    stream >> *mimeType >> *data;
+    if (stream.status() != QDataStream::Ok) {
+        qCWarning(general) << "Dropping corrupt avatar" << token << "from the cache";
+        file.remove();
+        return false;
+    }
+
+    return true;
+}
+
+QString AvatarCache::store(const QByteArray &data, const QString &mimeType)
+{
+    const QString token = tokenForData(data);
+    store(token, data, mimeType);
+    return token;
+}
+
+bool AvatarCache::store(const QString &token, const QByteArray &data, const QString &mimeType)
+{
+    if (m_path.isEmpty() || !isValidToken(token)) {
+        return false;
+    }
+
+    if (contains(token)) {
+        return true;
+    }
+
+    QSaveFile file(fileName(token));
+    if (!file.open(QIODevice::WriteOnly)) {
+        qCWarning(general) << "Could not store the avatar" << file.fileName() << file.errorString();
+        return false;
+    }
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_0);
+    stream << fileVersion << mimeType << data;
+
+    if (!file.commit()) {
+        qCWarning(general) << "Could not store the avatar" << file.fileName() << file.errorString();
+        return false;
+    }
+
+    return true;
+}
+
+QString AvatarCache::tokenForData(const QByteArray &data)
+{
+    return QString::fromLatin1(QCryptographicHash::hash(data, QCryptographicHash::Sha1).toHex());
+}
+
+bool AvatarCache::isValidToken(const QString &token)
+{
+    /* Tokens come from contacts and end up in file names */
+    if (token.size() != 40) {
+        return false;
+    }
+
+    for (const QChar c : token) {
+        if (!((c >= QLatin1Char('0') && c <= QLatin1Char('9'))
+                || (c >= QLatin1Char('a') && c <= QLatin1Char('f'))
+                || (c >= QLatin1Char('A') && c <= QLatin1Char('F')))) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+QString AvatarCache::fileName(const QString &token) const
+{
+    if (!isValidToken(token)) {
+        return QString();
+    }
+
+    return m_path + QLatin1Char('/') + token;
+}
+
+void AvatarCache::scheduleSave()
+{
+    if (!m_saveTimer.isActive()) {
+        m_saveTimer.start();
+    }
+}
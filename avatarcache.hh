@@ -0,0 +1,63 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef AVATARCACHE_HH
+#define AVATARCACHE_HH
+
+#include <QHash>
+#include <QObject>
+#include <QTimer>
+
+/* Avatars on disk, keyed by their token (the hex encoded SHA-1 hash of the
+ * image data as published), and the last token we have seen for each contact.
+ * Avatars that did not fit our avatar requirements are stored in their
+ * transcoded form under the token of the original.
+ *
+ * Since the token is what contacts advertise in their presence, an avatar
+ * only has to be fetched from the network when its token is not cached. */
+class AvatarCache : public QObject
+{
+    Q_OBJECT
+public:
+    explicit AvatarCache(QObject *parent = nullptr);
+    ~AvatarCache();
+
+    bool open(const QString &path);
+    void save();
+
+    QString token(const QString &jid) const;
+    bool setToken(const QString &jid, const QString &token);
+
+    bool contains(const QString &token) const;
+    bool load(const QString &token, QByteArray *data, QString *mimeType) const;
+    QString store(const QByteArray &data, const QString &mimeType);
+    bool store(const QString &token, const QByteArray &data, const QString &mimeType);
+
+    static QString tokenForData(const QByteArray &data);
+    static bool isValidToken(const QString &token);
+
+private:
+    QString fileName(const QString &token) const;
+    void scheduleSave();
+
+    QString m_path;
+    QHash<QString, QString> m_tokens;
+    QTimer m_saveTimer;
+};
+
+#endif // AVATARCACHE_HH
@@ -0,0 +1,205 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#include "avatartranscoder.hh"
+#include "common.hh"
+
+#include <QBuffer>
+#include <QElapsedTimer>
+#include <QImage>
+#include <QImageReader>
+#include <QImageWriter>
+#include <QRunnable>
+
+/* Refuse to decode anything larger, no matter how small the file is */
+static const qint64 maxSourcePixels = 64 * 1024 * 1024;
+static const int jpegQualities[] = { 90, 75, 50 };
+
+class AvatarTranscodeTask : public QRunnable
+{
+public:
+    AvatarTranscodeTask(AvatarTranscoder *transcoder, const QString &sourceToken, const QByteArray &data, const QString &mimeType) :
+        m_transcoder(transcoder),
+        m_sourceToken(sourceToken),
+        m_data(data),
+        m_mimeType(mimeType)
+    {
+    }
+
+    void run() override
+    {
+        QElapsedTimer timer;
+        timer.start();
+
+        QByteArray result;
+        QString resultMimeType;
+        const bool success = AvatarTranscoder::convert(m_data, m_mimeType, &result, &resultMimeType);
+
+        qCDebug(metrics) << "avatar transcoding:" << m_data.size() << "->" << result.size() << "bytes in" << timer.elapsed() << "ms";
+
+        QMetaObject::invokeMethod(m_transcoder, "onJobFinished", Qt::QueuedConnection,
+                                  Q_ARG(QString, m_sourceToken), Q_ARG(QByteArray, result),
+                                  Q_ARG(QString, resultMimeType), Q_ARG(bool, success));
+    }
+
+private:
+    AvatarTranscoder *m_transcoder;
+    QString m_sourceToken;
+    QByteArray m_data;
+    QString m_mimeType;
+};
+
+AvatarTranscoder::AvatarTranscoder(QObject *parent) :
+    QObject(parent)
+{
+    m_pool.setMaxThreadCount(2);
+}
+
+AvatarTranscoder::~AvatarTranscoder()
+{
+    m_pool.clear();
+    m_pool.waitForDone();
+}
+
+void AvatarTranscoder::transcode(const QString &sourceToken, const QByteArray &data, const QString &mimeType)
+{
+    if (m_pending.contains(sourceToken)) {
+        return;
+    }
+
+    m_pending.insert(sourceToken);
+    m_pool.start(new AvatarTranscodeTask(this, sourceToken, data, mimeType));
+}
+
+bool AvatarTranscoder::isPending(const QString &sourceToken) const
+{
+    return m_pending.contains(sourceToken);
+}
+
+bool AvatarTranscoder::convert(const QByteArray &data, const QString &mimeType, QByteArray *result, QString *resultMimeType)
+{
+    const Tp::AvatarSpec spec = Common::getAvatarSpec();
+
+    QBuffer buffer;
+    buffer.setData(data);
+    buffer.open(QIODevice::ReadOnly);
+
+    QImageReader reader(&buffer);
+    reader.setDecideFormatFromContent(true);
+
+    const QSize size = reader.size();
+    if (!size.isValid()) {
+        qCWarning(general) << "Could not read the avatar header:" << reader.errorString();
+        return false;
+    }
+
+    if (qint64(size.width()) * size.height() > maxSourcePixels) {
+        qCWarning(general) << "Refusing to decode an avatar of" << size;
+        return false;
+    }
+
+    const QByteArray format = reader.format();
+    QString sourceMimeType = mimeType;
+    if (format == "png") {
+        sourceMimeType = QStringLiteral("image/png");
+    } else if (format == "jpeg") {
+        sourceMimeType = QStringLiteral("image/jpeg");
+    }
+
+    const bool fits = spec.supportedMimeTypes().contains(sourceMimeType)
+            && (!spec.maximumBytes() || uint(data.size()) <= spec.maximumBytes())
+            && (!spec.maximumWidth() || uint(size.width()) <= spec.maximumWidth())
+            && (!spec.maximumHeight() || uint(size.height()) <= spec.maximumHeight());
+    if (fits) {
+        *result = data;
+        *resultMimeType = sourceMimeType;
+        return true;
+    }
+
+    /* Anything that is too large is brought down to the recommended size,
+     * which lets the JPEG decoder skip most of the work */
+    QSize targetSize = size;
+    if ((spec.maximumWidth() && uint(size.width()) > spec.maximumWidth())
+            || (spec.maximumHeight() && uint(size.height()) > spec.maximumHeight())) {
+        targetSize.scale(spec.recommendedWidth(), spec.recommendedHeight(), Qt::KeepAspectRatio);
+        reader.setScaledSize(targetSize);
+    }
+
+    QImage image = reader.read();
+    if (image.isNull()) {
+        qCWarning(general) << "Could not decode the avatar:" << reader.errorString();
+        return false;
+    }
+
+    if (image.size() != targetSize) {
+        image = image.scaled(targetSize, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+    }
+
+    const bool usePng = image.hasAlphaChannel();
+
+    while (!image.isNull()) {
+        if (usePng) {
+            QBuffer output(result);
+            output.open(QIODevice::WriteOnly | QIODevice::Truncate);
+            QImageWriter writer(&output, "png");
+            if (!writer.write(image)) {
+                return false;
+            }
+            *resultMimeType = QStringLiteral("image/png");
+
+            if (!spec.maximumBytes() || uint(result->size()) <= spec.maximumBytes()) {
+                return true;
+            }
+        } else {
+            for (int quality : jpegQualities) {
+                QBuffer output(result);
+                output.open(QIODevice::WriteOnly | QIODevice::Truncate);
+                QImageWriter writer(&output, "jpeg");
+                writer.setQuality(quality);
+                if (!writer.write(image)) {
+                    return false;
+                }
+                *resultMimeType = QStringLiteral("image/jpeg");
+
+                if (!spec.maximumBytes() || uint(result->size()) <= spec.maximumBytes()) {
+                    return true;
+                }
+            }
+        }
+
+        if (image.width() <= 1 && image.height() <= 1) {
+            break;
+        }
+
+        /* Still too large, try again with half the size */
+        image = image.scaled(image.size() / 2, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+    }
+
+    return false;
+}
+
+void AvatarTranscoder::onJobFinished(const QString &sourceToken, const QByteArray &data, const QString &mimeType, bool success)
+{
+    m_pending.remove(sourceToken);
+
+    if (success) {
+        emit finished(sourceToken, data, mimeType);
+    } else {
+        emit failed(sourceToken);
+    }
+}
@@ -0,0 +1,57 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef AVATARTRANSCODER_HH
+#define AVATARTRANSCODER_HH
+
+#include <QObject>
+#include <QSet>
+#include <QThreadPool>
+
+/* Brings avatars in line with Common::getAvatarSpec() on worker threads.
+ *
+ * Avatars that already fit are handed back untouched after only looking at
+ * the image header. Others are decoded at a reduced size where the format
+ * allows it and encoded as PNG (with alpha channel) or JPEG. Jobs are keyed
+ * by the token of the source image, so the same image is never transcoded
+ * twice at a time. */
+class AvatarTranscoder : public QObject
+{
+    Q_OBJECT
+public:
+    explicit AvatarTranscoder(QObject *parent = nullptr);
+    ~AvatarTranscoder();
+
+    void transcode(const QString &sourceToken, const QByteArray &data, const QString &mimeType);
+    bool isPending(const QString &sourceToken) const;
+
+    static bool convert(const QByteArray &data, const QString &mimeType, QByteArray *result, QString *resultMimeType);
+
+signals:
+    void finished(const QString &sourceToken, const QByteArray &data, const QString &mimeType);
+    void failed(const QString &sourceToken);
+
+private slots:
+    void onJobFinished(const QString &sourceToken, const QByteArray &data, const QString &mimeType, bool success);
+
+private:
+    QThreadPool m_pool;
+    QSet<QString> m_pending;
+};
+
+#endif // AVATARTRANSCODER_HH
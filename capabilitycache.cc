@@ -0,0 +1,96 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#include "capabilitycache.hh"
+#include "common.hh"
+
+/* Queries that take longer than this have most probably timed out, the next
+ * resource advertising the same verification string asks again */
+static const int waiterTimeout = 60 * 1000;
+
+CapabilityCache::CapabilityCache(ChannelClassesFunction channelClasses) :
+    m_channelClasses(channelClasses)
+{
+}
+
+CapabilitySetPtr CapabilityCache::find(const QByteArray &ver) const
+{
+    if (ver.isEmpty()) {
+        return CapabilitySetPtr();
+    }
+
+    return m_versions.value(ver);
+}
+
+CapabilitySetPtr CapabilityCache::intern(const QStringList &features, const QString &clientType)
+{
+    QStringList sortedFeatures = features;
+    sortedFeatures.sort();
+    sortedFeatures.removeDuplicates();
+
+    const QString key = clientType + QLatin1Char('\n') + sortedFeatures.join(QLatin1Char('\n'));
+    const auto it = m_sets.constFind(key);
+    if (it != m_sets.constEnd()) {
+        return it.value();
+    }
+
+    QSharedPointer<CapabilitySet> capabilities(new CapabilitySet);
+    capabilities->features = sortedFeatures;
+    capabilities->clientType = clientType;
+    capabilities->channelClasses = m_channelClasses(sortedFeatures);
+    m_sets.insert(key, capabilities);
+
+    qCDebug(metrics) << "Interned capability set" << m_sets.count() << "for client type" << clientType;
+    return capabilities;
+}
+
+void CapabilityCache::insert(const QByteArray &ver, const CapabilitySetPtr &capabilities)
+{
+    if (!ver.isEmpty()) {
+        m_versions.insert(ver, capabilities);
+    }
+}
+
+bool CapabilityCache::addWaiter(const QByteArray &ver, const QString &jid)
+{
+    if (ver.isEmpty()) {
+        return true;
+    }
+
+    Waiters &waiters = m_waiters[ver];
+    const bool query = waiters.jids.isEmpty() || waiters.since.hasExpired(waiterTimeout);
+    if (query) {
+        waiters.since.start();
+    }
+
+    if (!waiters.jids.contains(jid)) {
+        waiters.jids.append(jid);
+    }
+
+    return query;
+}
+
+QStringList CapabilityCache::takeWaiters(const QByteArray &ver)
+{
+    return m_waiters.take(ver).jids;
+}
+
+void CapabilityCache::clearWaiters()
+{
+    m_waiters.clear();
+}
@@ -0,0 +1,75 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef CAPABILITYCACHE_HH
+#define CAPABILITYCACHE_HH
+
+#include <QElapsedTimer>
+#include <QHash>
+#include <QSharedPointer>
+#include <QStringList>
+
+#include <TelepathyQt/Types>
+
+/* What a client can do, as told by service discovery. Instances are shared by
+ * all resources running the same client and never change. */
+struct CapabilitySet
+{
+    QStringList features;
+    QString clientType;
+    Tp::RequestableChannelClassList channelClasses;
+};
+
+typedef QSharedPointer<const CapabilitySet> CapabilitySetPtr;
+
+/* Capability sets interned by content and by the verification string
+ * contacts advertise in their presence (XEP-0115), so that service discovery
+ * is only needed once per distinct client and the channel classes are only
+ * derived once per distinct feature set.
+ *
+ * While a query for a verification string is in flight, other resources
+ * advertising it wait for its result instead of querying themselves. */
+class CapabilityCache
+{
+public:
+    typedef Tp::RequestableChannelClassList (*ChannelClassesFunction)(const QStringList &features);
+
+    explicit CapabilityCache(ChannelClassesFunction channelClasses);
+
+    CapabilitySetPtr find(const QByteArray &ver) const;
+    CapabilitySetPtr intern(const QStringList &features, const QString &clientType);
+    void insert(const QByteArray &ver, const CapabilitySetPtr &capabilities);
+
+    /* Returns whether a query has to be sent for the verification string */
+    bool addWaiter(const QByteArray &ver, const QString &jid);
+    QStringList takeWaiters(const QByteArray &ver);
+    void clearWaiters();
+
+private:
+    struct Waiters {
+        QStringList jids;
+        QElapsedTimer since;
+    };
+
+    ChannelClassesFunction m_channelClasses;
+    QHash<QString, CapabilitySetPtr> m_sets;
+    QHash<QByteArray, CapabilitySetPtr> m_versions;
+    QHash<QByteArray, Waiters> m_waiters;
+};
+
+#endif // CAPABILITYCACHE_HH
@@ -0,0 +1,128 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#include "chatstatethrottle.hh"
+
+/* Minimum time between two notifications */
+static const qint64 minimumInterval = 2000;
+/* Composing without any keystroke turns into paused after this time */
+static const qint64 pausedTimeout = 10000;
+/* Active or paused without any activity turns into inactive after this time */
+static const qint64 inactiveTimeout = 120000;
+
+ChatStateThrottle::ChatStateThrottle(QObject *parent) :
+    QObject(parent),
+    m_sentState(QXmppMessage::None),
+    m_pendingState(QXmppMessage::None)
+{
+    m_timer.setSingleShot(true);
+    connect(&m_timer, &QTimer::timeout, this, &ChatStateThrottle::onTimeout);
+}
+
+void ChatStateThrottle::setState(QXmppMessage::State state)
+{
+    m_lastActivity.start();
+
+    if (state == QXmppMessage::Gone) {
+        /* The conversation is over, do not hold this one back */
+        m_pendingState = QXmppMessage::None;
+        m_timer.stop();
+        if (m_sentState != QXmppMessage::Gone) {
+            send(state);
+        }
+        return;
+    }
+
+    if (state == m_sentState) {
+        m_pendingState = QXmppMessage::None;
+    } else if (!m_lastSent.isValid() || m_lastSent.elapsed() >= minimumInterval) {
+        m_pendingState = QXmppMessage::None;
+        send(state);
+    } else {
+        m_pendingState = state;
+    }
+
+    arm();
+}
+
+void ChatStateThrottle::messageSent()
+{
+    /* The message carries <active/> */
+    m_pendingState = QXmppMessage::None;
+    m_sentState = QXmppMessage::Active;
+    m_lastSent.start();
+    m_lastActivity.start();
+
+    arm();
+}
+
+QXmppMessage::State ChatStateThrottle::sentState() const
+{
+    return m_sentState;
+}
+
+void ChatStateThrottle::onTimeout()
+{
+    if (m_pendingState != QXmppMessage::None) {
+        if (m_lastSent.elapsed() >= minimumInterval) {
+            send(m_pendingState);
+            m_pendingState = QXmppMessage::None;
+        }
+    } else if (m_sentState == QXmppMessage::Composing) {
+        if (m_lastActivity.elapsed() >= pausedTimeout) {
+            send(QXmppMessage::Paused);
+        }
+    } else if (m_sentState == QXmppMessage::Active || m_sentState == QXmppMessage::Paused) {
+        if (m_lastActivity.elapsed() >= inactiveTimeout) {
+            send(QXmppMessage::Inactive);
+        }
+    }
+
+    arm();
+}
+
+void ChatStateThrottle::send(QXmppMessage::State state)
+{
+    m_sentState = state;
+    m_lastSent.start();
+    emit sendState(state);
+}
+
+void ChatStateThrottle::arm()
+{
+    qint64 remaining;
+    if (m_pendingState != QXmppMessage::None) {
+        remaining = minimumInterval - m_lastSent.elapsed();
+    } else if (m_sentState == QXmppMessage::Composing) {
+        remaining = pausedTimeout - m_lastActivity.elapsed();
+    } else if (m_sentState == QXmppMessage::Active || m_sentState == QXmppMessage::Paused) {
+        remaining = inactiveTimeout - m_lastActivity.elapsed();
+    } else {
+        m_timer.stop();
+        return;
+    }
+
+    remaining = qMax<qint64>(remaining, 0);
+
+    /* A timer that fires too early is cheaper than restarting it on every keystroke */
+    if (m_timer.isActive() && m_timer.remainingTime() <= remaining) {
+        return;
+    }
+
+    m_timer.start(remaining);
+}
@@ -0,0 +1,62 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef CHATSTATETHROTTLE_HH
+#define CHATSTATETHROTTLE_HH
+
+#include <QElapsedTimer>
+#include <QObject>
+#include <QTimer>
+
+#include <QXmppMessage.h>
+
+/* Outgoing chat state notifications (XEP-0085) of one conversation.
+ *
+ * Clients report a state on every keystroke. Repeats are dropped, changes
+ * are sent at most once per interval (only the latest one survives) and
+ * the state decays to paused and then inactive on its own. Keystrokes only
+ * record a timestamp; the single timer re-arms itself when it fires early. */
+class ChatStateThrottle : public QObject
+{
+    Q_OBJECT
+public:
+    explicit ChatStateThrottle(QObject *parent = nullptr);
+
+    void setState(QXmppMessage::State state);
+    void messageSent();
+
+    QXmppMessage::State sentState() const;
+
+signals:
+    void sendState(QXmppMessage::State state);
+
+private slots:
+    void onTimeout();
+
+private:
+    void send(QXmppMessage::State state);
+    void arm();
+
+    QXmppMessage::State m_sentState;
+    QXmppMessage::State m_pendingState;
+    QElapsedTimer m_lastSent;
+    QElapsedTimer m_lastActivity;
+    QTimer m_timer;
+};
+
+#endif // CHATSTATETHROTTLE_HH
@@ -18,10 +18,18 @@
 
 #include "common.hh"
 
+#include <QDir>
+#include <QStandardPaths>
+
+#include <TelepathyQt/Utils>
+
+#include <limits>
+
 Q_LOGGING_CATEGORY(qxmppGeneric, "qxmpp.generic")
 Q_LOGGING_CATEGORY(qxmppStanza, "qxmpp.stanza")
 Q_LOGGING_CATEGORY(general, "nonsense.general")
 Q_LOGGING_CATEGORY(tracing, "nonsense.tracing")
+Q_LOGGING_CATEGORY(metrics, "nonsense.metrics")
 
 Tp::SimpleStatusSpecMap Common::getSimpleStatusSpecMap()
 {
@@ -88,3 +96,59 @@ Tp::AvatarSpec Common::getAvatarSpec()
                           256 /* recommendedWidth */,
                           1024 * 1024 /* maxBytes */);
 }
+
+QString Common::accountDataPath(const QString &account)
+{
+    const QString path = QStandardPaths::writableLocation(QStandardPaths::GenericDataLocation)
+            + QLatin1String("/telepathy-nonsense/")
+            + Tp::escapeAsIdentifier(account);
+
+    /* Make sure that the directory exists so that callers can open files right away */
+    QDir().mkpath(path);
+    return path;
+}
+
+Tp::SimplePresence Common::toTpPresence(const QXmppPresence &presence)
+{
+    Tp::SimplePresence tpPresence;
+    tpPresence.statusMessage = presence.statusText();
+    if (presence.type() == QXmppPresence::Available) {
+        switch (presence.availableStatusType()) {
+        case QXmppPresence::Online:
+            tpPresence.type = Tp::ConnectionPresenceTypeAvailable;
+            tpPresence.status = QStringLiteral("available");
+            break;
+        case QXmppPresence::Away:
+            tpPresence.type = Tp::ConnectionPresenceTypeAway;
+            tpPresence.status = QStringLiteral("away");
+            break;
+        case QXmppPresence::XA:
+            tpPresence.type = Tp::ConnectionPresenceTypeExtendedAway;
+            tpPresence.status = QStringLiteral("xa");
+            break;
+        case QXmppPresence::DND:
+            tpPresence.type = Tp::ConnectionPresenceTypeBusy;
+            tpPresence.status = QStringLiteral("dnd");
+            break;
+        case QXmppPresence::Chat:
+            tpPresence.type = Tp::ConnectionPresenceTypeAvailable;
+            tpPresence.status = QStringLiteral("chat");
+            break;
+        case QXmppPresence::Invisible:
+            tpPresence.type = Tp::ConnectionPresenceTypeHidden;
+            tpPresence.status = QStringLiteral("hidden");
+            break;
+        }
+    } else {
+        tpPresence.type = Tp::ConnectionPresenceTypeOffline;
+        tpPresence.status = QStringLiteral("offline");
+    }
+
+    return tpPresence;
+}
+
+int Common::clampLimit(uint limit)
+{
+    /* D-Bus hands out unsigned limits, the stores count with int */
+    return int(qMin<uint>(limit, std::numeric_limits<int>::max()));
+}
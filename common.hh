@@ -22,10 +22,13 @@
 #include <QLoggingCategory>
 #include <TelepathyQt/ProtocolInterface>
 
+#include <QXmppPresence.h>
+
 Q_DECLARE_LOGGING_CATEGORY(qxmppGeneric)
 Q_DECLARE_LOGGING_CATEGORY(qxmppStanza)
 Q_DECLARE_LOGGING_CATEGORY(general)
 Q_DECLARE_LOGGING_CATEGORY(tracing)
+Q_DECLARE_LOGGING_CATEGORY(metrics)
 
 #define DBG qCDebug(tracing) << "ENTERING " << Q_FUNC_INFO
 
@@ -33,6 +36,9 @@ class Common {
 public:
     static Tp::SimpleStatusSpecMap getSimpleStatusSpecMap();
     static Tp::AvatarSpec getAvatarSpec();
+    static QString accountDataPath(const QString &account);
+    static Tp::SimplePresence toTpPresence(const QXmppPresence &presence);
+    static int clampLimit(uint limit);
 };
 
 #endif // COMMON_HH
@@ -17,6 +17,8 @@
  * License along with this library; if not, see <http://www.gnu.org/licenses/>
  */
 
+#include <QCryptographicHash>
+
 #include <QXmppRosterManager.h>
 #include <QXmppVCardManager.h>
 #include <QXmppVersionManager.h>
@@ -28,9 +30,15 @@
 #include "connection.hh"
 #include "muctextchannel.hh"
 #include "filetransferchannel.hh"
+#include "messagearchivesync.hh"
+#include "messageparts.hh"
+#include "pepavatarmanager.hh"
+#include "proxyprober.hh"
 #include "common.hh"
 #include "telepathy-nonsense-config.h"
 
+#include <algorithm>
+
 Tp::RequestableChannelClass createRequestableChannelClassText()
 {
     Tp::RequestableChannelClass text;
@@ -73,8 +81,27 @@ static const Tp::RequestableChannelClass requestableChannelClassText = createReq
 static const Tp::RequestableChannelClass requestableChannelClassGroupChat = createRequestableChannelClassGroupChat();
 static const Tp::RequestableChannelClass requestableChannelClassFileTransfer = createRequestableChannelClassFileTransfer();
 
+/* Text channels are supported by everyone */
+static const Tp::RequestableChannelClassList textOnlyChannelClasses = Tp::RequestableChannelClassList() << requestableChannelClassText;
+
+static Tp::RequestableChannelClassList channelClassesForFeatures(const QStringList &features)
+{
+    Tp::RequestableChannelClassList channelClasses = textOnlyChannelClasses;
+    if (features.contains(QStringLiteral("http://jabber.org/protocol/si/profile/file-transfer"))) {
+        channelClasses << requestableChannelClassFileTransfer;
+    }
+
+    return channelClasses;
+}
+
+/* Roster pushes arriving within this interval are announced together */
+static const int rosterPushDelay = 100;
+
+/* Capability changes arriving within this interval are announced together */
+static const int capabilityChangeDelay = 100;
+
 Connection::Connection(const QDBusConnection &dbusConnection, const QString &cmName, const QString &protocolName, const QVariantMap &parameters) :
-    Tp::BaseConnection(dbusConnection, cmName, protocolName, parameters), m_client (0)
+    Tp::BaseConnection(dbusConnection, cmName, protocolName, parameters), m_client (0), m_archiveSync(nullptr), m_outboundQueue(nullptr), m_rosterMutations(nullptr), m_iqScheduler(nullptr), m_pepAvatarManager(nullptr), m_proxyProber(nullptr), m_pendingMessageLimit(0), m_contactStates(m_uniqueContactHandleMap), m_capabilityCache(channelClassesForFeatures), m_serviceDirectory(this)
 {
     DBG;
 
@@ -112,6 +139,14 @@ Connection::Connection(const QDBusConnection &dbusConnection, const QString &cmN
     m_contactListIface->setUnpublishCallback(Tp::memFun(this, &Connection::unpublish));
     plugInterface(Tp::AbstractConnectionInterfacePtr::dynamicCast(m_contactListIface));
 
+    m_rosterPushTimer.setSingleShot(true);
+    m_rosterPushTimer.setInterval(rosterPushDelay);
+    connect(&m_rosterPushTimer, &QTimer::timeout, this, &Connection::flushRosterPushes);
+
+    m_capabilityTimer.setSingleShot(true);
+    m_capabilityTimer.setInterval(capabilityChangeDelay);
+    connect(&m_capabilityTimer, &QTimer::timeout, this, &Connection::flushCapabilityChanges);
+
     /* Connection.Interface.ContactGroups */
     m_contactGroupsIface = Tp::BaseConnectionContactGroupsInterface::create();
     m_contactGroupsIface->setDisjointGroups(false);
@@ -156,6 +191,10 @@ Connection::Connection(const QDBusConnection &dbusConnection, const QString &cmN
     m_requestsIface->requestableChannelClasses << requestableChannelClassFileTransfer;
     plugInterface(Tp::AbstractConnectionInterfacePtr::dynamicCast(m_requestsIface));
 
+    /* Connection.Interface.Nonsense.Search */
+    m_searchIface = SearchInterface::create(this);
+    plugInterface(Tp::AbstractConnectionInterfacePtr::dynamicCast(m_searchIface));
+
     QString myJid = parameters.value(QStringLiteral("account")).toString();
     QString server = parameters.value(QStringLiteral("server")).toString();
     QString resource = parameters.value(QStringLiteral("resource")).toString();
@@ -166,6 +205,7 @@ Connection::Connection(const QDBusConnection &dbusConnection, const QString &cmN
     uint priority = parameters.value(QStringLiteral("priority")).toUInt();
     bool requireEncryption = parameters.value(QStringLiteral("require-encryption")).toBool();
     bool ignoreSslErrors = parameters.value(QStringLiteral("ignore-ssl-errors")).toBool();
+    m_pendingMessageLimit = parameters.value(QStringLiteral("pending-message-limit"), 500u).toUInt();
     m_clientConfig.setJid(myJid);
     if (!server.isEmpty()) {
         m_clientConfig.setHost(server);
@@ -182,6 +222,17 @@ Connection::Connection(const QDBusConnection &dbusConnection, const QString &cmN
     m_clientPresence.setPriority(priority);
     setSelfContact(m_uniqueContactHandleMap[myJid], myJid);
 
+    m_messageStore.open(Common::accountDataPath(m_clientConfig.jidBare()) + QLatin1String("/messages.log"));
+    m_searchIndex.open(Common::accountDataPath(m_clientConfig.jidBare()) + QLatin1String("/search"));
+    m_deliveryTracker.open(Common::accountDataPath(m_clientConfig.jidBare()) + QLatin1String("/delivery.dat"));
+    m_avatarCache.open(Common::accountDataPath(m_clientConfig.jidBare()) + QLatin1String("/avatars"));
+    m_serviceDirectory.open(Common::accountDataPath(m_clientConfig.jidBare()) + QLatin1String("/services.dat"), m_clientConfig.domain());
+    connect(&m_deliveryTracker, &DeliveryTracker::resendMessage, this, &Connection::onResendMessage);
+    connect(&m_deliveryTracker, &DeliveryTracker::deliveryFailed, this, &Connection::onDeliveryFailed);
+    connect(&m_avatarTranscoder, &AvatarTranscoder::finished, this, &Connection::onAvatarTranscoded);
+    connect(&m_avatarTranscoder, &AvatarTranscoder::failed, this, &Connection::onAvatarTranscodingFailed);
+    connect(&m_serviceDirectory, &ServiceDirectory::servicesChanged, this, &Connection::onServicesChanged);
+
     setConnectCallback(Tp::memFun(this, &Connection::doConnect));
     setInspectHandlesCallback(Tp::memFun(this, &Connection::inspectHandles));
     setCreateChannelCallback(Tp::memFun(this, &Connection::createChannelCB));
@@ -238,6 +289,7 @@ void Connection::doConnect(Tp::DBusError *error)
     QXmppTransferManager *transferManager = new QXmppTransferManager;
     m_client->addExtension(transferManager);
     connect(transferManager, &QXmppTransferManager::fileReceived, this, &Connection::onFileReceived);
+    connect(transferManager, &QXmppTransferManager::jobFinished, this, &Connection::onTransferJobFinished);
 
 #if QXMPP_VERSION >= 0x000905
     m_carbonManager = new QXmppCarbonManager;
@@ -246,9 +298,36 @@ void Connection::doConnect(Tp::DBusError *error)
     connect(m_carbonManager, &QXmppCarbonManager::messageSent, this, &Connection::onCarbonMessageSent);
 #endif
 
+    /* Has to see IQ results before the extensions that consume them */
+    m_iqScheduler = new IqScheduler(this);
+    m_client->insertExtension(0, m_iqScheduler);
+    connect(m_iqScheduler, &IqScheduler::timedOut, &m_serviceDirectory, &ServiceDirectory::handleFailure);
+    connect(m_iqScheduler, &IqScheduler::errorReceived, &m_serviceDirectory, &ServiceDirectory::handleFailure);
+
+    /* Has to see the streamhost replies before the transfer manager */
+    m_proxyProber = new ProxyProber(this);
+    m_client->insertExtension(1, m_proxyProber);
+    connect(m_iqScheduler, &IqScheduler::timedOut, m_proxyProber, &ProxyProber::handleFailure);
+    connect(m_proxyProber, &ProxyProber::bestProxyChanged, this, &Connection::onBestProxyChanged);
+
+    m_pepAvatarManager = new PepAvatarManager(this);
+    m_client->addExtension(m_pepAvatarManager);
+    connect(m_iqScheduler, &IqScheduler::timedOut, m_pepAvatarManager, &PepAvatarManager::handleTimeout);
+    connect(m_pepAvatarManager, &PepAvatarManager::metadataReceived, this, &Connection::updateAvatarToken);
+    connect(m_pepAvatarManager, &PepAvatarManager::dataReceived, this, &Connection::onPepAvatarReceived);
+    connect(m_pepAvatarManager, &PepAvatarManager::dataFailed, this, &Connection::requestVCard);
+
+    m_outboundQueue = new OutboundQueue(m_client, this);
+
+    m_rosterMutations = new RosterMutationEngine(this, m_client, this);
+    connect(m_rosterMutations, &RosterMutationEngine::batchFinished, this, &Connection::onRosterBatchFinished);
+
+    m_archiveSync = new MessageArchiveSync(m_client, Common::accountDataPath(m_clientConfig.jidBare()) + QLatin1String("/state.ini"), this);
+    connect(m_archiveSync, &MessageArchiveSync::messagesReceived, this, &Connection::onArchivedMessagesReceived);
+
     /* The features for ourself must only be added after adding all QXmpp
      * extensions - we would miss features otherwise */
-    m_contactsFeatures[m_clientConfig.jid()] = m_discoveryManager->capabilities().features();
+    m_ownCapabilities = m_capabilityCache.intern(m_discoveryManager->capabilities().features(), m_discoveryManager->clientType());
 
     connect(m_client, &QXmppClient::connected, this, &Connection::onConnected);
     connect(m_client, &QXmppClient::error, this, &Connection::onError);
@@ -256,6 +335,9 @@ void Connection::doConnect(Tp::DBusError *error)
     connect(m_client, &QXmppClient::presenceReceived, this, &Connection::onPresenceReceived);
 
     connect(&m_client->rosterManager(), &QXmppRosterManager::rosterReceived, this, &Connection::onRosterReceived);
+    connect(&m_client->rosterManager(), &QXmppRosterManager::itemAdded, this, &Connection::onRosterItemChanged);
+    connect(&m_client->rosterManager(), &QXmppRosterManager::itemChanged, this, &Connection::onRosterItemChanged);
+    connect(&m_client->rosterManager(), &QXmppRosterManager::itemRemoved, this, &Connection::onRosterItemRemoved);
 
     connect(&m_client->vCardManager(), &QXmppVCardManager::vCardReceived, this, &Connection::onVCardReceived);
     connect(&m_client->vCardManager(), &QXmppVCardManager::clientVCardReceived, this, &Connection::onClientVCardReceived);
@@ -302,6 +384,26 @@ void Connection::doDisconnect()
 {
     DBG;
 
+    if (m_archiveSync) {
+        m_archiveSync->saveState();
+    }
+    m_deliveryTracker.setActive(false);
+    m_deliveryTracker.save();
+    m_avatarCache.save();
+    m_searchIndex.flush();
+    m_outboundQueue->clear();
+    m_rosterMutations->clear();
+    m_groupIndex.clear();
+    clearRosterPushes();
+    m_pepAvatarManager->clear();
+    m_proxyProber->clear();
+    m_iqScheduler->clear();
+    m_contactStates.clear();
+    m_capabilityCache.clearWaiters();
+    m_capabilityChanges.clear();
+    m_capabilityTimer.stop();
+    m_serviceDirectory.stop();
+
     m_client->disconnectFromServer();
     setStatus(Tp::ConnectionStatusDisconnected, Tp::ConnectionStatusReasonRequested);
 }
@@ -314,27 +416,48 @@ void Connection::onConnected()
     m_saslIface->setSaslStatus(Tp::SASLStatusSucceeded, QLatin1String("Succeeded"), QVariantMap());
 
     Tp::SimpleContactPresences presences;
-    QMap<QString, QXmppPresence> clientPresence;
-    clientPresence.insert(m_clientConfig.jidBare(), m_client->clientPresence());
-    presences[selfHandle()] = toTpPresence(clientPresence);
+    presences[selfHandle()] = Common::toTpPresence(m_client->clientPresence());
     m_simplePresenceIface->setPresences(presences);
 
     m_contactListIface->setContactListState(Tp::ContactListStateWaiting);
     m_clientPresence = m_client->clientPresence();
     m_client->vCardManager().requestClientVCard();
     if (m_clientPresence.vCardUpdateType() == QXmppPresence::VCardUpdateValidPhoto) {
-        m_avatarTokens[m_uniqueContactHandleMap[selfHandle()]] = QString::fromLatin1(m_clientPresence.photoHash());
+        m_avatarCache.setToken(m_clientConfig.jidBare(), QString::fromLatin1(m_clientPresence.photoHash().toHex()));
     }
 
-    m_discoveryManager->requestInfo(m_clientConfig.domain());
-    m_serverEntities.push_back(m_clientConfig.domain());
-    m_discoveryManager->requestItems(m_clientConfig.domain());
+    m_deliveryTracker.setActive(true);
+
+    /* The services of the server are known from the last login, the
+     * directory only crawls them again once they are out of date */
+    requestDiscoveryInfo(m_clientConfig.domain(), QString(), IqScheduler::Interactive);
+    onServicesChanged();
+    m_serviceDirectory.refresh();
+
+    /* The message archive (XEP-0313) is advertised by the account itself */
+    if (MessageArchiveSync::isSupported()) {
+        requestDiscoveryInfo(m_clientConfig.jidBare(), QString(), IqScheduler::Interactive);
+    }
 }
 
 void Connection::onError(QXmppClient::Error error)
 {
     DBG;
 
+    m_deliveryTracker.setActive(false);
+    m_outboundQueue->clear();
+    m_rosterMutations->clear();
+    m_groupIndex.clear();
+    clearRosterPushes();
+    m_pepAvatarManager->clear();
+    m_proxyProber->clear();
+    m_iqScheduler->clear();
+    m_contactStates.clear();
+    m_capabilityCache.clearWaiters();
+    m_capabilityChanges.clear();
+    m_capabilityTimer.stop();
+    m_serviceDirectory.stop();
+
     //TODO
     if (error == QXmppClient::SocketError || error == QXmppClient::KeepAliveError) {
         setStatus(Tp::ConnectionStatusDisconnected, Tp::ConnectionStatusReasonNetworkError);
@@ -372,6 +495,7 @@ void Connection::onRosterReceived()
 {
     DBG;
 
+    clearRosterPushes();
     updateGroups();
     m_contactListIface->setContactListState(Tp::ContactListStateSuccess);
 }
@@ -421,22 +545,37 @@ void Connection::onPresenceReceived(const QXmppPresence &presence)
         jid = presence.from();
         updateMucParticipantInfo(jid, presence);
         // TODO: If presence.mucItem().nick() is not empty, then the presence stanza is "Changing nickname". Look at XEP-0042, section 7.6 for details.
+        updateJidPresence(jid, presence);
+        return;
     }
 
-    updateJidPresence(jid, presence);
+    /* A resource that is not the most available one does not change what we announce */
+    const bool presenceChanged = m_contactStates.updatePresence(jid, QXmppUtils::jidToResource(presence.from()), presence);
+    updateJidPresence(jid, presence, presenceChanged);
 }
 
-void Connection::updateJidPresence(const QString &jid, const QXmppPresence &presence)
+void Connection::updateJidPresence(const QString &jid, const QXmppPresence &presence, bool presenceChanged)
 {
-    QMap<QString, QXmppPresence> receivedPresence;
-    receivedPresence.insert(jid, presence);
+    if (presenceChanged) {
+        /* Room participants are one resource each, contacts are aggregated over all of theirs */
+        const uint handle = m_uniqueContactHandleMap[jid];
+        Tp::SimpleContactPresences presences;
+        presences[handle] = m_contactStates.presence(handle);
+        m_simplePresenceIface->setPresences(presences);
+    }
 
-    Tp::SimpleContactPresences presences;
-    presences[m_uniqueContactHandleMap[jid]] = toTpPresence(receivedPresence);
-    m_simplePresenceIface->setPresences(presences);
+    /* Contacts that publish their avatar via PEP get it announced from there */
+    const bool hasPepAvatar = m_pepAvatarManager && m_pepAvatarManager->hasMetadata(jid);
 
-    if (presence.vCardUpdateType() == QXmppPresence::VCardUpdateValidPhoto) {
-        m_avatarTokens[jid] = QString::fromLatin1(presence.photoHash());
+    switch (hasPepAvatar ? QXmppPresence::VCardUpdateNone : presence.vCardUpdateType()) {
+    case QXmppPresence::VCardUpdateValidPhoto:
+        updateAvatarToken(jid, QString::fromLatin1(presence.photoHash().toHex()));
+        break;
+    case QXmppPresence::VCardUpdateNoPhoto:
+        updateAvatarToken(jid, QString());
+        break;
+    default:
+        break;
     }
 
     qCDebug(general) << "capability hash:" << presence.capabilityHash();
@@ -444,10 +583,17 @@ void Connection::updateJidPresence(const QString &jid, const QXmppPresence &pres
     qCDebug(general) << "capability extensions:" << presence.capabilityExt();
 
     if (!presence.capabilityVer().isEmpty()) {
-//        QString nodeWithVerification = presence.capabilityNode() + QLatin1Char('#') + QString::fromLatin1(presence.capabilityVer().toBase64());
-
-        qCDebug(general) << Q_FUNC_INFO << "Request info from" << presence.from();
-        m_discoveryManager->requestInfo(presence.from());
+        /* Only verification strings we can check are worth caching */
+        const QByteArray ver = presence.capabilityHash() == QLatin1String("sha-1") ? presence.capabilityVer() : QByteArray();
+        const CapabilitySetPtr capabilities = m_capabilityCache.find(ver);
+        if (capabilities) {
+            applyCapabilities(presence.from(), capabilities);
+        } else if (m_capabilityCache.addWaiter(ver, presence.from())) {
+            const QString nodeWithVerification = presence.capabilityNode() + QLatin1Char('#') + QString::fromLatin1(presence.capabilityVer().toBase64());
+
+            qCDebug(general) << Q_FUNC_INFO << "Request info from" << presence.from();
+            requestDiscoveryInfo(presence.from(), nodeWithVerification);
+        }
     }
 }
 
@@ -462,24 +608,23 @@ void Connection::onDiscoveryInfoReceived(const QXmppDiscoveryIq &iq)
     qCDebug(general) << iq.features();
     qCDebug(general).noquote() << iq.verificationString().toBase64();
 
+    m_serviceDirectory.handleInfo(iq);
+
     for (auto &identity : iq.identities()) {
         if (identity.category() == QLatin1String("client")) {
-            m_contactsFeatures[iq.from()] = iq.features();
-            m_clientTypes[iq.from()] = identity.type();
-
-            QString bareJid = QXmppUtils::jidToBareJid(iq.from());
-            uint handle = m_uniqueContactHandleMap[bareJid];
-            if (bareJid + lastResourceForJid(bareJid, /* force */ true) == iq.from()) {
-                Tp::DBusError error;
-                Tp::ContactCapabilitiesMap caps = getContactCapabilities(Tp::UIntList() << handle, &error);
-                m_contactCapabilitiesIface->contactCapabilitiesChanged(caps);
-                m_clientTypesIface->clientTypesUpdated(handle, getClientType(handle));
+            /* The verification string is computed from the result itself, so
+             * it is safe to cache it under that even if it was not asked for */
+            const QByteArray ver = iq.verificationString();
+            const CapabilitySetPtr capabilities = m_capabilityCache.intern(iq.features(), identity.type());
+            m_capabilityCache.insert(ver, capabilities);
+
+            QStringList jids = m_capabilityCache.takeWaiters(ver);
+            if (!jids.contains(iq.from())) {
+                jids.append(iq.from());
             }
-        } else if (identity.category() == QLatin1String("proxy")) {
-            if (identity.type() == QLatin1String("bytestreams") && m_serverEntities.contains(iq.from())) {
-                qCDebug(general) << "Found proxy with JID" << iq.from();
-                QXmppTransferManager *transferManager = m_client->findExtension<QXmppTransferManager>();
-                transferManager->setProxy(iq.from());
+
+            for (const QString &jid : jids) {
+                applyCapabilities(jid, capabilities);
             }
         }
     }
@@ -496,16 +641,32 @@ void Connection::onDiscoveryInfoReceived(const QXmppDiscoveryIq &iq)
         m_carbonManager->setCarbonsEnabled(true);
     }
 #endif
+
+    if (iq.from() == m_clientConfig.jidBare() && iq.features().contains(QStringLiteral("urn:xmpp:mam:2"))) {
+        qCDebug(general) << "Catching up with the message archive";
+        m_archiveSync->start();
+    }
 }
 
 void Connection::onDiscoveryItemsReceived(const QXmppDiscoveryIq &iq)
 {
     DBG;
-    for (auto &item : iq.items()) {
-        if (m_serverEntities.contains(iq.from())) {
-            m_serverEntities.push_back(item.jid());
-            m_discoveryManager->requestInfo(item.jid(), item.node());
-        }
+    m_serviceDirectory.handleItems(iq);
+}
+
+void Connection::onServicesChanged()
+{
+    if (m_proxyProber) {
+        m_proxyProber->setProxies(m_serviceDirectory.services(QStringLiteral("proxy"), QStringLiteral("bytestreams")));
+    }
+}
+
+void Connection::onBestProxyChanged(const QString &jid)
+{
+    QXmppTransferManager *transferManager = m_client ? m_client->findExtension<QXmppTransferManager>() : nullptr;
+    if (transferManager) {
+        qCDebug(general) << "Using proxy with JID" << jid;
+        transferManager->setProxy(jid);
     }
 }
 
@@ -529,12 +690,11 @@ Tp::ContactAttributesMap Connection::getContactAttributes(const Tp::UIntList &ha
     //TODO check
 
     Tp::ContactAttributesMap contactAttributes;
-    QStringList bareJids = m_client->rosterManager().getRosterBareJids();
 
     for (auto handle : handles) {
         QString contactJid = m_uniqueContactHandleMap[handle];
         QXmppRosterIq::Item rosterIq = m_client->rosterManager().getRosterEntry(contactJid);
-        QMap<QString, QXmppPresence> contactPresences;
+        Tp::SimplePresence contactPresence = m_contactStates.presence(handle);
         QVariantMap attributes;
 
         attributes[TP_QT_IFACE_CONNECTION + QLatin1String("/contact-id")] = contactJid;
@@ -556,50 +716,25 @@ Tp::ContactAttributesMap Connection::getContactAttributes(const Tp::UIntList &ha
                 attributes[TP_QT_IFACE_CONNECTION_INTERFACE_CONTACT_LIST + QLatin1String("/publish")] = Tp::SubscriptionStateYes;
             }
 
-            contactPresences.insert(contactJid, m_client->clientPresence());
+            contactPresence = Common::toTpPresence(m_client->clientPresence());
 
             if (m_client && m_client->isConnected()) {
                 if (interfaces.contains(TP_QT_IFACE_CONNECTION_INTERFACE_AVATARS)) {
-                    attributes[TP_QT_IFACE_CONNECTION_INTERFACE_AVATARS + QLatin1String("/token")] = QVariant::fromValue(m_avatarTokens[contactJid]);
+                    attributes[TP_QT_IFACE_CONNECTION_INTERFACE_AVATARS + QLatin1String("/token")] = QVariant::fromValue(m_avatarCache.token(contactJid));
                 }
             }
-        } else if (bareJids.contains(contactJid)) {
+        } else if (!rosterIq.bareJid().isEmpty()) {
             if (interfaces.contains(TP_QT_IFACE_CONNECTION_INTERFACE_CONTACT_LIST)) {
-                switch (rosterIq.subscriptionType()) {
-                case QXmppRosterIq::Item::None:
-                    attributes[TP_QT_IFACE_CONNECTION_INTERFACE_CONTACT_LIST + QLatin1String("/subscribe")] = Tp::SubscriptionStateNo;
-                    attributes[TP_QT_IFACE_CONNECTION_INTERFACE_CONTACT_LIST + QLatin1String("/publish")] = Tp::SubscriptionStateNo;
-                    break;
-                case QXmppRosterIq::Item::From:
-                    attributes[TP_QT_IFACE_CONNECTION_INTERFACE_CONTACT_LIST + QLatin1String("/subscribe")] = Tp::SubscriptionStateNo;
-                    attributes[TP_QT_IFACE_CONNECTION_INTERFACE_CONTACT_LIST + QLatin1String("/publish")] = Tp::SubscriptionStateYes;
-                    break;
-                case QXmppRosterIq::Item::To:
-                    attributes[TP_QT_IFACE_CONNECTION_INTERFACE_CONTACT_LIST + QLatin1String("/subscribe")] = Tp::SubscriptionStateYes;
-                    attributes[TP_QT_IFACE_CONNECTION_INTERFACE_CONTACT_LIST + QLatin1String("/publish")] = Tp::SubscriptionStateNo;
-                    break;
-                case QXmppRosterIq::Item::Both:
-                    attributes[TP_QT_IFACE_CONNECTION_INTERFACE_CONTACT_LIST + QLatin1String("/subscribe")] = Tp::SubscriptionStateYes;
-                    attributes[TP_QT_IFACE_CONNECTION_INTERFACE_CONTACT_LIST + QLatin1String("/publish")] = Tp::SubscriptionStateYes;
-                    break;
-                case QXmppRosterIq::Item::Remove:
-                    break;
-                case QXmppRosterIq::Item::NotSet:
-                    attributes[TP_QT_IFACE_CONNECTION_INTERFACE_CONTACT_LIST + QLatin1String("/subscribe")] = Tp::SubscriptionStateUnknown;
-                    attributes[TP_QT_IFACE_CONNECTION_INTERFACE_CONTACT_LIST + QLatin1String("/publish")] = Tp::SubscriptionStateUnknown;
-                    break;
-                }
+                const Tp::ContactSubscriptions subscriptions = toTpSubscriptions(rosterIq);
+                attributes[TP_QT_IFACE_CONNECTION_INTERFACE_CONTACT_LIST + QLatin1String("/subscribe")] = subscriptions.subscribe;
+                attributes[TP_QT_IFACE_CONNECTION_INTERFACE_CONTACT_LIST + QLatin1String("/publish")] = subscriptions.publish;
             }
 
-            contactPresences = m_client->rosterManager().getAllPresencesForBareJid(contactJid);
-
             if (m_client && m_client->isConnected()) {
                 if (interfaces.contains(TP_QT_IFACE_CONNECTION_INTERFACE_AVATARS)) {
-                    attributes[TP_QT_IFACE_CONNECTION_INTERFACE_AVATARS + QLatin1String("/token")] = QVariant::fromValue(m_avatarTokens[contactJid]);
+                    attributes[TP_QT_IFACE_CONNECTION_INTERFACE_AVATARS + QLatin1String("/token")] = QVariant::fromValue(m_avatarCache.token(contactJid));
                 }
             }
-        } else if (m_mucParticipants.contains(contactJid)) {
-            contactPresences.insert(contactJid, m_mucParticipants.value(contactJid));
         }
 
         if (interfaces.contains(TP_QT_IFACE_CONNECTION_INTERFACE_CONTACT_GROUPS)) {
@@ -608,7 +743,7 @@ Tp::ContactAttributesMap Connection::getContactAttributes(const Tp::UIntList &ha
         }
 
         if (interfaces.contains(TP_QT_IFACE_CONNECTION_INTERFACE_SIMPLE_PRESENCE)) {
-            attributes[TP_QT_IFACE_CONNECTION_INTERFACE_SIMPLE_PRESENCE + QLatin1String("/presence")] = QVariant::fromValue(toTpPresence(contactPresences));
+            attributes[TP_QT_IFACE_CONNECTION_INTERFACE_SIMPLE_PRESENCE + QLatin1String("/presence")] = QVariant::fromValue(contactPresence);
         }
 
         contactAttributes[handle] = attributes;
@@ -616,60 +751,33 @@ Tp::ContactAttributesMap Connection::getContactAttributes(const Tp::UIntList &ha
     return contactAttributes;
 }
 
-Tp::SimplePresence Connection::toTpPresence(QMap<QString, QXmppPresence> presences)
+Tp::ContactSubscriptions Connection::toTpSubscriptions(const QXmppRosterIq::Item &item)
 {
-    QXmppPresence maxPresence(QXmppPresence::Error);
-
-    for (const QXmppPresence &presence : presences) {
-        if (presence.type() == QXmppPresence::Error) {
-            continue;
-        }
-
-        if (maxPresence.type() == QXmppPresence::Error) {
-            maxPresence = presence;
-            continue;
-        }
+    Tp::ContactSubscriptions subscriptions;
+    subscriptions.subscribe = Tp::SubscriptionStateNo;
+    subscriptions.publish = Tp::SubscriptionStateNo;
 
-        if (maxPresence.availableStatusType() > presence.availableStatusType()) {
-            maxPresence = presence;
-        }
-    }
-
-    Tp::SimplePresence tpPresence;
-    tpPresence.statusMessage = maxPresence.statusText();
-    if (maxPresence.type() == QXmppPresence::Available) {
-        switch (maxPresence.availableStatusType()) {
-        case QXmppPresence::Online:
-            tpPresence.type = Tp::ConnectionPresenceTypeAvailable;
-            tpPresence.status = QStringLiteral("available");
-            break;
-        case QXmppPresence::Away:
-            tpPresence.type = Tp::ConnectionPresenceTypeAway;
-            tpPresence.status = QStringLiteral("away");
-            break;
-        case QXmppPresence::XA:
-            tpPresence.type = Tp::ConnectionPresenceTypeExtendedAway;
-            tpPresence.status = QStringLiteral("xa");
-            break;
-        case QXmppPresence::DND:
-            tpPresence.type = Tp::ConnectionPresenceTypeBusy;
-            tpPresence.status = QStringLiteral("dnd");
-            break;
-        case QXmppPresence::Chat:
-            tpPresence.type = Tp::ConnectionPresenceTypeAvailable;
-            tpPresence.status = QStringLiteral("chat");
-            break;
-        case QXmppPresence::Invisible:
-            tpPresence.type = Tp::ConnectionPresenceTypeHidden;
-            tpPresence.status = QStringLiteral("hidden");
-            break;
-        }
-    } else {
-        tpPresence.type = Tp::ConnectionPresenceTypeOffline;
-        tpPresence.status = QStringLiteral("offline");
+    switch (item.subscriptionType()) {
+    case QXmppRosterIq::Item::None:
+    case QXmppRosterIq::Item::Remove:
+        break;
+    case QXmppRosterIq::Item::From:
+        subscriptions.publish = Tp::SubscriptionStateYes;
+        break;
+    case QXmppRosterIq::Item::To:
+        subscriptions.subscribe = Tp::SubscriptionStateYes;
+        break;
+    case QXmppRosterIq::Item::Both:
+        subscriptions.subscribe = Tp::SubscriptionStateYes;
+        subscriptions.publish = Tp::SubscriptionStateYes;
+        break;
+    case QXmppRosterIq::Item::NotSet:
+        subscriptions.subscribe = Tp::SubscriptionStateUnknown;
+        subscriptions.publish = Tp::SubscriptionStateUnknown;
+        break;
     }
 
-    return tpPresence;
+    return subscriptions;
 }
 
 QString Connection::getAlias(uint handle, Tp::DBusError *error)
@@ -682,7 +790,7 @@ QString Connection::getAlias(uint handle, Tp::DBusError *error)
 
     const QString jid = m_uniqueContactHandleMap[handle];
 
-    if (m_mucParticipants.contains(jid)) {
+    if (m_contactStates.isMucParticipant(jid)) {
         return QXmppUtils::jidToResource(jid);
     } else {
         return m_client->rosterManager().getRosterEntry(jid).name();
@@ -768,7 +876,7 @@ Tp::UIntList Connection::requestHandles(uint handleType, const QStringList &iden
     return result;
 }
 
-//TODO m_contactListIface->contactsChangedWithID for all of these and for remote actions:
+/* The resulting roster pushes are announced by flushRosterPushes() */
 
 void Connection::requestSubscription(const Tp::UIntList &handles, const QString &message, Tp::DBusError *error)
 {
@@ -795,14 +903,9 @@ void Connection::removeContacts(const Tp::UIntList &handles, Tp::DBusError *erro
         error->set(TP_QT_ERROR_DISCONNECTED, QStringLiteral("Disconnected"));
     }
 
-    Tp::ContactSubscriptionMap changes;
-    Tp::HandleIdentifierMap identifiers;
-    Tp::HandleIdentifierMap removals;
     for (uint handle : handles) {
         m_client->rosterManager().removeItem(m_uniqueContactHandleMap[handle]);
-        removals[handle] = m_uniqueContactHandleMap[handle];
     }
-    m_contactListIface->contactsChangedWithID(changes, identifiers, removals);
 }
 
 void Connection::authorizePublication(const Tp::UIntList &handles, Tp::DBusError *error)
@@ -987,6 +1090,11 @@ void Connection::onMessageReceived(const QXmppMessage &message)
         return;
     }
 
+    if (m_archiveSync->checkAndRemember(message)) {
+        qCDebug(general) << "Ignoring message that was already delivered from the archive:" << message.id();
+        return;
+    }
+
     TextChannelPtr textChannel = getTextChannel(message.from(), true, !message.mucInvitationJid().isEmpty());
     if (!textChannel) {
         qCDebug(general) << "Error, channel is not a TextChannel?";
@@ -1003,6 +1111,10 @@ void Connection::onCarbonMessageReceived(const QXmppMessage &message)
         return;
     }
 
+    if (m_archiveSync->checkAndRemember(message)) {
+        return;
+    }
+
     TextChannelPtr textChannel = getTextChannel(message.from(), false, !message.mucInvitationJid().isEmpty());
     if (textChannel) {
         textChannel->onMessageReceived(message);
@@ -1016,12 +1128,61 @@ void Connection::onCarbonMessageSent(const QXmppMessage &message)
         return;
     }
 
+    if (m_archiveSync->checkAndRemember(message)) {
+        return;
+    }
+
     TextChannelPtr textChannel = getTextChannel(message.to(), false, !message.mucInvitationJid().isEmpty());
     if (textChannel) {
         textChannel->onCarbonMessageSent(message);
     }
 }
 
+void Connection::onArchivedMessagesReceived(const QString &contactJid, const QList<QXmppMessage> &messages)
+{
+    DBG << contactJid << messages.count();
+
+    if (m_uniqueRoomHandleMap.contains(contactJid)) {
+        return;
+    }
+
+    /* Only open a new channel if somebody actually wrote to us */
+    bool ensure = false;
+    for (const QXmppMessage &message : messages) {
+        if (QXmppUtils::jidToBareJid(message.from()) != m_clientConfig.jidBare() && !message.body().isEmpty()) {
+            ensure = true;
+            break;
+        }
+    }
+
+    TextChannelPtr textChannel = getTextChannel(contactJid, ensure, /* mucInvitation */ false);
+    if (textChannel) {
+        textChannel->processArchivedMessages(messages);
+    }
+}
+
+void Connection::onResendMessage(const QString &contactJid, const QString &messageToken, const QString &content)
+{
+    DBG << contactJid << messageToken;
+
+    TextChannelPtr textChannel = getTextChannel(contactJid, /* ensure */ false, /* mucInvitation */ false);
+    if (textChannel) {
+        textChannel->resendMessage(messageToken, content);
+    }
+}
+
+void Connection::onDeliveryFailed(const QString &contactJid, const QString &messageToken)
+{
+    DBG << contactJid << messageToken;
+
+    m_messageStore.setDeliveryStatus(contactJid, messageToken, Tp::DeliveryStatusTemporarilyFailed);
+
+    TextChannelPtr textChannel = getTextChannel(contactJid, /* ensure */ false, /* mucInvitation */ false);
+    if (textChannel) {
+        textChannel->addDeliveryReport(messageToken, Tp::DeliveryStatusTemporarilyFailed, QStringLiteral("No delivery receipt"));
+    }
+}
+
 void Connection::onFileReceived(QXmppTransferJob *job)
 {
     DBG;
@@ -1061,6 +1222,15 @@ void Connection::onFileReceived(QXmppTransferJob *job)
     }
 }
 
+void Connection::onTransferJobFinished(QXmppTransferJob *job)
+{
+    /* Outgoing SOCKS5 transfers go through our proxy, so try another one next time */
+    if (job->error() == QXmppTransferJob::ProtocolError && job->direction() == QXmppTransferJob::OutgoingDirection
+            && job->method() == QXmppTransferJob::SocksMethod && m_proxyProber) {
+        m_proxyProber->reportFailure(m_proxyProber->bestProxy());
+    }
+}
+
 void Connection::requestAvatars(const Tp::UIntList &handles, Tp::DBusError *error)
 {
     DBG;
@@ -1070,7 +1240,23 @@ void Connection::requestAvatars(const Tp::UIntList &handles, Tp::DBusError *erro
     }
 
     for (uint handle : handles) {
-        m_client->vCardManager().requestVCard(m_uniqueContactHandleMap[handle]);
+        const QString contactJid = m_uniqueContactHandleMap[handle];
+        const QString token = m_avatarCache.token(contactJid);
+
+        QByteArray avatar;
+        QString mimeType;
+        if (m_avatarCache.load(token, &avatar, &mimeType)) {
+            m_avatarsIface->avatarRetrieved(handle, token, avatar, mimeType);
+        } else if (m_avatarTranscoder.isPending(token)) {
+            /* Repeated requests must not announce the result repeatedly */
+            if (!m_transcodingAvatars.contains(token, contactJid)) {
+                m_transcodingAvatars.insert(token, contactJid);
+            }
+        } else if (m_pepAvatarManager->hasMetadata(contactJid)) {
+            m_pepAvatarManager->requestData(contactJid);
+        } else {
+            requestVCard(contactJid);
+        }
     }
 }
 
@@ -1083,14 +1269,89 @@ void Connection::onVCardReceived(QXmppVCardIq iq)
 void Connection::onClientVCardReceived()
 {
     DBG;
-    updateAvatar(m_client->vCardManager().clientVCard().photo(), m_clientConfig.jidBare(), m_client->vCardManager().clientVCard().photoType());
+
+    /* Our own avatar is only announced if it changed, clients request it if they need it */
+    const QXmppVCardIq &vCard = m_client->vCardManager().clientVCard();
+    QString token;
+    if (!vCard.photo().isEmpty()) {
+        token = m_avatarCache.store(vCard.photo(), vCard.photoType());
+    }
+    updateAvatarToken(m_clientConfig.jidBare(), token);
 }
 
 void Connection::updateAvatar(const QByteArray &photo, const QString &jid, const QString &type)
 {
-    QString photoHash = QString::fromLatin1(QCryptographicHash::hash(photo, QCryptographicHash::Sha1));
-    m_avatarTokens[jid] = photoHash;
-    m_avatarsIface->avatarRetrieved(m_uniqueContactHandleMap[jid], photoHash, photo, type);
+    if (photo.isEmpty()) {
+        updateAvatarToken(jid, QString());
+        return;
+    }
+
+    const QString token = AvatarCache::tokenForData(photo);
+    m_avatarCache.setToken(jid, token);
+
+    QByteArray avatar;
+    QString mimeType;
+    if (m_avatarCache.load(token, &avatar, &mimeType)) {
+        m_avatarsIface->avatarRetrieved(m_uniqueContactHandleMap[jid], token, avatar, mimeType);
+        return;
+    }
+
+    transcodeAvatar(jid, token, photo, type);
+}
+
+void Connection::transcodeAvatar(const QString &jid, const QString &token, const QByteArray &data, const QString &mimeType)
+{
+    if (!m_transcodingAvatars.contains(token, jid)) {
+        m_transcodingAvatars.insert(token, jid);
+    }
+    m_avatarTranscoder.transcode(token, data, mimeType);
+}
+
+void Connection::onAvatarTranscoded(const QString &sourceToken, const QByteArray &data, const QString &mimeType)
+{
+    m_avatarCache.store(sourceToken, data, mimeType);
+
+    if (sourceToken == m_ownAvatarToken) {
+        m_ownAvatarToken.clear();
+        publishAvatar(data, mimeType);
+    }
+
+    for (const QString &jid : m_transcodingAvatars.values(sourceToken)) {
+        if (m_avatarCache.token(jid) == sourceToken) {
+            m_avatarsIface->avatarRetrieved(m_uniqueContactHandleMap[jid], sourceToken, data, mimeType);
+        }
+    }
+    m_transcodingAvatars.remove(sourceToken);
+}
+
+void Connection::onAvatarTranscodingFailed(const QString &sourceToken)
+{
+    qCWarning(general) << "Could not transcode the avatar" << sourceToken;
+
+    if (sourceToken == m_ownAvatarToken) {
+        m_ownAvatarToken.clear();
+    }
+    m_transcodingAvatars.remove(sourceToken);
+}
+
+void Connection::onPepAvatarReceived(const QString &jid, const QString &token, const QByteArray &data, const QString &mimeType)
+{
+    if (AvatarCache::tokenForData(data) != token) {
+        qCWarning(general) << "The PEP avatar of" << jid << "does not match its hash, falling back to the vCard";
+        requestVCard(jid);
+        return;
+    }
+
+    if (m_avatarCache.token(jid) == token) {
+        transcodeAvatar(jid, token, data, mimeType);
+    }
+}
+
+void Connection::updateAvatarToken(const QString &jid, const QString &token)
+{
+    if (m_avatarCache.setToken(jid, token)) {
+        m_avatarsIface->avatarUpdated(m_uniqueContactHandleMap[jid], token);
+    }
 }
 
 Tp::AvatarTokenMap Connection::getKnownAvatarTokens(const Tp::UIntList &handles, Tp::DBusError *error)
@@ -1106,8 +1367,9 @@ Tp::AvatarTokenMap Connection::getKnownAvatarTokens(const Tp::UIntList &handles,
 
     Tp::AvatarTokenMap result;
     for (uint handle : handles) {
-        if (!m_avatarTokens[m_uniqueContactHandleMap[handle]].isEmpty()) {
-            result.insert(handle, m_avatarTokens[m_uniqueContactHandleMap[handle]]);
+        const QString token = m_avatarCache.token(m_uniqueContactHandleMap[handle]);
+        if (!token.isEmpty()) {
+            result.insert(handle, token);
         }
     }
 
@@ -1118,53 +1380,69 @@ void Connection::clearAvatar(Tp::DBusError *error)
 {
     if (!m_client || !m_client->isConnected() || !m_client->vCardManager().isClientVCardReceived()) {
         error->set(TP_QT_ERROR_NOT_AVAILABLE, QStringLiteral("Disconnected"));
+        return;
     }
 
+    m_ownAvatarToken.clear();
+
     QXmppVCardIq clientVCard = m_client->vCardManager().clientVCard();
     clientVCard.setPhoto(QByteArray());
     clientVCard.setPhotoType(QString());
     m_client->vCardManager().setClientVCard(clientVCard);
 
-    QXmppPresence presence;
-    presence.setVCardUpdateType(QXmppPresence::VCardUpdateNoPhoto);
-    presence.setFrom(m_clientConfig.jid());
-    m_client->sendPacket(presence);
+    m_clientPresence = m_client->clientPresence();
+    m_clientPresence.setVCardUpdateType(QXmppPresence::VCardUpdateNoPhoto);
+    m_clientPresence.setPhotoHash(QByteArray());
+    m_client->setClientPresence(m_clientPresence);
 
-    m_avatarTokens[m_clientConfig.jidBare()] = QStringLiteral("");
+    m_avatarCache.setToken(m_clientConfig.jidBare(), QString());
 }
 
 QString Connection::setAvatar(const QByteArray &avatar, const QString &mimetype, Tp::DBusError *error)
 {
     if (!m_client || !m_client->isConnected() || !m_client->vCardManager().isClientVCardReceived()) {
         error->set(TP_QT_ERROR_NOT_AVAILABLE, QStringLiteral("Disconnected"));
+        return QString();
     }
 
-    QByteArray hash = QCryptographicHash::hash(avatar, QCryptographicHash::Sha1);
-    QXmppVCardIq clientVCard = m_client->vCardManager().clientVCard();
-    clientVCard.setPhoto(QByteArray());
-    clientVCard.setPhotoType(mimetype);
-    m_client->vCardManager().setClientVCard(clientVCard);
+    /* The avatar is published once it has been brought in line with our
+     * avatar requirements. It keeps the token of what the client gave us, the
+     * result is cached under it and requests for it wait for the result. */
+    const QString token = AvatarCache::tokenForData(avatar);
+    m_ownAvatarToken = token;
+    updateAvatarToken(m_clientConfig.jidBare(), token);
+    m_avatarTranscoder.transcode(token, avatar, mimetype);
 
-    QXmppPresence presence;
-    presence.setVCardUpdateType(QXmppPresence::VCardUpdateValidPhoto);
-    presence.setFrom(m_clientConfig.jid());
-    m_client->sendPacket(presence);
+    return token;
+}
 
-    m_avatarTokens[m_clientConfig.jidBare()] = QString::fromLatin1(hash);
+void Connection::publishAvatar(const QByteArray &avatar, const QString &mimeType)
+{
+    if (!m_client || !m_client->isConnected()) {
+        return;
+    }
+
+    QXmppVCardIq clientVCard = m_client->vCardManager().clientVCard();
+    clientVCard.setPhoto(avatar);
+    clientVCard.setPhotoType(mimeType);
+    m_client->vCardManager().setClientVCard(clientVCard);
 
-    return QString::fromLatin1(hash);
+    const QByteArray hash = QCryptographicHash::hash(avatar, QCryptographicHash::Sha1);
+    m_clientPresence = m_client->clientPresence();
+    m_clientPresence.setVCardUpdateType(QXmppPresence::VCardUpdateValidPhoto);
+    m_clientPresence.setPhotoHash(hash);
+    m_client->setClientPresence(m_clientPresence);
 }
 
 void Connection::updateGroups()
 {
-    QSet<QString> groups;
+    m_groupIndex.clear();
 
     for (const QString &jid : m_client->rosterManager().getRosterBareJids()) {
-        QXmppRosterIq::Item item = m_client->rosterManager().getRosterEntry(jid);
-        groups.unite(item.groups());
+        m_groupIndex.setGroups(jid, m_client->rosterManager().getRosterEntry(jid).groups());
     }
 
-    m_contactGroupsIface->setGroups(groups.toList());
+    m_contactGroupsIface->setGroups(m_groupIndex.allGroups());
     m_contactGroupsIface->groupsCreated(m_contactGroupsIface->groups());
 }
 
@@ -1177,52 +1455,23 @@ void Connection::setContactGroups(uint contact, const QStringList &groups, Tp::D
 
     if (!m_uniqueContactHandleMap.contains(contact)) {
         error->set(TP_QT_ERROR_INVALID_HANDLE, QStringLiteral("Unknown handle"));
+        return;
     }
 
     const QString contactJid = m_uniqueContactHandleMap[contact];
 
-    QXmppRosterIq::Item item = m_client->rosterManager().getRosterEntry(contactJid);
-
-    auto oldGroups = item.groups();
+    RosterMutation mutation;
+    mutation.jid = contactJid;
+    mutation.handle = contact;
+    mutation.oldGroups = m_groupIndex.groups(contactJid);
+    mutation.newGroups = groups.toSet();
 
-    item.setGroups(groups.toSet());
-
-    if (oldGroups == item.groups()) {
+    if (mutation.oldGroups == mutation.newGroups) {
         // NOP
         return;
     }
 
-    QXmppRosterIq iq;
-    iq.setType(QXmppIq::Set);
-    iq.addItem(item);
-
-    m_client->sendPacket(iq);
-
-    auto groupsAddedToTheContact = item.groups().subtract(oldGroups);
-    auto groupsRemovedFromTheContact = oldGroups.subtract(item.groups());
-
-    auto newGroups = groupsAddedToTheContact;
-    auto removedGroups = groupsRemovedFromTheContact;
-
-    for (const QString &jid : m_client->rosterManager().getRosterBareJids()) {
-        if (jid == contactJid) {
-            // Skip the target contact
-            continue;
-        }
-
-        QXmppRosterIq::Item item = m_client->rosterManager().getRosterEntry(jid);
-
-        newGroups.subtract(item.groups());
-        removedGroups.subtract(item.groups());
-    }
-
-    if (!newGroups.isEmpty()) {
-        m_contactGroupsIface->groupsCreated(newGroups.toList());
-    }
-    if (!removedGroups.isEmpty()) {
-        m_contactGroupsIface->groupsRemoved(removedGroups.toList());
-    }
-    m_contactGroupsIface->groupsChanged(Tp::UIntList() << contact, groupsAddedToTheContact.toList(), groupsRemovedFromTheContact.toList());
+    m_rosterMutations->submit(QList<RosterMutation>() << mutation, existingGroups(mutation.oldGroups + mutation.newGroups));
 }
 
 void Connection::setGroupMembers(const QString &group, const Tp::UIntList &members, Tp::DBusError *error)
@@ -1232,7 +1481,7 @@ void Connection::setGroupMembers(const QString &group, const Tp::UIntList &membe
         return;
     }
 
-    QStringList memberJids;
+    QSet<QString> memberJids;
 
     for (uint handle : members) {
         if (!m_uniqueContactHandleMap.contains(handle)) {
@@ -1240,58 +1489,46 @@ void Connection::setGroupMembers(const QString &group, const Tp::UIntList &membe
             return;
         }
 
-        memberJids.append(m_uniqueContactHandleMap[handle]);
+        memberJids.insert(m_uniqueContactHandleMap[handle]);
     }
 
-    Tp::UIntList handlesRemovedFromTheGroup;
-    Tp::UIntList handlesAddedToTheGroup;
-
-    bool groupExisted = false;
-
-    for (const QString &contactJid : m_client->rosterManager().getRosterBareJids()) {
-        QXmppRosterIq::Item item = m_client->rosterManager().getRosterEntry(contactJid);
-        if (item.groups().contains(group)) {
-            groupExisted = true;
+    const QSet<QString> currentMembers = m_groupIndex.members(group);
+    QList<RosterMutation> mutations;
 
-            if (memberJids.contains(contactJid)) {
-                // NOP
-                continue;
-            } else {
-                auto groups = item.groups();
-                groups.remove(group);
-                item.setGroups(groups);
-
-                handlesRemovedFromTheGroup.append(m_uniqueContactHandleMap[contactJid]);
-            }
-        } else {
-            if (memberJids.contains(contactJid)) {
-                auto groups = item.groups();
-                groups.insert(group);
-                item.setGroups(groups);
-
-                handlesAddedToTheGroup.append(m_uniqueContactHandleMap[contactJid]);
-            } else {
-                // NOP
-                continue;
-            }
+    for (const QString &contactJid : currentMembers) {
+        if (memberJids.contains(contactJid)) {
+            continue;
         }
 
-        QXmppRosterIq iq;
-        iq.setType(QXmppIq::Set);
-        iq.addItem(item);
-        m_client->sendPacket(iq);
+        RosterMutation mutation;
+        mutation.jid = contactJid;
+        mutation.handle = m_uniqueContactHandleMap[contactJid];
+        mutation.oldGroups = m_groupIndex.groups(contactJid);
+        mutation.newGroups = mutation.oldGroups;
+        mutation.newGroups.remove(group);
+        mutations.append(mutation);
     }
 
-    if (!groupExisted && !members.isEmpty()) {
-        m_contactGroupsIface->groupsCreated(QStringList() << group);
-    }
+    for (const QString &contactJid : memberJids) {
+        if (currentMembers.contains(contactJid)) {
+            continue;
+        }
 
-    if (groupExisted && members.isEmpty()) {
-        m_contactGroupsIface->groupsRemoved(QStringList() << group);
+        if (m_client->rosterManager().getRosterEntry(contactJid).bareJid().isEmpty()) {
+            /* Not in the roster */
+            continue;
+        }
+
+        RosterMutation mutation;
+        mutation.jid = contactJid;
+        mutation.handle = m_uniqueContactHandleMap[contactJid];
+        mutation.oldGroups = m_groupIndex.groups(contactJid);
+        mutation.newGroups = mutation.oldGroups;
+        mutation.newGroups.insert(group);
+        mutations.append(mutation);
     }
 
-    m_contactGroupsIface->groupsChanged(handlesRemovedFromTheGroup, QStringList(), QStringList() << group);
-    m_contactGroupsIface->groupsChanged(handlesAddedToTheGroup, QStringList() << group, QStringList());
+    m_rosterMutations->submit(mutations, existingGroups(QSet<QString>() << group));
 }
 
 void Connection::addToGroup(const QString &group, const Tp::UIntList &members, Tp::DBusError *error)
@@ -1306,7 +1543,7 @@ void Connection::addToGroup(const QString &group, const Tp::UIntList &members, T
         return;
     }
 
-    QStringList memberJids;
+    QList<RosterMutation> mutations;
 
     for (uint handle : members) {
         if (!m_uniqueContactHandleMap.contains(handle)) {
@@ -1314,41 +1551,27 @@ void Connection::addToGroup(const QString &group, const Tp::UIntList &members, T
             return;
         }
 
-        memberJids.append(m_uniqueContactHandleMap[handle]);
-    }
-
-    Tp::UIntList handlesAddedToTheGroup;
-
-    bool groupExists = false;
-
-    for (const QString &contactJid : m_client->rosterManager().getRosterBareJids()) {
-        QXmppRosterIq::Item item = m_client->rosterManager().getRosterEntry(contactJid);
-        if (item.groups().contains(group)) {
-            groupExists = true;
+        const QString contactJid = m_uniqueContactHandleMap[handle];
+        const QSet<QString> groups = m_groupIndex.groups(contactJid);
+        if (groups.contains(group)) {
             continue;
         }
 
-        if (!memberJids.contains(contactJid)) {
+        if (groups.isEmpty() && m_client->rosterManager().getRosterEntry(contactJid).bareJid().isEmpty()) {
+            /* Not in the roster */
             continue;
         }
 
-        auto groups = item.groups();
-        groups.insert(group);
-        item.setGroups(groups);
-
-        QXmppRosterIq iq;
-        iq.setType(QXmppIq::Set);
-        iq.addItem(item);
-        m_client->sendPacket(iq);
-
-        handlesAddedToTheGroup.append(m_uniqueContactHandleMap[contactJid]);
+        RosterMutation mutation;
+        mutation.jid = contactJid;
+        mutation.handle = handle;
+        mutation.oldGroups = groups;
+        mutation.newGroups = groups;
+        mutation.newGroups.insert(group);
+        mutations.append(mutation);
     }
 
-    if (!groupExists) {
-        m_contactGroupsIface->groupsCreated(QStringList() << group);
-    }
-
-    m_contactGroupsIface->groupsChanged(handlesAddedToTheGroup, QStringList() << group, QStringList());
+    m_rosterMutations->submit(mutations, existingGroups(QSet<QString>() << group));
 }
 
 void Connection::removeFromGroup(const QString &group, const Tp::UIntList &members, Tp::DBusError *error)
@@ -1358,7 +1581,7 @@ void Connection::removeFromGroup(const QString &group, const Tp::UIntList &membe
         return;
     }
 
-    QStringList memberJids;
+    QList<RosterMutation> mutations;
 
     for (uint handle : members) {
         if (!m_uniqueContactHandleMap.contains(handle)) {
@@ -1366,126 +1589,240 @@ void Connection::removeFromGroup(const QString &group, const Tp::UIntList &membe
             return;
         }
 
-        memberJids.append(m_uniqueContactHandleMap[handle]);
+        const QString contactJid = m_uniqueContactHandleMap[handle];
+        const QSet<QString> groups = m_groupIndex.groups(contactJid);
+        if (!groups.contains(group)) {
+            continue;
+        }
+
+        RosterMutation mutation;
+        mutation.jid = contactJid;
+        mutation.handle = handle;
+        mutation.oldGroups = groups;
+        mutation.newGroups = groups;
+        mutation.newGroups.remove(group);
+        mutations.append(mutation);
     }
 
-    Tp::UIntList handlesRemovedFromTheGroup;
+    m_rosterMutations->submit(mutations, existingGroups(QSet<QString>() << group));
+}
 
-    bool groupExisted = false;
-    bool groupRemoved = true;
+void Connection::removeGroup(const QString &group, Tp::DBusError *error)
+{
+    if ((!m_client) || (!m_client->isConnected())) {
+        error->set(TP_QT_ERROR_DISCONNECTED, QStringLiteral("Disconnected"));
+        return;
+    }
 
-    for (const QString &contactJid : m_client->rosterManager().getRosterBareJids()) {
-        QXmppRosterIq::Item item = m_client->rosterManager().getRosterEntry(contactJid);
+    QList<RosterMutation> mutations;
 
-        if (item.groups().contains(group)) {
-            groupExisted = true;
-            if (memberJids.contains(contactJid)) {
-                auto groups = item.groups();
-                groups.remove(group);
-                item.setGroups(groups);
+    for (const QString &contactJid : m_groupIndex.members(group)) {
+        RosterMutation mutation;
+        mutation.jid = contactJid;
+        mutation.handle = m_uniqueContactHandleMap[contactJid];
+        mutation.oldGroups = m_groupIndex.groups(contactJid);
+        mutation.newGroups = mutation.oldGroups;
+        mutation.newGroups.remove(group);
+        mutations.append(mutation);
+    }
 
-                QXmppRosterIq iq;
-                iq.setType(QXmppIq::Set);
-                iq.addItem(item);
-                m_client->sendPacket(iq);
+    m_rosterMutations->submit(mutations, existingGroups(QSet<QString>() << group));
+}
 
-                handlesRemovedFromTheGroup.append(m_uniqueContactHandleMap[contactJid]);
-            } else {
-                groupRemoved = false;
-            }
-        }
+void Connection::renameGroup(const QString &oldName, const QString &newName, Tp::DBusError *error)
+{
+    if ((!m_client) || (!m_client->isConnected())) {
+        error->set(TP_QT_ERROR_DISCONNECTED, QStringLiteral("Disconnected"));
+        return;
     }
 
-    if (!groupExisted) {
-        // NOP
+    if (!m_groupIndex.contains(oldName)) {
+        error->set(TP_QT_ERROR_DOES_NOT_EXIST, QStringLiteral("The group does not exist"));
         return;
     }
 
-    if (groupRemoved) {
-        m_contactGroupsIface->groupsRemoved(QStringList() << group);
+    if (m_groupIndex.contains(newName)) {
+        error->set(TP_QT_ERROR_NOT_AVAILABLE, QStringLiteral("There is already a group with the new name"));
+        return;
     }
 
-    m_contactGroupsIface->groupsChanged(handlesRemovedFromTheGroup, QStringList(), QStringList() << group);
-}
+    QList<RosterMutation> mutations;
 
-void Connection::removeGroup(const QString &group, Tp::DBusError *error)
-{
-    if ((!m_client) || (!m_client->isConnected())) {
-        error->set(TP_QT_ERROR_DISCONNECTED, QStringLiteral("Disconnected"));
-        return;
+    for (const QString &contactJid : m_groupIndex.members(oldName)) {
+        RosterMutation mutation;
+        mutation.jid = contactJid;
+        mutation.handle = m_uniqueContactHandleMap[contactJid];
+        mutation.oldGroups = m_groupIndex.groups(contactJid);
+        mutation.newGroups = mutation.oldGroups;
+        mutation.newGroups.remove(oldName);
+        mutation.newGroups.insert(newName);
+        mutations.append(mutation);
     }
 
-    bool groupExisted = false;
-    Tp::UIntList handlesRemovedFromTheGroup;
+    m_rosterMutations->submit(mutations, QSet<QString>() << oldName);
+}
 
-    for (const QString &contactJid : m_client->rosterManager().getRosterBareJids()) {
-        QXmppRosterIq::Item item = m_client->rosterManager().getRosterEntry(contactJid);
+QSet<QString> Connection::existingGroups(const QSet<QString> &groups) const
+{
+    QSet<QString> result;
 
-        if (item.groups().contains(group)) {
-            groupExisted = true;
+    for (const QString &group : groups) {
+        if (m_groupIndex.contains(group)) {
+            result.insert(group);
+        }
+    }
 
-            auto groups = item.groups();
-            groups.remove(group);
-            item.setGroups(groups);
+    return result;
+}
 
-            QXmppRosterIq iq;
-            iq.setType(QXmppIq::Set);
-            iq.addItem(item);
-            m_client->sendPacket(iq);
+void Connection::onRosterItemChanged(const QString &bareJid)
+{
+    queueRosterPush(bareJid);
+    m_groupIndex.setGroups(bareJid, m_client->rosterManager().getRosterEntry(bareJid).groups());
+}
+
+void Connection::onRosterItemRemoved(const QString &bareJid)
+{
+    queueRosterPush(bareJid);
+    m_groupIndex.remove(bareJid);
+}
 
-            handlesRemovedFromTheGroup.append(m_uniqueContactHandleMap[contactJid]);
+void Connection::queueRosterPush(const QString &bareJid)
+{
+    /* Group changes we asked for ourselves are announced once the server has confirmed them */
+    const bool ownChange = m_rosterMutations->isPending(bareJid);
+    const QSet<QString> groups = m_groupIndex.groups(bareJid);
+
+    auto push = m_rosterPushes.find(bareJid);
+    if (push == m_rosterPushes.end()) {
+        m_rosterPushes.insert(bareJid, RosterPush { groups, !ownChange });
+    } else if (ownChange) {
+        push->announceGroups = false;
+    }
+
+    if (!ownChange) {
+        /* Remember which groups existed before the burst so that created and
+         * removed groups can be told apart when it is announced */
+        const QSet<QString> newGroups = m_client->rosterManager().getRosterEntry(bareJid).groups();
+        for (const QString &group : groups + newGroups) {
+            if (!m_rosterPushGroups.contains(group)) {
+                m_rosterPushGroups.insert(group, m_groupIndex.contains(group));
+            }
         }
     }
 
-    if (groupExisted) {
-        m_contactGroupsIface->groupsRemoved(QStringList() << group);
-        m_contactGroupsIface->groupsChanged(handlesRemovedFromTheGroup, QStringList(), QStringList() << group);
+    if (!m_rosterPushTimer.isActive()) {
+        m_rosterPushTimer.start();
     }
 }
 
-void Connection::renameGroup(const QString &oldName, const QString &newName, Tp::DBusError *error)
+void Connection::flushRosterPushes()
 {
-    if ((!m_client) || (!m_client->isConnected())) {
-        error->set(TP_QT_ERROR_DISCONNECTED, QStringLiteral("Disconnected"));
-        return;
-    }
+    Tp::ContactSubscriptionMap changes;
+    Tp::HandleIdentifierMap identifiers;
+    Tp::HandleIdentifierMap removals;
+    QList<RosterMutation> groupChanges;
 
+    for (auto it = m_rosterPushes.constBegin(); it != m_rosterPushes.constEnd(); ++it) {
+        const QString &contactJid = it.key();
+        const uint handle = m_uniqueContactHandleMap[contactJid];
+        const QXmppRosterIq::Item item = m_client->rosterManager().getRosterEntry(contactJid);
 
-    for (const QString &contactJid : m_client->rosterManager().getRosterBareJids()) {
-        QXmppRosterIq::Item item = m_client->rosterManager().getRosterEntry(contactJid);
-        if (item.groups().contains(newName)) {
-            error->set(TP_QT_ERROR_NOT_AVAILABLE, QStringLiteral("There is already a group with the new name"));
-            return;
+        if (item.bareJid().isEmpty()) {
+            removals[handle] = contactJid;
+        } else {
+            changes[handle] = toTpSubscriptions(item);
+            identifiers[handle] = contactJid;
+        }
+
+        const QSet<QString> groups = m_groupIndex.groups(contactJid);
+        if (it->announceGroups && groups != it->groups) {
+            groupChanges.append(RosterMutation { contactJid, handle, it->groups, groups });
         }
     }
 
-    Tp::UIntList affectedHandles;
+    QSet<QString> groupsBefore;
+    for (auto it = m_rosterPushGroups.constBegin(); it != m_rosterPushGroups.constEnd(); ++it) {
+        if (it.value()) {
+            groupsBefore.insert(it.key());
+        }
+    }
 
-    for (const QString &contactJid : m_client->rosterManager().getRosterBareJids()) {
-        QXmppRosterIq::Item item = m_client->rosterManager().getRosterEntry(contactJid);
+    clearRosterPushes();
 
-        if (item.groups().contains(oldName)) {
-            auto groups = item.groups();
-            groups.remove(oldName);
-            groups.insert(newName);
-            item.setGroups(groups);
+    if (!changes.isEmpty() || !removals.isEmpty()) {
+        m_contactListIface->contactsChangedWithID(changes, identifiers, removals);
+    }
 
-            QXmppRosterIq iq;
-            iq.setType(QXmppIq::Set);
-            iq.addItem(item);
-            m_client->sendPacket(iq);
+    announceGroupChanges(groupChanges, groupsBefore);
+}
 
-            affectedHandles.append(m_uniqueContactHandleMap[contactJid]);
-        }
+void Connection::clearRosterPushes()
+{
+    m_rosterPushTimer.stop();
+    m_rosterPushes.clear();
+    m_rosterPushGroups.clear();
+}
+
+void Connection::onRosterBatchFinished(const QList<RosterMutation> &confirmed, int failed, const QSet<QString> &groupsBefore)
+{
+    /* The D-Bus call has returned long ago, all we can do is to not announce what did not happen */
+    if (failed > 0) {
+        qCWarning(general) << failed << "of" << failed + confirmed.count() << "roster changes failed";
     }
 
-    if (affectedHandles.isEmpty()) {
-        error->set(TP_QT_ERROR_DOES_NOT_EXIST, QStringLiteral("The group does not exist"));
+    announceGroupChanges(confirmed, groupsBefore);
+}
+
+void Connection::announceGroupChanges(const QList<RosterMutation> &mutations, const QSet<QString> &groupsBefore)
+{
+    if (mutations.isEmpty()) {
         return;
     }
 
-    m_contactGroupsIface->groupsRemoved(QStringList() << oldName);
-    m_contactGroupsIface->groupsChanged(affectedHandles, QStringList() << newName, QStringList() << oldName);
+    /* Contacts that had the same change applied are announced together */
+    struct GroupChange {
+        Tp::UIntList contacts;
+        QStringList added;
+        QStringList removed;
+    };
+    QList<GroupChange> changes;
+    QSet<QString> touchedGroups;
+
+    for (const RosterMutation &mutation : mutations) {
+        QStringList added = (mutation.newGroups - mutation.oldGroups).toList();
+        QStringList removed = (mutation.oldGroups - mutation.newGroups).toList();
+        std::sort(added.begin(), added.end());
+        std::sort(removed.begin(), removed.end());
+
+        touchedGroups.unite(mutation.oldGroups - mutation.newGroups);
+        touchedGroups.unite(mutation.newGroups - mutation.oldGroups);
+
+        auto change = std::find_if(changes.begin(), changes.end(), [&](const GroupChange &change) {
+            return change.added == added && change.removed == removed;
+        });
+        if (change == changes.end()) {
+            changes.append(GroupChange { Tp::UIntList(), added, removed });
+            change = changes.end() - 1;
+        }
+        change->contacts.append(mutation.handle);
+    }
+
+    const QSet<QString> groupsAfter = existingGroups(touchedGroups);
+    const QStringList createdGroups = (groupsAfter - groupsBefore).toList();
+    const QStringList removedGroups = (groupsBefore - groupsAfter).toList();
+
+    if (!createdGroups.isEmpty()) {
+        m_contactGroupsIface->groupsCreated(createdGroups);
+    }
+
+    for (const GroupChange &change : changes) {
+        m_contactGroupsIface->groupsChanged(change.contacts, change.added, change.removed);
+    }
+
+    if (!removedGroups.isEmpty()) {
+        m_contactGroupsIface->groupsRemoved(removedGroups);
+    }
 }
 
 QStringList Connection::getClientType(uint handle) const
@@ -1499,12 +1836,12 @@ QStringList Connection::getClientType(uint handle) const
         return QStringList();
     }
 
-    QString fullJid = jid + bestResourceForJid(jid);
-    if (!m_clientTypes.contains(fullJid)) {
+    const CapabilitySetPtr capabilities = m_contactStates.capabilities(jid, m_contactStates.bestResource(jid));
+    if (!capabilities || capabilities->clientType.isEmpty()) {
         return QStringList();
     }
 
-    return QStringList() << m_clientTypes.value(fullJid);
+    return QStringList() << capabilities->clientType;
 }
 
 Tp::ContactClientTypes Connection::getClientTypes(const Tp::UIntList &contacts, Tp::DBusError *error)
@@ -1527,27 +1864,54 @@ Tp::ContactCapabilitiesMap Connection::getContactCapabilities(const Tp::UIntList
 {
     Tp::ContactCapabilitiesMap capabilities;
 
-    const QStringList contactJids = inspectHandles(Tp::HandleTypeContact, contacts, error);
-    if (error->isValid()) {
-        return capabilities;
+    for (uint handle : contacts) {
+        const QString contactJid = m_uniqueContactHandleMap[handle];
+        if (contactJid.isEmpty()) {
+            error->set(TP_QT_ERROR_INVALID_HANDLE, QStringLiteral("Unknown handle"));
+            return Tp::ContactCapabilitiesMap();
+        }
+
+        const QString fullJid = contactJid + lastResourceForJid(contactJid, /* force */ true);
+        const CapabilitySetPtr caps = contactJid == m_clientConfig.jidBare()
+                ? m_ownCapabilities
+                : m_contactStates.capabilities(contactJid, QXmppUtils::jidToResource(fullJid));
+
+        /* Shares the list of the interned capability set */
+        capabilities[handle] = caps ? caps->channelClasses : textOnlyChannelClasses;
     }
 
-    for (int i = 0; i < contacts.count(); ++i) {
-        Tp::RequestableChannelClassList channelClassList;
-        channelClassList << requestableChannelClassText; // Text channels supported by everyone.
+    return capabilities;
+}
 
-        const QString fullJid = contactJids.at(i) + lastResourceForJid(contactJids.at(i), /* force */ true);
-        const QStringList caps = m_contactsFeatures.value(fullJid);
+void Connection::applyCapabilities(const QString &jid, const CapabilitySetPtr &capabilities)
+{
+    const QString bareJid = QXmppUtils::jidToBareJid(jid);
+    if (!m_contactStates.setCapabilities(bareJid, QXmppUtils::jidToResource(jid), capabilities)) {
+        return;
+    }
 
-        if (caps.contains(QStringLiteral("http://jabber.org/protocol/si/profile/file-transfer"))) {
-            channelClassList << requestableChannelClassFileTransfer;
-        } else {
-            qCDebug(general) << "Contact" << fullJid << "has these caps:" << caps;
-        }
-        capabilities[contacts.at(i)] = channelClassList;
+    /* Only the resource we would talk to determines what the contact can do */
+    if (bareJid + lastResourceForJid(bareJid, /* force */ true) != jid) {
+        return;
     }
 
-    return capabilities;
+    m_capabilityChanges.insert(m_uniqueContactHandleMap[bareJid]);
+    if (!m_capabilityTimer.isActive()) {
+        m_capabilityTimer.start();
+    }
+}
+
+void Connection::flushCapabilityChanges()
+{
+    const Tp::UIntList handles = m_capabilityChanges.toList();
+    m_capabilityChanges.clear();
+
+    Tp::DBusError error;
+    m_contactCapabilitiesIface->contactCapabilitiesChanged(getContactCapabilities(handles, &error));
+
+    for (uint handle : handles) {
+        m_clientTypesIface->clientTypesUpdated(handle, getClientType(handle));
+    }
 }
 
 QPointer<QXmppClient> Connection::qxmppClient() const
@@ -1555,16 +1919,92 @@ QPointer<QXmppClient> Connection::qxmppClient() const
     return m_client;
 }
 
+MessageStore *Connection::messageStore()
+{
+    return &m_messageStore;
+}
+
+SearchIndex *Connection::searchIndex()
+{
+    return &m_searchIndex;
+}
+
+bool Connection::sendStanza(const QXmppStanza &stanza, OutboundQueue::Priority priority)
+{
+    if (!m_outboundQueue) {
+        return false;
+    }
+
+    return m_outboundQueue->send(stanza, priority);
+}
+
+QString Connection::scheduleIq(const QString &key, QXmppIq &iq, IqScheduler::Priority priority)
+{
+    if (!m_iqScheduler) {
+        return QString();
+    }
+
+    return m_iqScheduler->request(key, iq, priority);
+}
+
+void Connection::requestVCard(const QString &jid)
+{
+    /* vCards are only fetched for avatars somebody asked for */
+    QXmppVCardIq request(jid);
+    scheduleIq(QLatin1String("vcard ") + jid, request, IqScheduler::Interactive);
+}
+
+void Connection::requestDiscoveryInfo(const QString &jid, const QString &node, IqScheduler::Priority priority)
+{
+    /* The discovery manager picks up the result */
+    QXmppDiscoveryIq request;
+    request.setType(QXmppIq::Get);
+    request.setQueryType(QXmppDiscoveryIq::InfoQuery);
+    request.setTo(jid);
+    if (!node.isEmpty()) {
+        request.setQueryNode(node);
+    }
+    scheduleIq(QLatin1String("disco#info ") + jid + QLatin1Char(' ') + node, request, priority);
+}
+
+bool Connection::isOutboundQueueFull() const
+{
+    return m_outboundQueue && m_outboundQueue->isFull();
+}
+
+DeliveryTracker *Connection::deliveryTracker()
+{
+    return &m_deliveryTracker;
+}
+
+uint Connection::pendingMessageLimit() const
+{
+    return m_pendingMessageLimit;
+}
+
+QString Connection::nextStanzaId()
+{
+    return m_stanzaIds.next();
+}
+
+Tp::MessagePartList Connection::storedMessageToParts(const StoredMessage &message)
+{
+    MessagePartsBuilder builder;
+    builder.setToken(message.id)
+           .setSent(message.timestamp / 1000)
+           .setSender(ensureContactHandle(message.senderId), message.senderId)
+           .setType(Tp::ChannelTextMessageTypeNormal)
+           .setScrollback(true)
+           .setTextContent(message.body);
+
+    return builder.take();
+}
+
 QString Connection::lastResourceForJid(const QString &jid, bool force)
 {
-    QString resource = m_lastResources[jid];
-    if (resource.isEmpty() || !m_client->rosterManager().getResources(jid).contains(resource)) {
-        if (force) {
-            return bestResourceForJid(jid);
-        } else {
-            m_lastResources.remove(jid);
-            return QString();
-        }
+    const QString resource = m_contactStates.lastResource(jid);
+    if (resource.isEmpty()) {
+        return force ? bestResourceForJid(jid) : QString();
     }
 
     return QLatin1Char('/') + resource;
@@ -1572,27 +2012,30 @@ QString Connection::lastResourceForJid(const QString &jid, bool force)
 
 QString Connection::bestResourceForJid(const QString &jid) const
 {
-    const QStringList resources = m_client->rosterManager().getResources(jid);
-    if (resources.isEmpty()) {
+    const QString resource = m_contactStates.bestResource(jid);
+    if (resource.isEmpty()) {
         return QString();
     }
 
-    QString resource = resources.first();
-    int highestPriority = m_client->rosterManager().getPresence(jid, resource).priority();
-    for (int i = 1; i < resources.count(); ++i) {
-        const int priority = m_client->rosterManager().getPresence(jid, resources.at(i)).priority();
-        if (priority > highestPriority) {
-            highestPriority = priority;
-            resource = resources.at(i);
-        }
-    }
-
     return QLatin1Char('/') + resource;
 }
 
 void Connection::setLastResource(const QString &jid, const QString &resource)
 {
-    m_lastResources[jid] = resource;
+    m_contactStates.setLastResource(jid, resource);
+}
+
+bool Connection::supportsDeliveryReceipts(const QString &jid)
+{
+    /* Whoever we talk to has to confirm the delivery */
+    const QString fullJid = jid + lastResourceForJid(jid, /* force */ true);
+    const CapabilitySetPtr capabilities = m_contactStates.capabilities(jid, QXmppUtils::jidToResource(fullJid));
+    if (!capabilities) {
+        return false;
+    }
+
+    return capabilities->features.contains(QStringLiteral("urn:xmpp:receipts"))
+            || capabilities->features.contains(QStringLiteral("urn:xmpp:chat-markers:0"));
 }
 
 uint Connection::ensureContactHandle(const QString &id)
@@ -1607,5 +2050,5 @@ QString Connection::getContactIdentifier(uint handle) const
 
 void Connection::updateMucParticipantInfo(const QString &participant, const QXmppPresence &presense)
 {
-    m_mucParticipants.insert(participant, presense);
+    m_contactStates.setMucPresence(participant, presense);
 }
@@ -23,7 +23,10 @@
 #include <TelepathyQt/BaseConnection>
 #include <TelepathyQt/BaseChannel>
 
+#include <QTimer>
+
 #include <QXmppClient.h>
+#include <QXmppRosterIq.h>
 #include <QXmppVCardIq.h>
 #include <QXmppMessage.h>
 #include <QXmppDiscoveryManager.h>
@@ -33,9 +36,25 @@
 #endif
 
 #include "textchannel.hh"
+#include "avatarcache.hh"
+#include "avatartranscoder.hh"
+#include "capabilitycache.hh"
+#include "contactstatetable.hh"
+#include "deliverytracker.hh"
+#include "iqscheduler.hh"
+#include "messagestore.hh"
+#include "outboundqueue.hh"
+#include "rostergroupindex.hh"
+#include "rostermutationengine.hh"
+#include "searchindex.hh"
+#include "searchinterface.hh"
+#include "servicedirectory.hh"
 #include "uniquehandlemap.hh"
 
 class QXmppMucManager;
+class PepAvatarManager;
+class ProxyProber;
+class MessageArchiveSync;
 
 class Connection : public Tp::BaseConnection
 {
@@ -46,14 +65,24 @@ public:
             const QVariantMap &parameters);
 
     QPointer<QXmppClient> qxmppClient() const;
+    bool sendStanza(const QXmppStanza &stanza, OutboundQueue::Priority priority);
+    bool isOutboundQueueFull() const;
+    MessageStore *messageStore();
+    SearchIndex *searchIndex();
+    DeliveryTracker *deliveryTracker();
+    uint pendingMessageLimit() const;
+    QString nextStanzaId();
+    QString scheduleIq(const QString &key, QXmppIq &iq, IqScheduler::Priority priority);
+    Tp::MessagePartList storedMessageToParts(const StoredMessage &message);
     QString lastResourceForJid(const QString &jid, bool force = false);
     QString bestResourceForJid(const QString &jid) const;
     void setLastResource(const QString &jid, const QString &resource);
+    bool supportsDeliveryReceipts(const QString &jid);
 
     uint ensureContactHandle(const QString &id);
     QString getContactIdentifier(uint handle) const;
 
-    void updateJidPresence(const QString &jid, const QXmppPresence &presence);
+    void updateJidPresence(const QString &jid, const QXmppPresence &presence, bool presenceChanged = true);
     void updateMucParticipantInfo(const QString &participant, const QXmppPresence &presense);
 
 private:
@@ -81,6 +110,10 @@ private:
 
     TextChannelPtr getTextChannel(const QString &contactJid, bool ensure, bool mucInvitation);
 
+    void requestVCard(const QString &jid);
+    void requestDiscoveryInfo(const QString &jid, const QString &node = QString(),
+                              IqScheduler::Priority priority = IqScheduler::Background);
+
     void updateGroups();
     void setContactGroups(uint contact, const QStringList &groups, Tp::DBusError *error);
     void setGroupMembers(const QString &group, const Tp::UIntList &members, Tp::DBusError *error);
@@ -88,14 +121,19 @@ private:
     void removeFromGroup(const QString &group, const Tp::UIntList &members, Tp::DBusError *error);
     void removeGroup(const QString &group, Tp::DBusError *error);
     void renameGroup(const QString &oldName, const QString &newName, Tp::DBusError *error);
+    QSet<QString> existingGroups(const QSet<QString> &groups) const;
+    void announceGroupChanges(const QList<RosterMutation> &mutations, const QSet<QString> &groupsBefore);
+    void queueRosterPush(const QString &bareJid);
+    void clearRosterPushes();
 
     QStringList getClientType(uint handle) const;
     Tp::ContactClientTypes getClientTypes(const Tp::UIntList &contacts, Tp::DBusError *error);
     QStringList requestClientTypes(uint contact, Tp::DBusError *error);
 
     Tp::ContactCapabilitiesMap getContactCapabilities(const Tp::UIntList &contacts, Tp::DBusError *error);
+    void applyCapabilities(const QString &jid, const CapabilitySetPtr &capabilities);
 
-    Tp::SimplePresence toTpPresence(QMap<QString, QXmppPresence> presences);
+    static Tp::ContactSubscriptions toTpSubscriptions(const QXmppRosterIq::Item &item);
 
 private slots:
     void doDisconnect();
@@ -106,20 +144,42 @@ private slots:
     void onCarbonMessageReceived(const QXmppMessage &message);
     void onCarbonMessageSent(const QXmppMessage &message);
     void onFileReceived(QXmppTransferJob *job);
+    void onTransferJobFinished(QXmppTransferJob *job);
     void onPresenceReceived(const QXmppPresence &presence);
+    void onArchivedMessagesReceived(const QString &contactJid, const QList<QXmppMessage> &messages);
+    void onResendMessage(const QString &contactJid, const QString &messageToken, const QString &content);
+    void onDeliveryFailed(const QString &contactJid, const QString &messageToken);
 
     void onDiscoveryInfoReceived(const QXmppDiscoveryIq &iq);
     void onDiscoveryItemsReceived(const QXmppDiscoveryIq &iq);
+    void onServicesChanged();
+    void onBestProxyChanged(const QString &jid);
 
     void onRosterReceived();
+    void onRosterItemChanged(const QString &bareJid);
+    void onRosterItemRemoved(const QString &bareJid);
+    void flushRosterPushes();
+    void flushCapabilityChanges();
+    void onRosterBatchFinished(const QList<RosterMutation> &confirmed, int failed, const QSet<QString> &groupsBefore);
 
     void onVCardReceived(QXmppVCardIq);
+    void onAvatarTranscoded(const QString &sourceToken, const QByteArray &data, const QString &mimeType);
+    void onAvatarTranscodingFailed(const QString &sourceToken);
+    void onPepAvatarReceived(const QString &jid, const QString &token, const QByteArray &data, const QString &mimeType);
     void onClientVCardReceived();
 
     void onLogMessage(QXmppLogger::MessageType type, const QString &text);
 
 private:
+    struct RosterPush {
+        QSet<QString> groups;
+        bool announceGroups;
+    };
+
     void updateAvatar(const QByteArray &photo, const QString &jid, const QString &type);
+    void updateAvatarToken(const QString &jid, const QString &token);
+    void transcodeAvatar(const QString &jid, const QString &token, const QByteArray &data, const QString &mimeType);
+    void publishAvatar(const QByteArray &avatar, const QString &mimeType);
 
     Tp::BaseConnectionContactsInterfacePtr m_contactsIface;
     Tp::BaseConnectionSimplePresenceInterfacePtr m_simplePresenceIface;
@@ -131,10 +191,23 @@ private:
     Tp::BaseConnectionAvatarsInterfacePtr m_avatarsIface;
     Tp::BaseConnectionRequestsInterfacePtr m_requestsIface;
     Tp::BaseChannelSASLAuthenticationInterfacePtr m_saslIface;
+    SearchInterfacePtr m_searchIface;
 
     QPointer<QXmppClient> m_client;
     QXmppDiscoveryManager *m_discoveryManager;
     QXmppMucManager *m_mucManager;
+    MessageArchiveSync *m_archiveSync;
+    OutboundQueue *m_outboundQueue;
+    RosterMutationEngine *m_rosterMutations;
+    IqScheduler *m_iqScheduler;
+    PepAvatarManager *m_pepAvatarManager;
+    ProxyProber *m_proxyProber;
+    RosterGroupIndex m_groupIndex;
+    QHash<QString, RosterPush> m_rosterPushes;
+    QHash<QString, bool> m_rosterPushGroups;
+    QTimer m_rosterPushTimer;
+    QSet<uint> m_capabilityChanges;
+    QTimer m_capabilityTimer;
 #if QXMPP_VERSION >= 0x000905
     QXmppCarbonManager *m_carbonManager;
 #endif
@@ -142,12 +215,19 @@ private:
     QXmppConfiguration m_clientConfig;
     UniqueHandleMap m_uniqueContactHandleMap;
     UniqueHandleMap m_uniqueRoomHandleMap;
-    QMap<QString, QString> m_avatarTokens;
-    QMap<QString, QString> m_lastResources;
-    QMap<QString, QStringList> m_contactsFeatures;
-    QMap<QString, QString> m_clientTypes;
-    QMap<QString, QXmppPresence> m_mucParticipants;
-    QList<QString> m_serverEntities;
+    MessageStore m_messageStore;
+    SearchIndex m_searchIndex;
+    DeliveryTracker m_deliveryTracker;
+    uint m_pendingMessageLimit;
+    StanzaIdGenerator m_stanzaIds;
+    AvatarCache m_avatarCache;
+    AvatarTranscoder m_avatarTranscoder;
+    QMultiHash<QString, QString> m_transcodingAvatars;
+    QString m_ownAvatarToken;
+    ContactStateTable m_contactStates;
+    CapabilityCache m_capabilityCache;
+    CapabilitySetPtr m_ownCapabilities;
+    ServiceDirectory m_serviceDirectory;
 };
 
 #endif // CONNECTION_HH
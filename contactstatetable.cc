@@ -0,0 +1,270 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#include "contactstatetable.hh"
+#include "common.hh"
+#include "uniquehandlemap.hh"
+
+static Tp::SimplePresence offlinePresence()
+{
+    Tp::SimplePresence presence;
+    presence.type = Tp::ConnectionPresenceTypeOffline;
+    presence.status = QStringLiteral("offline");
+    return presence;
+}
+
+static bool samePresence(const Tp::SimplePresence &a, const Tp::SimplePresence &b)
+{
+    return a.type == b.type && a.status == b.status && a.statusMessage == b.statusMessage;
+}
+
+ContactStateTable::ContactState::ContactState() :
+    best(-1),
+    presence(offlinePresence()),
+    mucParticipant(false)
+{
+}
+
+ContactStateTable::ContactStateTable(UniqueHandleMap &handles) :
+    m_handles(handles)
+{
+}
+
+void ContactStateTable::clear()
+{
+    /* Handles outlive the connection, so only forget what we were told since */
+    for (ContactState &state : m_states) {
+        const bool mucParticipant = state.mucParticipant;
+        state = ContactState();
+        state.mucParticipant = mucParticipant;
+    }
+}
+
+bool ContactStateTable::updatePresence(const QString &bareJid, const QString &resource, const QXmppPresence &presence)
+{
+    if (presence.type() != QXmppPresence::Available) {
+        ContactState *state = findState(bareJid);
+        const int index = state ? indexOf(*state, resource) : -1;
+        if (index < 0) {
+            return false;
+        }
+
+        state->resources.remove(index);
+
+        const Tp::SimplePresence oldPresence = state->presence;
+        updateContact(*state);
+        return !samePresence(oldPresence, state->presence);
+    }
+
+    ContactState &state = ensureState(bareJid);
+    int index = indexOf(state, resource);
+    if (index < 0) {
+        Resource entry;
+        entry.name = resource;
+        state.resources.append(entry);
+        index = state.resources.count() - 1;
+    }
+
+    Resource &entry = state.resources[index];
+    entry.priority = presence.priority();
+    entry.availability = availability(presence);
+    entry.presence = Common::toTpPresence(presence);
+
+    const Tp::SimplePresence oldPresence = state.presence;
+    updateContact(state);
+    return !samePresence(oldPresence, state.presence);
+}
+
+bool ContactStateTable::setCapabilities(const QString &bareJid, const QString &resource, const CapabilitySetPtr &capabilities)
+{
+    ContactState *state = findState(bareJid);
+    const int index = state ? indexOf(*state, resource) : -1;
+    if (index < 0) {
+        /* Gone offline in the meantime */
+        return false;
+    }
+
+    /* Capability sets are interned, equal sets are the same object */
+    Resource &entry = state->resources[index];
+    if (entry.capabilities == capabilities) {
+        return false;
+    }
+
+    entry.capabilities = capabilities;
+    return true;
+}
+
+void ContactStateTable::setLastResource(const QString &bareJid, const QString &resource)
+{
+    ContactState *state = findState(bareJid);
+    if (state) {
+        state->last = resource;
+    }
+}
+
+void ContactStateTable::setMucPresence(const QString &participant, const QXmppPresence &presence)
+{
+    ContactState &state = ensureState(participant);
+    state.mucParticipant = true;
+    state.presence = Common::toTpPresence(presence);
+}
+
+QString ContactStateTable::lastResource(const QString &bareJid) const
+{
+    const ContactState *state = findState(bareJid);
+    if (!state || indexOf(*state, state->last) < 0) {
+        return QString();
+    }
+
+    return state->last;
+}
+
+QString ContactStateTable::bestResource(const QString &bareJid) const
+{
+    const ContactState *state = findState(bareJid);
+    if (!state || state->best < 0) {
+        return QString();
+    }
+
+    return state->resources.at(state->best).name;
+}
+
+CapabilitySetPtr ContactStateTable::capabilities(const QString &bareJid, const QString &resource) const
+{
+    const Resource *entry = findResource(bareJid, resource);
+    return entry ? entry->capabilities : CapabilitySetPtr();
+}
+
+bool ContactStateTable::isMucParticipant(const QString &jid) const
+{
+    const ContactState *state = findState(jid);
+    return state && state->mucParticipant;
+}
+
+Tp::SimplePresence ContactStateTable::presence(const QString &jid) const
+{
+    const ContactState *state = findState(jid);
+    return state ? state->presence : offlinePresence();
+}
+
+Tp::SimplePresence ContactStateTable::presence(uint handle) const
+{
+    const ContactState *state = findState(handle);
+    return state ? state->presence : offlinePresence();
+}
+
+int ContactStateTable::availability(const QXmppPresence &presence)
+{
+    /* Lower is better */
+    switch (presence.availableStatusType()) {
+    case QXmppPresence::Chat:
+        return 0;
+    case QXmppPresence::Online:
+        return 1;
+    case QXmppPresence::Away:
+        return 2;
+    case QXmppPresence::XA:
+        return 3;
+    case QXmppPresence::DND:
+        return 4;
+    default:
+        return 5;
+    }
+}
+
+void ContactStateTable::updateContact(ContactState &state)
+{
+    /* Contacts rarely have more than a handful of resources */
+    const Resource *mostAvailable = nullptr;
+    state.best = -1;
+    for (int i = 0; i < state.resources.count(); ++i) {
+        const Resource &entry = state.resources.at(i);
+        if (state.best < 0) {
+            state.best = i;
+        } else {
+            const Resource &best = state.resources.at(state.best);
+            if (entry.priority > best.priority
+                    || (entry.priority == best.priority && entry.availability < best.availability)) {
+                state.best = i;
+            }
+        }
+
+        if (!mostAvailable || entry.availability < mostAvailable->availability
+                || (entry.availability == mostAvailable->availability && entry.priority > mostAvailable->priority)) {
+            mostAvailable = &entry;
+        }
+    }
+
+    state.presence = mostAvailable ? mostAvailable->presence : offlinePresence();
+}
+
+int ContactStateTable::indexOf(const ContactState &state, const QString &resource)
+{
+    for (int i = 0; i < state.resources.count(); ++i) {
+        if (state.resources.at(i).name == resource) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+ContactStateTable::ContactState &ContactStateTable::ensureState(const QString &jid)
+{
+    const uint handle = m_handles[jid];
+    if (static_cast<uint>(m_states.count()) < handle) {
+        m_states.resize(handle);
+    }
+
+    return m_states[handle - 1];
+}
+
+ContactStateTable::ContactState *ContactStateTable::findState(const QString &jid)
+{
+    const uint handle = m_handles.handle(jid);
+    if (handle == 0 || static_cast<uint>(m_states.count()) < handle) {
+        return nullptr;
+    }
+
+    return &m_states[handle - 1];
+}
+
+const ContactStateTable::ContactState *ContactStateTable::findState(const QString &jid) const
+{
+    return findState(m_handles.handle(jid));
+}
+
+const ContactStateTable::ContactState *ContactStateTable::findState(uint handle) const
+{
+    if (handle == 0 || static_cast<uint>(m_states.count()) < handle) {
+        return nullptr;
+    }
+
+    return &m_states.at(handle - 1);
+}
+
+const ContactStateTable::Resource *ContactStateTable::findResource(const QString &bareJid, const QString &resource) const
+{
+    const ContactState *state = findState(bareJid);
+    const int index = state ? indexOf(*state, resource) : -1;
+    if (index < 0) {
+        return nullptr;
+    }
+
+    return &state->resources.at(index);
+}
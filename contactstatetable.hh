@@ -0,0 +1,103 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef CONTACTSTATETABLE_HH
+#define CONTACTSTATETABLE_HH
+
+#include <QStringList>
+#include <QVarLengthArray>
+#include <QVector>
+
+#include <TelepathyQt/Types>
+
+#include <QXmppPresence.h>
+
+#include "capabilitycache.hh"
+
+class UniqueHandleMap;
+
+/* Everything we know about the presence of each contact handle: the online
+ * resources as seen in presence together with what service discovery told us
+ * about them, or the presence of a room participant.
+ *
+ * The state of all contacts is kept in one array indexed by handle, with up
+ * to two resources of a contact stored inline in its slot, so that a handle
+ * resolves all of it with a single indexed access. Contacts with more
+ * resources spill them into one heap block.
+ *
+ * The best resource (highest priority, then most available) and the
+ * aggregated presence (the most available resource) are kept up to date
+ * whenever a presence arrives, so that routing, capability and presence
+ * lookups do not have to look at all resources of a contact. */
+class ContactStateTable
+{
+public:
+    explicit ContactStateTable(UniqueHandleMap &handles);
+
+    void clear();
+
+    /* Returns whether the aggregated presence of the contact changed */
+    bool updatePresence(const QString &bareJid, const QString &resource, const QXmppPresence &presence);
+    /* Returns whether the capabilities of a known resource changed */
+    bool setCapabilities(const QString &bareJid, const QString &resource, const CapabilitySetPtr &capabilities);
+    void setLastResource(const QString &bareJid, const QString &resource);
+    void setMucPresence(const QString &participant, const QXmppPresence &presence);
+
+    QString lastResource(const QString &bareJid) const;
+    QString bestResource(const QString &bareJid) const;
+    CapabilitySetPtr capabilities(const QString &bareJid, const QString &resource) const;
+    bool isMucParticipant(const QString &jid) const;
+    Tp::SimplePresence presence(const QString &jid) const;
+    Tp::SimplePresence presence(uint handle) const;
+
+private:
+    struct Resource {
+        QString name;
+        int priority;
+        int availability;
+        Tp::SimplePresence presence;
+        CapabilitySetPtr capabilities;
+    };
+
+    struct ContactState {
+        ContactState();
+
+        QVarLengthArray<Resource, 2> resources;
+        int best;
+        QString last;
+        Tp::SimplePresence presence;
+        bool mucParticipant;
+    };
+
+    static int availability(const QXmppPresence &presence);
+    static void updateContact(ContactState &state);
+    static int indexOf(const ContactState &state, const QString &resource);
+
+    ContactState &ensureState(const QString &jid);
+    ContactState *findState(const QString &jid);
+    const ContactState *findState(const QString &jid) const;
+    const ContactState *findState(uint handle) const;
+    const Resource *findResource(const QString &bareJid, const QString &resource) const;
+
+    UniqueHandleMap &m_handles;
+
+    /* Indexed by handle - 1 */
+    QVector<ContactState> m_states;
+};
+
+#endif // CONTACTSTATETABLE_HH
@@ -0,0 +1,385 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#include "deliverytracker.hh"
+#include "common.hh"
+
+#include <QDataStream>
+#include <QDateTime>
+#include <QFile>
+#include <QSaveFile>
+
+#include <TelepathyQt/Constants>
+
+#include <algorithm>
+
+/* How long we wait for a receipt before sending the message again */
+static const qint64 receiptTimeout = 60000;
+/* How long we wait for an error reply to a message without receipt request */
+static const qint64 errorTimeout = 120000;
+/* Number of times a message is sent before it counts as failed */
+static const quint32 maxAttempts = 3;
+/* Upper bound for the number of tracked messages */
+static const int maxEntries = 1000;
+
+static const int checkInterval = 5000;
+static const int saveDelay = 2000;
+static const quint32 fileVersion = 1;
+
+/* Delivery reports only ever move forward */
+static int statusRank(uint status)
+{
+    switch (status) {
+    case Tp::DeliveryStatusDelivered:
+        return 1;
+    case Tp::DeliveryStatusRead:
+        return 2;
+    default:
+        return 0;
+    }
+}
+
+DeliveryTracker::DeliveryTracker(QObject *parent) :
+    QObject(parent),
+    m_active(false),
+    m_latencyCount(0),
+    m_latencyTotal(0),
+    m_latencyMax(0)
+{
+    m_checkTimer.setInterval(checkInterval);
+    connect(&m_checkTimer, &QTimer::timeout, this, &DeliveryTracker::checkTimeouts);
+
+    m_saveTimer.setSingleShot(true);
+    m_saveTimer.setInterval(saveDelay);
+    connect(&m_saveTimer, &QTimer::timeout, this, &DeliveryTracker::save);
+}
+
+DeliveryTracker::~DeliveryTracker()
+{
+    if (m_saveTimer.isActive()) {
+        save();
+    }
+}
+
+bool DeliveryTracker::open(const QString &fileName)
+{
+    m_fileName = fileName;
+
+    QFile file(fileName);
+    if (!file.exists()) {
+        return true;
+    }
+
+    if (!file.open(QIODevice::ReadOnly)) {
+        qCWarning(general) << "Could not open the delivery tracker state" << fileName << file.errorString();
+        return false;
+    }
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_0);
+
+    quint32 version;
+    quint32 count;
+    stream >> version >> count;
+    if (version != fileVersion) {
+        qCWarning(general) << "Ignoring delivery tracker state of unknown version" << version;
+        return false;
+    }
+
+    QList<Deadline> deadlines;
+    for (quint32 i = 0; i < count && stream.status() == QDataStream::Ok; ++i) {
+        QString token;
+        Entry entry;
+        stream >> token >> entry.conversation >> entry.body >> entry.firstSent >> entry.lastSent
+               >> entry.attempts >> entry.status >> entry.requestReceipt;
+        if (stream.status() != QDataStream::Ok) {
+            break;
+        }
+
+        m_entries.insert(token, entry);
+        if (entry.status == Tp::DeliveryStatusUnknown) {
+            deadlines.append(Deadline { token, entry.lastSent });
+        }
+    }
+
+    std::sort(deadlines.begin(), deadlines.end(),
+              [](const Deadline &a, const Deadline &b) { return a.lastSent < b.lastSent; });
+    for (const Deadline &deadline : deadlines) {
+        if (m_entries.value(deadline.token).requestReceipt) {
+            m_receiptDeadlines.enqueue(deadline);
+        } else {
+            m_errorDeadlines.enqueue(deadline);
+        }
+    }
+
+    qCDebug(general) << "Tracking the delivery of" << m_entries.count() << "messages from the last session";
+    return true;
+}
+
+void DeliveryTracker::save()
+{
+    m_saveTimer.stop();
+
+    if (m_fileName.isEmpty()) {
+        return;
+    }
+
+    if (m_entries.isEmpty()) {
+        QFile::remove(m_fileName);
+        return;
+    }
+
+    QSaveFile file(m_fileName);
+    if (!file.open(QIODevice::WriteOnly)) {
+        qCWarning(general) << "Could not save the delivery tracker state" << m_fileName << file.errorString();
+        return;
+    }
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_0);
+    stream << fileVersion << quint32(m_entries.count());
+    for (auto it = m_entries.constBegin(); it != m_entries.constEnd(); ++it) {
+        const Entry &entry = it.value();
+        stream << it.key() << entry.conversation << entry.body << entry.firstSent << entry.lastSent
+               << entry.attempts << entry.status << entry.requestReceipt;
+    }
+
+    if (!file.commit()) {
+        qCWarning(general) << "Could not save the delivery tracker state" << m_fileName << file.errorString();
+    }
+}
+
+void DeliveryTracker::setActive(bool active)
+{
+    m_active = active;
+
+    if (m_active && !(m_receiptDeadlines.isEmpty() && m_errorDeadlines.isEmpty())) {
+        m_checkTimer.start();
+    } else {
+        m_checkTimer.stop();
+    }
+}
+
+void DeliveryTracker::track(const QString &token, const QString &conversation, const QString &body, bool expectReceipt)
+{
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+
+    Entry entry;
+    entry.conversation = conversation;
+    entry.body = body;
+    entry.firstSent = now;
+    entry.lastSent = now;
+    entry.attempts = 1;
+    entry.status = Tp::DeliveryStatusUnknown;
+    entry.requestReceipt = expectReceipt;
+
+    m_entries.insert(token, entry);
+    enqueueDeadline(token, entry);
+    evict();
+    scheduleSave();
+}
+
+QStringList DeliveryTracker::acknowledge(const QString &token, uint status, bool cumulative)
+{
+    QStringList tokens;
+
+    const auto it = m_entries.constFind(token);
+    if (it == m_entries.constEnd()) {
+        /* Not tracked (any more), all we can do is to pass it on */
+        return tokens << token;
+    }
+
+    if (cumulative) {
+        /* Markers for earlier messages of the conversation may have been
+         * collapsed into this one, oldest first */
+        QList<QPair<qint64, QString>> earlier;
+        for (auto earlierIt = m_entries.constBegin(); earlierIt != m_entries.constEnd(); ++earlierIt) {
+            if (earlierIt.key() != token && earlierIt->conversation == it->conversation
+                    && earlierIt->firstSent <= it->firstSent && statusRank(earlierIt->status) < statusRank(status)) {
+                earlier.append(qMakePair(earlierIt->firstSent, earlierIt.key()));
+            }
+        }
+        std::sort(earlier.begin(), earlier.end());
+
+        for (const auto &entry : earlier) {
+            if (advance(entry.second, status)) {
+                tokens << entry.second;
+            }
+        }
+    }
+
+    if (advance(token, status)) {
+        tokens << token;
+    }
+
+    if (!tokens.isEmpty()) {
+        scheduleSave();
+    }
+
+    return tokens;
+}
+
+bool DeliveryTracker::advance(const QString &token, uint status)
+{
+    auto it = m_entries.find(token);
+    if (it == m_entries.end() || statusRank(status) <= statusRank(it->status)) {
+        return false;
+    }
+
+    if (it->status == Tp::DeliveryStatusUnknown) {
+        recordLatency(QDateTime::currentMSecsSinceEpoch() - it->firstSent);
+    }
+
+    if (status == Tp::DeliveryStatusRead) {
+        /* Nothing can follow */
+        m_entries.erase(it);
+    } else {
+        it->status = status;
+    }
+
+    return true;
+}
+
+void DeliveryTracker::fail(const QString &token)
+{
+    if (m_entries.remove(token)) {
+        scheduleSave();
+    }
+}
+
+void DeliveryTracker::checkTimeouts()
+{
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    const bool receiptsChanged = expireDeadlines(m_receiptDeadlines, receiptTimeout, now);
+    const bool errorsChanged = expireDeadlines(m_errorDeadlines, errorTimeout, now);
+
+    if (m_receiptDeadlines.isEmpty() && m_errorDeadlines.isEmpty()) {
+        m_checkTimer.stop();
+    }
+
+    if (receiptsChanged || errorsChanged) {
+        scheduleSave();
+    }
+}
+
+void DeliveryTracker::enqueueDeadline(const QString &token, const Entry &entry)
+{
+    QQueue<Deadline> &deadlines = entry.requestReceipt ? m_receiptDeadlines : m_errorDeadlines;
+    deadlines.enqueue(Deadline { token, entry.lastSent });
+
+    if (m_active && !m_checkTimer.isActive()) {
+        m_checkTimer.start();
+    }
+}
+
+bool DeliveryTracker::expireDeadlines(QQueue<Deadline> &deadlines, qint64 timeout, qint64 now)
+{
+    bool changed = false;
+
+    while (!deadlines.isEmpty()) {
+        if (!isCurrent(deadlines.head())) {
+            deadlines.dequeue();
+            continue;
+        }
+
+        /* All deadlines of a queue share the timeout, the rest is later */
+        if (deadlines.head().lastSent + timeout > now) {
+            break;
+        }
+
+        const QString token = deadlines.dequeue().token;
+        auto it = m_entries.find(token);
+        Entry &entry = it.value();
+        changed = true;
+
+        if (!entry.requestReceipt) {
+            /* No error came back, that is all we can know */
+            m_entries.erase(it);
+        } else if (entry.attempts < maxAttempts) {
+            ++entry.attempts;
+            entry.lastSent = now;
+            enqueueDeadline(token, entry);
+            qCDebug(general) << "No receipt for message" << token << "- sending it again, attempt" << entry.attempts;
+            emit resendMessage(entry.conversation, token, entry.body);
+        } else {
+            const QString conversation = entry.conversation;
+            m_entries.erase(it);
+            qCDebug(general) << "No receipt for message" << token << "after" << maxAttempts << "attempts";
+            emit deliveryFailed(conversation, token);
+        }
+    }
+
+    return changed;
+}
+
+bool DeliveryTracker::isCurrent(const Deadline &deadline) const
+{
+    auto it = m_entries.constFind(deadline.token);
+    return it != m_entries.constEnd() && it->lastSent == deadline.lastSent && it->status == Tp::DeliveryStatusUnknown;
+}
+
+void DeliveryTracker::evict()
+{
+    while (m_entries.count() > maxEntries) {
+        auto oldest = m_entries.begin();
+        for (auto it = m_entries.begin(); it != m_entries.end(); ++it) {
+            if (it->firstSent < oldest->firstSent) {
+                oldest = it;
+            }
+        }
+
+        qCDebug(general) << "Giving up on tracking the delivery of message" << oldest.key();
+        m_entries.erase(oldest);
+    }
+
+    pruneDeadlines(m_receiptDeadlines);
+    pruneDeadlines(m_errorDeadlines);
+}
+
+void DeliveryTracker::pruneDeadlines(QQueue<Deadline> &deadlines)
+{
+    /* Drop outdated deadlines once they dominate the queue */
+    if (deadlines.count() <= 2 * maxEntries) {
+        return;
+    }
+
+    QQueue<Deadline> current;
+    for (const Deadline &deadline : deadlines) {
+        if (isCurrent(deadline)) {
+            current.enqueue(deadline);
+        }
+    }
+    deadlines.swap(current);
+}
+
+void DeliveryTracker::recordLatency(qint64 latency)
+{
+    ++m_latencyCount;
+    m_latencyTotal += latency;
+    m_latencyMax = qMax(m_latencyMax, latency);
+
+    qCDebug(metrics) << "delivery latency" << latency << "ms, mean" << m_latencyTotal / qint64(m_latencyCount)
+                     << "ms, max" << m_latencyMax << "ms over" << m_latencyCount << "messages";
+}
+
+void DeliveryTracker::scheduleSave()
+{
+    if (!m_saveTimer.isActive()) {
+        m_saveTimer.start();
+    }
+}
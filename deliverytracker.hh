@@ -0,0 +1,101 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef DELIVERYTRACKER_HH
+#define DELIVERYTRACKER_HH
+
+#include <QHash>
+#include <QObject>
+#include <QQueue>
+#include <QStringList>
+#include <QTimer>
+
+/* Messages we sent and are still waiting for a delivery receipt for.
+ *
+ * Messages are keyed by their token, which is also the stanza ID, so that
+ * receipts, markers and error replies match in constant time. Messages to
+ * peers that advertised receipts or chat markers and that do not get one in
+ * time are sent again and eventually reported as failed. A chat marker also
+ * acknowledges all earlier messages of its conversation.
+ * The state is written to disk, so that it survives reconnects and
+ * restarts. */
+class DeliveryTracker : public QObject
+{
+    Q_OBJECT
+public:
+    explicit DeliveryTracker(QObject *parent = nullptr);
+    ~DeliveryTracker();
+
+    bool open(const QString &fileName);
+    void save();
+
+    void setActive(bool active);
+
+    void track(const QString &token, const QString &conversation, const QString &body, bool expectReceipt);
+    /* Returns the tokens of the messages whose delivery status moved forward */
+    QStringList acknowledge(const QString &token, uint status, bool cumulative);
+    void fail(const QString &token);
+
+signals:
+    void resendMessage(const QString &conversation, const QString &token, const QString &body);
+    void deliveryFailed(const QString &conversation, const QString &token);
+
+private slots:
+    void checkTimeouts();
+
+private:
+    struct Entry {
+        QString conversation;
+        QString body;
+        qint64 firstSent;
+        qint64 lastSent;
+        quint32 attempts;
+        quint32 status;
+        bool requestReceipt; /* Waits for a receipt, not just for errors */
+    };
+
+    struct Deadline {
+        QString token;
+        qint64 lastSent;
+    };
+
+    bool advance(const QString &token, uint status);
+    void enqueueDeadline(const QString &token, const Entry &entry);
+    bool expireDeadlines(QQueue<Deadline> &deadlines, qint64 timeout, qint64 now);
+    bool isCurrent(const Deadline &deadline) const;
+    void evict();
+    void pruneDeadlines(QQueue<Deadline> &deadlines);
+    void recordLatency(qint64 latency);
+    void scheduleSave();
+
+    QString m_fileName;
+    QHash<QString, Entry> m_entries;
+    /* One queue per timeout, so that each of them is ordered by deadline */
+    QQueue<Deadline> m_receiptDeadlines;
+    QQueue<Deadline> m_errorDeadlines;
+
+    QTimer m_checkTimer;
+    QTimer m_saveTimer;
+    bool m_active;
+
+    quint64 m_latencyCount;
+    qint64 m_latencyTotal;
+    qint64 m_latencyMax;
+};
+
+#endif // DELIVERYTRACKER_HH
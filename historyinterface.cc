@@ -0,0 +1,57 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#include "historyinterface.hh"
+#include "textchannel.hh"
+
+HistoryInterface::HistoryInterface(TextChannel *channel)
+    : Tp::AbstractChannelInterface(QLatin1String(NONSENSE_IFACE_CHANNEL_HISTORY)),
+      m_channel(channel)
+{
+}
+
+HistoryInterfacePtr HistoryInterface::create(TextChannel *channel)
+{
+    return HistoryInterfacePtr(new HistoryInterface(channel));
+}
+
+QVariantMap HistoryInterface::immutableProperties() const
+{
+    return QVariantMap();
+}
+
+void HistoryInterface::createAdaptor()
+{
+    new HistoryAdaptor(m_channel, dbusObject());
+}
+
+HistoryAdaptor::HistoryAdaptor(TextChannel *channel, QObject *parent)
+    : QDBusAbstractAdaptor(parent),
+      m_channel(channel)
+{
+}
+
+Tp::MessagePartListList HistoryAdaptor::GetMessagesByTime(qlonglong from, qlonglong to, uint limit)
+{
+    return m_channel->storedMessagesByTime(from, to, limit);
+}
+
+Tp::MessagePartListList HistoryAdaptor::GetMessagesBefore(const QString &messageToken, uint limit)
+{
+    return m_channel->storedMessagesBefore(messageToken, limit);
+}
@@ -0,0 +1,64 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef HISTORYINTERFACE_HH
+#define HISTORYINTERFACE_HH
+
+#include <QDBusAbstractAdaptor>
+
+#include <TelepathyQt/BaseChannel>
+
+#define NONSENSE_IFACE_CHANNEL_HISTORY "org.freedesktop.Telepathy.Channel.Interface.Nonsense.History"
+
+class TextChannel;
+class HistoryInterface;
+
+typedef Tp::SharedPtr<HistoryInterface> HistoryInterfacePtr;
+
+/* Scrollback from the local message store, served without any network traffic */
+class HistoryInterface : public Tp::AbstractChannelInterface
+{
+    Q_OBJECT
+public:
+    static HistoryInterfacePtr create(TextChannel *channel);
+
+    QVariantMap immutableProperties() const override;
+
+private:
+    HistoryInterface(TextChannel *channel);
+    void createAdaptor() override;
+
+    TextChannel *m_channel;
+};
+
+class HistoryAdaptor : public QDBusAbstractAdaptor
+{
+    Q_OBJECT
+    Q_CLASSINFO("D-Bus Interface", NONSENSE_IFACE_CHANNEL_HISTORY)
+public:
+    HistoryAdaptor(TextChannel *channel, QObject *parent);
+
+public slots:
+    Tp::MessagePartListList GetMessagesByTime(qlonglong from, qlonglong to, uint limit);
+    Tp::MessagePartListList GetMessagesBefore(const QString &messageToken, uint limit);
+
+private:
+    TextChannel *m_channel;
+};
+
+#endif // HISTORYINTERFACE_HH
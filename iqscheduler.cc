@@ -0,0 +1,207 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#include "iqscheduler.hh"
+#include "common.hh"
+#include "connection.hh"
+
+#include <QDateTime>
+#include <QDomElement>
+#include <QXmlStreamWriter>
+
+#include <QXmppIq.h>
+#include <QXmppUtils.h>
+
+static const int maxInFlightPerServer = 4;
+static const int tickInterval = 1000;
+static const int requestTimeout = 30; // in ticks
+static const int wheelSize = 64;
+
+IqScheduler::IqScheduler(Connection *connection) :
+    m_connection(connection),
+    m_wheel(wheelSize),
+    m_wheelPosition(0)
+{
+    m_tickTimer.setInterval(tickInterval);
+    connect(&m_tickTimer, &QTimer::timeout, this, &IqScheduler::onTick);
+}
+
+bool IqScheduler::handleStanza(const QDomElement &element)
+{
+    if (element.tagName() != QLatin1String("iq")) {
+        return false;
+    }
+
+    const QString type = element.attribute(QStringLiteral("type"));
+    if (type != QLatin1String("result") && type != QLatin1String("error")) {
+        return false;
+    }
+
+    const auto it = m_keysById.find(element.attribute(QStringLiteral("id")));
+    if (it == m_keysById.end()) {
+        return false;
+    }
+
+    const QString id = it.key();
+    const QString key = it.value();
+    m_keysById.erase(it);
+    finish(key, type == QLatin1String("result") ? "ok" : "error");
+
+    if (type == QLatin1String("error")) {
+        emit errorReceived(id);
+    }
+
+    /* Whoever asked for it handles the content */
+    return false;
+}
+
+QString IqScheduler::request(const QString &key, QXmppIq &iq, Priority priority)
+{
+    auto existing = m_requests.find(key);
+    if (existing != m_requests.end()) {
+        /* Somebody is waiting now, let a queued background request overtake */
+        if (priority < existing->priority && existing->sent == 0) {
+            Server &server = m_servers[existing->server];
+            server.queues[existing->priority].removeOne(key);
+            server.queues[priority].enqueue(key);
+            existing->priority = priority;
+        }
+
+        qCDebug(general) << "Merging IQ request" << key;
+        return existing->id;
+    }
+
+    if (iq.id().isEmpty()) {
+        iq.setId(m_connection->nextStanzaId());
+    }
+
+    Request request;
+    request.id = iq.id();
+    request.server = QXmppUtils::jidToDomain(iq.to());
+    request.priority = priority;
+    request.queued = QDateTime::currentMSecsSinceEpoch();
+    request.sent = 0;
+
+    /* Serialize right away, the caller's IQ may be of any subclass */
+    QXmlStreamWriter writer(&request.data);
+    iq.toXml(&writer);
+
+    m_requests.insert(key, request);
+    m_servers[request.server].queues[priority].enqueue(key);
+    dispatch(request.server);
+
+    return request.id;
+}
+
+void IqScheduler::clear()
+{
+    m_requests.clear();
+    m_keysById.clear();
+    m_servers.clear();
+    for (QList<QString> &slot : m_wheel) {
+        slot.clear();
+    }
+    m_tickTimer.stop();
+}
+
+void IqScheduler::onTick()
+{
+    m_wheelPosition = (m_wheelPosition + 1) % wheelSize;
+    const QList<QString> ids = m_wheel[m_wheelPosition];
+    m_wheel[m_wheelPosition].clear();
+
+    for (const QString &id : ids) {
+        const auto it = m_keysById.find(id);
+        if (it == m_keysById.end()) {
+            /* Answered in time */
+            continue;
+        }
+
+        const QString key = it.value();
+        m_keysById.erase(it);
+        qCDebug(general) << "IQ request" << key << "timed out";
+        finish(key, "timeout");
+        emit timedOut(id);
+    }
+
+    if (m_keysById.isEmpty()) {
+        m_tickTimer.stop();
+    }
+}
+
+void IqScheduler::dispatch(const QString &serverName)
+{
+    auto server = m_servers.find(serverName);
+    if (server == m_servers.end()) {
+        return;
+    }
+
+    for (int priority = 0; priority < PriorityCount; ++priority) {
+        QQueue<QString> &queue = server->queues[priority];
+        while (server->inFlight < maxInFlightPerServer && !queue.isEmpty()) {
+            ++server->inFlight;
+            send(queue.dequeue());
+        }
+    }
+
+    if (server->inFlight == 0) {
+        m_servers.erase(server);
+    }
+}
+
+void IqScheduler::send(const QString &key)
+{
+    Request &request = m_requests[key];
+    request.sent = QDateTime::currentMSecsSinceEpoch();
+
+    m_keysById.insert(request.id, key);
+    m_wheel[(m_wheelPosition + requestTimeout) % wheelSize].append(request.id);
+    if (!m_tickTimer.isActive()) {
+        m_tickTimer.start();
+    }
+
+    if (!m_connection->sendStanza(RawStanza(request.data), OutboundQueue::BulkIq)) {
+        /* Treated like a lost reply, the timeout cleans up */
+        qCDebug(general) << "Could not send IQ request" << key;
+    }
+}
+
+void IqScheduler::finish(const QString &key, const char *outcome)
+{
+    const Request request = m_requests.take(key);
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+
+    const QString counter = kind(key) + QLatin1Char(' ') + QLatin1String(outcome);
+    const int count = ++m_counts[counter];
+    const qint64 latency = now - request.sent;
+    const qint64 total = m_latencyTotals[counter] += latency;
+
+    qCDebug(metrics) << "iq" << counter << "queued" << request.sent - request.queued << "ms, latency" << latency
+                     << "ms, mean" << total / count << "ms over" << count << "requests";
+
+    auto server = m_servers.find(request.server);
+    if (server != m_servers.end()) {
+        --server->inFlight;
+        dispatch(request.server);
+    }
+}
+
+QString IqScheduler::kind(const QString &key)
+{
+    return key.section(QLatin1Char(' '), 0, 0);
+}
@@ -0,0 +1,102 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef IQSCHEDULER_HH
+#define IQSCHEDULER_HH
+
+#include <QHash>
+#include <QQueue>
+#include <QTimer>
+#include <QVector>
+
+#include <QXmppClientExtension.h>
+
+class Connection;
+class QXmppIq;
+
+/* Flow control for the IQ queries we send to fetch data (vCards, disco,
+ * avatars).
+ *
+ * Requests are identified by a key chosen by the caller; a request for a
+ * key that is already queued or in flight is merged into the existing one.
+ * At most a few queries are in flight per server, and requests that a user
+ * is waiting for overtake background ones. Timeouts are tracked in a timer
+ * wheel so that thousands of queries cost one timer.
+ *
+ * The scheduler must be the first extension of the client: it only watches
+ * the replies and leaves them to the extension that handles their content. */
+class IqScheduler : public QXmppClientExtension
+{
+    Q_OBJECT
+public:
+    enum Priority {
+        Interactive,
+        Background,
+        PriorityCount
+    };
+
+    explicit IqScheduler(Connection *connection);
+
+    bool handleStanza(const QDomElement &element) override;
+
+    QString request(const QString &key, QXmppIq &iq, Priority priority);
+    void clear();
+
+signals:
+    void timedOut(const QString &id);
+    void errorReceived(const QString &id);
+
+private slots:
+    void onTick();
+
+private:
+    struct Request {
+        QString id;
+        QString server;
+        QByteArray data;
+        Priority priority;
+        qint64 queued;
+        qint64 sent;
+    };
+
+    struct Server {
+        int inFlight;
+        QQueue<QString> queues[PriorityCount];
+    };
+
+    void dispatch(const QString &server);
+    void send(const QString &key);
+    void finish(const QString &key, const char *outcome);
+
+    static QString kind(const QString &key);
+
+    Connection *m_connection;
+
+    QHash<QString, Request> m_requests;
+    QHash<QString, QString> m_keysById;
+    QHash<QString, Server> m_servers;
+
+    QVector<QList<QString>> m_wheel;
+    int m_wheelPosition;
+    QTimer m_tickTimer;
+
+    QHash<QString, int> m_counts;
+    QHash<QString, qint64> m_latencyTotals;
+};
+
+#endif // IQSCHEDULER_HH
@@ -0,0 +1,118 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#include "markeraggregator.hh"
+
+/* How long markers are collected before they are sent */
+static const int flushDelay = 500;
+/* Number of messages whose arrival order we remember */
+static const int maxTrackedMessages = 4096;
+
+MarkerAggregator::MarkerAggregator(QObject *parent) :
+    QObject(parent),
+    m_nextSequence(1),
+    m_displayedSequence(0)
+{
+    m_timer.setSingleShot(true);
+    m_timer.setInterval(flushDelay);
+    connect(&m_timer, &QTimer::timeout, this, &MarkerAggregator::flush);
+}
+
+void MarkerAggregator::addMessage(const QString &id)
+{
+    if (id.isEmpty() || m_sequences.contains(id)) {
+        return;
+    }
+
+    remember(id, m_nextSequence++);
+}
+
+void MarkerAggregator::addReceived(const QString &to, const QString &id)
+{
+    addMessage(id);
+    setPending(m_received, to, id);
+}
+
+void MarkerAggregator::addDisplayed(const QString &to, const QString &id)
+{
+    /* Already covered by a marker that went out */
+    if (m_displayedSequence > 0 && m_sequences.value(id) <= m_displayedSequence) {
+        return;
+    }
+
+    setPending(m_displayed, to, id);
+}
+
+void MarkerAggregator::flush()
+{
+    m_timer.stop();
+
+    /* Displayed implies received */
+    if (m_received.isValid() && !(m_displayed.isValid() && m_displayed.sequence >= m_received.sequence)) {
+        emit sendMarker(QXmppMessage::Received, m_received.to, m_received.id);
+    }
+
+    if (m_displayed.isValid()) {
+        emit sendMarker(QXmppMessage::Displayed, m_displayed.to, m_displayed.id);
+        m_displayedSequence = qMax(m_displayedSequence, m_displayed.sequence);
+        prune(m_displayedSequence);
+    }
+
+    m_received = PendingMarker();
+    m_displayed = PendingMarker();
+}
+
+void MarkerAggregator::remember(const QString &id, quint64 sequence)
+{
+    m_sequences.insert(id, sequence);
+    m_order.enqueue(id);
+
+    while (m_order.count() > maxTrackedMessages) {
+        m_sequences.remove(m_order.dequeue());
+    }
+}
+
+void MarkerAggregator::setPending(PendingMarker &marker, const QString &to, const QString &id)
+{
+    if (id.isEmpty()) {
+        return;
+    }
+
+    /* Messages we do not know about (e.g. from before a restart) are older than everything else */
+    const quint64 sequence = m_sequences.value(id);
+    if (marker.isValid() && sequence <= marker.sequence) {
+        return;
+    }
+
+    marker.to = to;
+    marker.id = id;
+    marker.sequence = sequence;
+
+    /* Do not postpone markers that are already waiting */
+    if (!m_timer.isActive()) {
+        m_timer.start();
+    }
+}
+
+void MarkerAggregator::prune(quint64 sequence)
+{
+    /* Nothing can be newer than a message that is already displayed */
+    while (!m_order.isEmpty() && m_sequences.value(m_order.head()) <= sequence) {
+        m_sequences.remove(m_order.dequeue());
+    }
+}
@@ -0,0 +1,78 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef MARKERAGGREGATOR_HH
+#define MARKERAGGREGATOR_HH
+
+#include <QHash>
+#include <QObject>
+#include <QQueue>
+#include <QTimer>
+
+#include <QXmppMessage.h>
+
+/* Collapses the chat markers (XEP-0333) of one conversation.
+ *
+ * A marker for a message implies the same marker for all earlier ones, so
+ * only the newest received and displayed marker is kept and sent when the
+ * timer fires. A displayed marker also covers a received marker for an
+ * older message. Messages are ordered by their arrival, which is why every
+ * incoming message has to be announced with addMessage(), including the
+ * ones caught up from the archive. */
+class MarkerAggregator : public QObject
+{
+    Q_OBJECT
+public:
+    explicit MarkerAggregator(QObject *parent = nullptr);
+
+    void addMessage(const QString &id);
+    void addReceived(const QString &to, const QString &id);
+    void addDisplayed(const QString &to, const QString &id);
+
+public slots:
+    void flush();
+
+signals:
+    void sendMarker(QXmppMessage::Marker marker, const QString &to, const QString &id);
+
+private:
+    struct PendingMarker {
+        PendingMarker() : sequence(0) { }
+
+        bool isValid() const { return !id.isEmpty(); }
+
+        QString to;
+        QString id;
+        quint64 sequence;
+    };
+
+    void remember(const QString &id, quint64 sequence);
+    void setPending(PendingMarker &marker, const QString &to, const QString &id);
+    void prune(quint64 sequence);
+
+    QHash<QString, quint64> m_sequences;
+    QQueue<QString> m_order;
+    quint64 m_nextSequence;
+    quint64 m_displayedSequence;
+
+    PendingMarker m_received;
+    PendingMarker m_displayed;
+    QTimer m_timer;
+};
+
+#endif // MARKERAGGREGATOR_HH
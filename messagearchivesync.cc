@@ -0,0 +1,247 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#include "messagearchivesync.hh"
+#include "common.hh"
+
+#include <QSettings>
+
+#include <QXmppClient.h>
+#include <QXmppIq.h>
+#include <QXmppUtils.h>
+#if QXMPP_VERSION >= 0x010000
+#include <QXmppMamManager.h>
+#include <QXmppResultSet.h>
+#endif
+
+/* Most servers cap the page size at about this value */
+static const int archivePageSize = 250;
+/* Number of message keys that we remember for de-duplication */
+static const int maxSeenKeys = 2000;
+
+MessageArchiveSync::MessageArchiveSync(QXmppClient *client, const QString &statePath, QObject *parent) :
+    QObject(parent),
+    m_client(client),
+    m_mamManager(nullptr),
+    m_statePath(statePath),
+    m_bootstrapping(false)
+{
+    QSettings state(m_statePath, QSettings::IniFormat);
+    m_lastId = state.value(QStringLiteral("mam/last-id")).toString();
+    for (const QString &key : state.value(QStringLiteral("mam/seen")).toStringList()) {
+        m_seenKeys.insert(key);
+        m_seenOrder.enqueue(key);
+    }
+
+#if QXMPP_VERSION >= 0x010000
+    QXmppMamManager *mamManager = new QXmppMamManager;
+    m_client->addExtension(mamManager);
+    m_mamManager = mamManager;
+
+    connect(mamManager, &QXmppMamManager::archivedMessageReceived, this, &MessageArchiveSync::onArchivedMessageReceived);
+    connect(mamManager, &QXmppMamManager::resultsRecieved, this,
+            [this](const QString &queryId, const QXmppResultSetReply &reply, bool complete) {
+        onResultsReceived(queryId, reply.last(), complete);
+    });
+    /* Errors carry no <fin/>, so the manager leaves them to the client */
+    connect(m_client, &QXmppClient::iqReceived, this, &MessageArchiveSync::onIqReceived);
+#endif
+}
+
+MessageArchiveSync::~MessageArchiveSync()
+{
+    saveState();
+}
+
+bool MessageArchiveSync::isSupported()
+{
+#if QXMPP_VERSION >= 0x010000
+    return true;
+#else
+    return false;
+#endif
+}
+
+void MessageArchiveSync::start()
+{
+    DBG;
+
+    if (!isSupported() || isRunning()) {
+        return;
+    }
+
+    /* Without a known position in the archive, we only look up the newest
+     * archive ID. Everything older has either been delivered as offline
+     * message or was never meant for this account. */
+    m_bootstrapping = m_lastId.isEmpty();
+    requestPage();
+}
+
+bool MessageArchiveSync::isRunning() const
+{
+    return !m_queryId.isEmpty();
+}
+
+void MessageArchiveSync::requestPage()
+{
+#if QXMPP_VERSION >= 0x010000
+    QXmppResultSetQuery resultSetQuery;
+    if (m_bootstrapping) {
+        resultSetQuery.setMax(1);
+        resultSetQuery.setBefore(QLatin1String(""));
+    } else {
+        resultSetQuery.setMax(archivePageSize);
+        resultSetQuery.setAfter(m_lastId);
+    }
+
+    QXmppMamManager *mamManager = static_cast<QXmppMamManager *>(m_mamManager);
+    m_queryId = mamManager->retrieveArchivedMessages(QString(), QString(), QString(), QDateTime(), QDateTime(), resultSetQuery);
+#endif
+}
+
+void MessageArchiveSync::onArchivedMessageReceived(const QString &queryId, const QXmppMessage &message)
+{
+    if (queryId != m_queryId || m_bootstrapping) {
+        return;
+    }
+
+    m_page.append(message);
+}
+
+void MessageArchiveSync::onResultsReceived(const QString &queryId, const QString &lastId, bool complete)
+{
+    if (queryId != m_queryId) {
+        return;
+    }
+
+    const QList<QXmppMessage> page = m_page;
+    m_page.clear();
+    m_queryId.clear();
+
+    if (!lastId.isEmpty()) {
+        m_lastId = lastId;
+    }
+
+    if (m_bootstrapping) {
+        m_bootstrapping = false;
+        complete = true;
+    }
+
+    /* Ask for the next page before we deliver the current one, so that the
+     * server can prepare it while we are busy with the batch. */
+    if (!complete && !lastId.isEmpty()) {
+        requestPage();
+    }
+
+    qCDebug(general) << "Received" << page.count() << "archived messages, complete:" << complete;
+    deliverPage(page);
+    saveState();
+
+    if (!isRunning()) {
+        emit finished();
+    }
+}
+
+void MessageArchiveSync::onIqReceived(const QXmppIq &iq)
+{
+    if (iq.id() != m_queryId || iq.type() != QXmppIq::Error) {
+        return;
+    }
+
+    qCWarning(general) << "The server rejected the archive query:" << iq.error().text();
+    m_page.clear();
+    m_queryId.clear();
+
+    if (iq.error().condition() == QXmppStanza::Error::ItemNotFound && !m_bootstrapping) {
+        /* The server no longer has the message we caught up to, start over
+         * from the newest one instead of failing on every login */
+        m_lastId.clear();
+        m_bootstrapping = true;
+        requestPage();
+        return;
+    }
+
+    m_bootstrapping = false;
+    saveState();
+    emit finished();
+}
+
+void MessageArchiveSync::deliverPage(const QList<QXmppMessage> &page)
+{
+    const QString selfBareJid = m_client->configuration().jidBare();
+
+    /* Group the page by conversation, keeping the archive order */
+    QStringList contacts;
+    QHash<QString, QList<QXmppMessage>> conversations;
+
+    for (const QXmppMessage &message : page) {
+        if (message.type() == QXmppMessage::GroupChat) {
+            continue;
+        }
+
+        if (checkAndRemember(message)) {
+            continue;
+        }
+
+        QString contactJid = QXmppUtils::jidToBareJid(message.from());
+        if (contactJid == selfBareJid) {
+            contactJid = QXmppUtils::jidToBareJid(message.to());
+        }
+
+        if (!conversations.contains(contactJid)) {
+            contacts.append(contactJid);
+        }
+        conversations[contactJid].append(message);
+    }
+
+    for (const QString &contactJid : contacts) {
+        emit messagesReceived(contactJid, conversations.value(contactJid));
+    }
+}
+
+bool MessageArchiveSync::checkAndRemember(const QXmppMessage &message)
+{
+    if (message.id().isEmpty()) {
+        return false;
+    }
+
+    const QString key = messageKey(message);
+    if (m_seenKeys.contains(key)) {
+        return true;
+    }
+
+    m_seenKeys.insert(key);
+    m_seenOrder.enqueue(key);
+    while (m_seenOrder.count() > maxSeenKeys) {
+        m_seenKeys.remove(m_seenOrder.dequeue());
+    }
+
+    return false;
+}
+
+void MessageArchiveSync::saveState() const
+{
+    QSettings state(m_statePath, QSettings::IniFormat);
+    state.setValue(QStringLiteral("mam/last-id"), m_lastId);
+    state.setValue(QStringLiteral("mam/seen"), QStringList(m_seenOrder));
+}
+
+QString MessageArchiveSync::messageKey(const QXmppMessage &message)
+{
+    return QXmppUtils::jidToBareJid(message.from()) + QLatin1Char(' ') + message.id();
+}
@@ -0,0 +1,79 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef MESSAGEARCHIVESYNC_HH
+#define MESSAGEARCHIVESYNC_HH
+
+#include <QObject>
+#include <QQueue>
+#include <QSet>
+
+#include <QXmppMessage.h>
+
+class QXmppClient;
+class QXmppClientExtension;
+class QXmppIq;
+
+/* Catches up on everything that was archived on the server (XEP-0313) while
+ * we were offline. The archive is paged with RSM from the last archive ID that
+ * we have seen and each page is handed out as one batch per conversation. */
+class MessageArchiveSync : public QObject
+{
+    Q_OBJECT
+public:
+    MessageArchiveSync(QXmppClient *client, const QString &statePath, QObject *parent = nullptr);
+    ~MessageArchiveSync();
+
+    static bool isSupported();
+
+    void start();
+    bool isRunning() const;
+
+    /* Returns true if the message has been delivered before (either live or
+     * from the archive) and remembers it otherwise. */
+    bool checkAndRemember(const QXmppMessage &message);
+
+    void saveState() const;
+
+signals:
+    void messagesReceived(const QString &contactJid, const QList<QXmppMessage> &messages);
+    void finished();
+
+private:
+    void requestPage();
+    void onArchivedMessageReceived(const QString &queryId, const QXmppMessage &message);
+    void onResultsReceived(const QString &queryId, const QString &lastId, bool complete);
+    void onIqReceived(const QXmppIq &iq);
+    void deliverPage(const QList<QXmppMessage> &page);
+
+    static QString messageKey(const QXmppMessage &message);
+
+    QXmppClient *m_client;
+    QXmppClientExtension *m_mamManager;
+    QString m_statePath;
+
+    QString m_lastId;
+    QString m_queryId;
+    QList<QXmppMessage> m_page;
+    bool m_bootstrapping;
+
+    QSet<QString> m_seenKeys;
+    QQueue<QString> m_seenOrder;
+};
+
+#endif // MESSAGEARCHIVESYNC_HH
@@ -0,0 +1,117 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#include "messageparts.hh"
+
+namespace {
+
+const QString messageTokenKey = QStringLiteral("message-token");
+const QString messageSentKey = QStringLiteral("message-sent");
+const QString messageReceivedKey = QStringLiteral("message-received");
+const QString messageSenderKey = QStringLiteral("message-sender");
+const QString messageSenderIdKey = QStringLiteral("message-sender-id");
+const QString messageTypeKey = QStringLiteral("message-type");
+const QString deliveryStatusKey = QStringLiteral("delivery-status");
+const QString deliveryTokenKey = QStringLiteral("delivery-token");
+const QString deliveryErrorMessageKey = QStringLiteral("delivery-error-message");
+const QString scrollbackKey = QStringLiteral("scrollback");
+const QString contentTypeKey = QStringLiteral("content-type");
+const QString contentKey = QStringLiteral("content");
+const QString textPlain = QStringLiteral("text/plain");
+
+}
+
+MessagePartsBuilder::MessagePartsBuilder()
+{
+}
+
+MessagePartsBuilder &MessagePartsBuilder::setToken(const QString &token)
+{
+    m_header.insert(messageTokenKey, QDBusVariant(token));
+    return *this;
+}
+
+MessagePartsBuilder &MessagePartsBuilder::setSent(qint64 timestamp)
+{
+    m_header.insert(messageSentKey, QDBusVariant(timestamp));
+    return *this;
+}
+
+MessagePartsBuilder &MessagePartsBuilder::setReceived(qint64 timestamp)
+{
+    m_header.insert(messageReceivedKey, QDBusVariant(timestamp));
+    return *this;
+}
+
+MessagePartsBuilder &MessagePartsBuilder::setSender(uint handle, const QString &id)
+{
+    m_header.insert(messageSenderKey, QDBusVariant(handle));
+    m_header.insert(messageSenderIdKey, QDBusVariant(id));
+    return *this;
+}
+
+MessagePartsBuilder &MessagePartsBuilder::setType(uint type)
+{
+    m_header.insert(messageTypeKey, QDBusVariant(type));
+    return *this;
+}
+
+MessagePartsBuilder &MessagePartsBuilder::setDeliveryStatus(uint status)
+{
+    m_header.insert(deliveryStatusKey, QDBusVariant(status));
+    return *this;
+}
+
+MessagePartsBuilder &MessagePartsBuilder::setDeliveryToken(const QString &token)
+{
+    m_header.insert(deliveryTokenKey, QDBusVariant(token));
+    return *this;
+}
+
+MessagePartsBuilder &MessagePartsBuilder::setDeliveryErrorMessage(QString message)
+{
+    m_header.insert(deliveryErrorMessageKey, QDBusVariant(QVariant(std::move(message))));
+    return *this;
+}
+
+MessagePartsBuilder &MessagePartsBuilder::setScrollback(bool scrollback)
+{
+    m_header.insert(scrollbackKey, QDBusVariant(scrollback));
+    return *this;
+}
+
+MessagePartsBuilder &MessagePartsBuilder::setTextContent(QString content)
+{
+    m_content.insert(contentTypeKey, QDBusVariant(textPlain));
+    m_content.insert(contentKey, QDBusVariant(QVariant(std::move(content))));
+    return *this;
+}
+
+Tp::MessagePartList MessagePartsBuilder::take()
+{
+    Tp::MessagePartList parts;
+    parts.reserve(m_content.isEmpty() ? 1 : 2);
+    parts.append(std::move(m_header));
+    if (!m_content.isEmpty()) {
+        parts.append(std::move(m_content));
+    }
+
+    m_header = Tp::MessagePart();
+    m_content = Tp::MessagePart();
+    return parts;
+}
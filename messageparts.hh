@@ -0,0 +1,52 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef MESSAGEPARTS_HH
+#define MESSAGEPARTS_HH
+
+#include <TelepathyQt/Types>
+
+/* Builds the part list of a single message.
+ *
+ * The keys are shared, preallocated strings and the body is moved into the
+ * content part without a deep copy, so filling in a message only allocates
+ * the map nodes. */
+class MessagePartsBuilder
+{
+public:
+    MessagePartsBuilder();
+
+    MessagePartsBuilder &setToken(const QString &token);
+    MessagePartsBuilder &setSent(qint64 timestamp);
+    MessagePartsBuilder &setReceived(qint64 timestamp);
+    MessagePartsBuilder &setSender(uint handle, const QString &id);
+    MessagePartsBuilder &setType(uint type);
+    MessagePartsBuilder &setDeliveryStatus(uint status);
+    MessagePartsBuilder &setDeliveryToken(const QString &token);
+    MessagePartsBuilder &setDeliveryErrorMessage(QString message);
+    MessagePartsBuilder &setScrollback(bool scrollback);
+    MessagePartsBuilder &setTextContent(QString content);
+
+    Tp::MessagePartList take();
+
+private:
+    Tp::MessagePart m_header;
+    Tp::MessagePart m_content;
+};
+
+#endif // MESSAGEPARTS_HH
@@ -0,0 +1,343 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#include "messagestore.hh"
+#include "common.hh"
+
+#include <QDataStream>
+#include <QtEndian>
+
+#include <algorithm>
+
+/* Each record is a little endian quint32 length followed by the payload */
+static const int recordHeaderSize = sizeof(quint32);
+/* Records that may be appended before the log is mapped again, at least */
+static const qint64 minimumUnmappedSize = 64 * 1024;
+
+MessageStore::MessageStore() :
+    m_size(0),
+    m_map(nullptr),
+    m_mappedSize(0)
+{
+}
+
+MessageStore::~MessageStore()
+{
+    if (m_map) {
+        m_file.unmap(m_map);
+    }
+}
+
+bool MessageStore::open(const QString &fileName)
+{
+    m_file.setFileName(fileName);
+    if (!m_file.open(QIODevice::ReadWrite)) {
+        qCWarning(general) << "Could not open the message store" << fileName << m_file.errorString();
+        return false;
+    }
+
+    m_size = m_file.size();
+    if (m_size == 0) {
+        return true;
+    }
+
+    if (!ensureMapped()) {
+        return false;
+    }
+
+    qint64 offset = 0;
+    while (offset + recordHeaderSize <= m_size) {
+        const quint32 length = qFromLittleEndian<quint32>(m_map + offset);
+        if (offset + recordHeaderSize + length > m_size) {
+            break;
+        }
+
+        indexRecord(offset, m_map + offset + recordHeaderSize, length);
+        offset += recordHeaderSize + length;
+    }
+
+    if (offset != m_size) {
+        /* The last record was not written completely, most probably we crashed */
+        qCWarning(general) << "Dropping" << m_size - offset << "bytes of garbage from the message store";
+        m_file.unmap(m_map);
+        m_map = nullptr;
+        m_mappedSize = 0;
+        m_file.resize(offset);
+        m_size = offset;
+    }
+
+    qCDebug(general) << "Message store contains" << m_ids.count() << "messages in" << m_conversations.count() << "conversations";
+    return true;
+}
+
+bool MessageStore::isOpen() const
+{
+    return m_file.isOpen();
+}
+
+bool MessageStore::append(const StoredMessage &message)
+{
+    if (!isOpen() || !message.isValid()) {
+        return false;
+    }
+
+    if (!message.id.isEmpty() && contains(message.conversation, message.id)) {
+        return false;
+    }
+
+    QByteArray payload;
+    QDataStream stream(&payload, QIODevice::WriteOnly);
+    stream.setVersion(QDataStream::Qt_5_0);
+    stream << quint8(MessageRecord) << message.conversation << message.id << message.timestamp
+           << quint32(message.flags) << message.senderId << message.body;
+
+    const qint64 offset = m_size;
+    if (!writeRecord(payload)) {
+        return false;
+    }
+
+    indexMessage(message, offset);
+    return true;
+}
+
+void MessageStore::setDeliveryStatus(const QString &conversation, const QString &id, uint status)
+{
+    if (!isOpen() || !contains(conversation, id)) {
+        return;
+    }
+
+    QByteArray payload;
+    QDataStream stream(&payload, QIODevice::WriteOnly);
+    stream.setVersion(QDataStream::Qt_5_0);
+    stream << quint8(StatusRecord) << conversation << id << quint32(status);
+
+    if (writeRecord(payload)) {
+        m_statuses.insert(idKey(conversation, id), status);
+    }
+}
+
+bool MessageStore::contains(const QString &conversation, const QString &id) const
+{
+    return m_ids.contains(idKey(conversation, id));
+}
+
+StoredMessage MessageStore::message(const QString &conversation, const QString &id)
+{
+    const auto it = m_ids.constFind(idKey(conversation, id));
+    if (it == m_ids.constEnd()) {
+        return StoredMessage();
+    }
+
+    return readMessage(it.value());
+}
+
+int MessageStore::count(const QString &conversation) const
+{
+    return m_conversations.value(conversation).count();
+}
+
+QList<StoredMessage> MessageStore::messagesByTime(const QString &conversation, qint64 from, qint64 to, int limit)
+{
+    QList<StoredMessage> result;
+
+    const auto conversationIt = m_conversations.constFind(conversation);
+    if (conversationIt == m_conversations.constEnd() || limit <= 0) {
+        return result;
+    }
+
+    const QVector<IndexEntry> &entries = conversationIt.value();
+    auto first = std::lower_bound(entries.constBegin(), entries.constEnd(), from,
+                                  [](const IndexEntry &entry, qint64 timestamp) { return entry.timestamp < timestamp; });
+    auto last = std::upper_bound(first, entries.constEnd(), to,
+                                 [](qint64 timestamp, const IndexEntry &entry) { return timestamp < entry.timestamp; });
+
+    if (last - first > limit) {
+        first = last - limit;
+    }
+
+    result.reserve(last - first);
+    for (auto it = first; it != last; ++it) {
+        result.append(readMessage(it->offset));
+    }
+
+    return result;
+}
+
+QList<StoredMessage> MessageStore::messagesBefore(const QString &conversation, const QString &id, int limit)
+{
+    QList<StoredMessage> result;
+
+    const auto idIt = m_ids.constFind(idKey(conversation, id));
+    const auto conversationIt = m_conversations.constFind(conversation);
+    if (idIt == m_ids.constEnd() || conversationIt == m_conversations.constEnd() || limit <= 0) {
+        return result;
+    }
+
+    const qint64 offset = idIt.value();
+    const qint64 timestamp = readMessage(offset).timestamp;
+
+    const QVector<IndexEntry> &entries = conversationIt.value();
+    auto last = std::lower_bound(entries.constBegin(), entries.constEnd(), timestamp,
+                                 [](const IndexEntry &entry, qint64 timestamp) { return entry.timestamp < timestamp; });
+    while (last != entries.constEnd() && last->offset != offset) {
+        ++last;
+    }
+
+    auto first = last - std::min<qint64>(limit, last - entries.constBegin());
+    result.reserve(last - first);
+    for (auto it = first; it != last; ++it) {
+        result.append(readMessage(it->offset));
+    }
+
+    return result;
+}
+
+bool MessageStore::writeRecord(const QByteArray &payload)
+{
+    uchar header[recordHeaderSize];
+    qToLittleEndian<quint32>(payload.size(), header);
+
+    m_file.seek(m_size);
+    if (m_file.write(reinterpret_cast<const char *>(header), recordHeaderSize) != recordHeaderSize
+            || m_file.write(payload) != payload.size()) {
+        qCWarning(general) << "Could not write to the message store:" << m_file.errorString();
+        m_file.resize(m_size);
+        return false;
+    }
+
+    m_file.flush();
+    m_size += recordHeaderSize + payload.size();
+    return true;
+}
+
+bool MessageStore::ensureMapped()
+{
+    if (m_map && m_size - m_mappedSize <= qMax(m_mappedSize, minimumUnmappedSize)) {
+        return true;
+    }
+
+    if (m_map) {
+        m_file.unmap(m_map);
+    }
+
+    m_map = m_file.map(0, m_size);
+    if (!m_map) {
+        qCWarning(general) << "Could not map the message store:" << m_file.errorString();
+        m_mappedSize = 0;
+        return false;
+    }
+
+    m_mappedSize = m_size;
+    return true;
+}
+
+QByteArray MessageStore::readRecord(qint64 offset)
+{
+    if (!ensureMapped()) {
+        return QByteArray();
+    }
+
+    /* Records are only ever mapped as a whole */
+    if (offset < m_mappedSize) {
+        const quint32 length = qFromLittleEndian<quint32>(m_map + offset);
+        return QByteArray::fromRawData(reinterpret_cast<const char *>(m_map + offset + recordHeaderSize), length);
+    }
+
+    uchar header[recordHeaderSize];
+    m_file.seek(offset);
+    if (m_file.read(reinterpret_cast<char *>(header), recordHeaderSize) != recordHeaderSize) {
+        qCWarning(general) << "Could not read from the message store:" << m_file.errorString();
+        return QByteArray();
+    }
+
+    return m_file.read(qFromLittleEndian<quint32>(header));
+}
+
+StoredMessage MessageStore::readMessage(qint64 offset)
+{
+    StoredMessage message;
+    const QByteArray data = readRecord(offset);
+    if (data.isEmpty()) {
+        return message;
+    }
+
+    QDataStream stream(data);
+    stream.setVersion(QDataStream::Qt_5_0);
+
+    quint8 type;
+    quint32 flags;
+    stream >> type >> message.conversation >> message.id >> message.timestamp >> flags >> message.senderId >> message.body;
+    message.flags = flags;
+    message.deliveryStatus = m_statuses.value(idKey(message.conversation, message.id));
+
+    return message;
+}
+
+void MessageStore::indexRecord(qint64 offset, const uchar *data, quint32 length)
+{
+    QByteArray record = QByteArray::fromRawData(reinterpret_cast<const char *>(data), length);
+    QDataStream stream(record);
+    stream.setVersion(QDataStream::Qt_5_0);
+
+    quint8 type;
+    stream >> type;
+
+    switch (type) {
+    case MessageRecord: {
+        StoredMessage message;
+        stream >> message.conversation >> message.id >> message.timestamp;
+        indexMessage(message, offset);
+        break;
+    }
+    case StatusRecord: {
+        QString conversation;
+        QString id;
+        quint32 status;
+        stream >> conversation >> id >> status;
+        m_statuses.insert(idKey(conversation, id), status);
+        break;
+    }
+    default:
+        qCWarning(general) << "Unknown record type" << type << "in the message store";
+        break;
+    }
+}
+
+void MessageStore::indexMessage(const StoredMessage &message, qint64 offset)
+{
+    QVector<IndexEntry> &entries = m_conversations[message.conversation];
+    const IndexEntry entry = { message.timestamp, offset };
+
+    /* Messages mostly arrive in order, only archived ones may be older */
+    if (entries.isEmpty() || entries.last().timestamp <= message.timestamp) {
+        entries.append(entry);
+    } else {
+        auto position = std::upper_bound(entries.begin(), entries.end(), message.timestamp,
+                                         [](qint64 timestamp, const IndexEntry &entry) { return timestamp < entry.timestamp; });
+        entries.insert(position, entry);
+    }
+
+    if (!message.id.isEmpty()) {
+        m_ids.insert(idKey(message.conversation, message.id), offset);
+    }
+}
+
+QString MessageStore::idKey(const QString &conversation, const QString &id)
+{
+    return conversation + QLatin1Char(' ') + id;
+}
@@ -0,0 +1,103 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef MESSAGESTORE_HH
+#define MESSAGESTORE_HH
+
+#include <QFile>
+#include <QHash>
+#include <QVector>
+
+struct StoredMessage
+{
+    enum Flag {
+        Outgoing = 0x1
+    };
+
+    StoredMessage() : timestamp(0), flags(0), deliveryStatus(0) { }
+
+    bool isValid() const { return !conversation.isEmpty(); }
+
+    QString conversation;
+    QString id;
+    qint64 timestamp; /* msecs since epoch */
+    uint flags;
+    QString senderId;
+    QString body;
+    uint deliveryStatus; /* Tp::DeliveryStatus, updated by receipts */
+};
+
+/* Append-only log of all messages of one account. The log is memory mapped
+ * for reading and an in-memory index maps each conversation to the offsets
+ * of its messages (sorted by timestamp) and each message ID to its offset.
+ * Records appended since the last mapping are read through the file until
+ * they add up to as much as is mapped, so the log is only remapped each
+ * time it doubles. */
+class MessageStore
+{
+public:
+    MessageStore();
+    ~MessageStore();
+
+    bool open(const QString &fileName);
+    bool isOpen() const;
+
+    /* Returns false if the message is already stored */
+    bool append(const StoredMessage &message);
+    void setDeliveryStatus(const QString &conversation, const QString &id, uint status);
+
+    bool contains(const QString &conversation, const QString &id) const;
+    StoredMessage message(const QString &conversation, const QString &id);
+    int count(const QString &conversation) const;
+
+    /* The newest messages in [from, to], at most limit, in chronological order */
+    QList<StoredMessage> messagesByTime(const QString &conversation, qint64 from, qint64 to, int limit);
+    /* The limit messages that precede the message with the given ID */
+    QList<StoredMessage> messagesBefore(const QString &conversation, const QString &id, int limit);
+
+private:
+    enum RecordType {
+        MessageRecord = 1,
+        StatusRecord = 2
+    };
+
+    struct IndexEntry {
+        qint64 timestamp;
+        qint64 offset;
+    };
+
+    bool writeRecord(const QByteArray &payload);
+    bool ensureMapped();
+    QByteArray readRecord(qint64 offset);
+    StoredMessage readMessage(qint64 offset);
+    void indexRecord(qint64 offset, const uchar *data, quint32 length);
+    void indexMessage(const StoredMessage &message, qint64 offset);
+
+    static QString idKey(const QString &conversation, const QString &id);
+
+    QFile m_file;
+    qint64 m_size;
+    uchar *m_map;
+    qint64 m_mappedSize;
+
+    QHash<QString, QVector<IndexEntry>> m_conversations;
+    QHash<QString, qint64> m_ids;
+    QHash<QString, uint> m_statuses;
+};
+
+#endif // MESSAGESTORE_HH
@@ -85,19 +85,20 @@ void MucTextChannel::addMembers(const Tp::UIntList &contacts, const QString &rea
 
     // Direct Invitation, XEP-0249
     for (const QString &jid : jids) {
-        QUuid messageToken = QUuid::createUuid();
         QXmppMessage message;
         message.setType(QXmppMessage::Normal);
         message.setTo(jid); // contacts
-        message.setId(messageToken.toString());
+        message.setId(m_connection->nextStanzaId());
         message.setMucInvitationJid(m_room->jid());
         message.setMucInvitationReason(reason);
-        m_connection->qxmppClient()->sendPacket(message);
+        m_connection->sendStanza(message, OutboundQueue::Interactive);
     }
 }
 
 MucTextChannel::~MucTextChannel()
 {
+    /* Still as a groupchat stanza, before ~TextChannel() would flush them */
+    m_markers.flush();
     m_room->leave();
 }
 
@@ -146,16 +147,16 @@ void MucTextChannel::onMucParticipantsChanged()
     m_groupIface->setMembers(handles, /* details */ QVariantMap());
 }
 
-bool MucTextChannel::sendQXmppMessage(QXmppMessage &message)
+bool MucTextChannel::sendStanza(OutboundStanza &stanza)
 {
-    if (message.state() != QXmppMessage::None) {
+    if (stanza.kind() == OutboundStanza::ChatState) {
         return false;
     }
 
-    m_sentIds << message.id();
+    m_sentIds << stanza.id();
 
-    message.setType(QXmppMessage::GroupChat);
-    return TextChannel::sendQXmppMessage(message);
+    stanza.setType(QXmppMessage::GroupChat);
+    return TextChannel::sendStanza(stanza);
 }
 
 QString MucTextChannel::targetJid() const
@@ -48,7 +48,7 @@ protected:
 
     void addMembers(const Tp::UIntList &contacts, const QString &reason, Tp::DBusError *error);
 
-    bool sendQXmppMessage(QXmppMessage &message) override;
+    bool sendStanza(OutboundStanza &stanza) override;
     QString targetJid() const override;
     QString selfJid() const override;
 
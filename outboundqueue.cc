@@ -0,0 +1,286 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#include "outboundqueue.hh"
+#include "common.hh"
+
+#include <QSslSocket>
+#include <QXmlStreamWriter>
+
+#include <QXmppClient.h>
+
+/* Socket write buffer size at which we start holding stanzas back */
+static const qint64 highWatermark = 64 * 1024;
+/* Socket write buffer size at which we start sending them again */
+static const qint64 lowWatermark = 16 * 1024;
+/* Bounds of the queue; beyond them we refuse new messages */
+static const int maxQueuedStanzas = 1000;
+static const qint64 maxQueuedBytes = 1024 * 1024;
+
+/* Token buckets per priority class, in bytes and bytes per second. They
+ * keep bulk traffic from crowding out chat messages; together they allow up
+ * to 16 KiB/s, which is more than many servers shape c2s traffic to, so the
+ * socket backpressure above still applies. A stanza larger than its bucket
+ * is only sent once the bucket is full and leaves at most a bucket's worth
+ * of debt. */
+static const double bucketSize[OutboundQueue::PriorityCount] = { 16384, 4096, 4096, 8192 };
+static const double bucketRate[OutboundQueue::PriorityCount] = { 8192, 2048, 2048, 4096 };
+
+/* Corked stanzas are written in chunks of at most one TLS record */
+static const int maxBatchSize = 16 * 1024;
+
+static const char *const priorityNames[OutboundQueue::PriorityCount] = { "interactive", "markers", "presence", "bulk-iq" };
+
+RawStanza::RawStanza(const QByteArray &data) :
+    m_data(data)
+{
+}
+
+void RawStanza::parse(const QDomElement &element)
+{
+    /* Only ever sent, never received */
+    Q_UNUSED(element);
+}
+
+void RawStanza::toXml(QXmlStreamWriter *writer) const
+{
+    /* Verbatim, see OutboundStanza::toXml() */
+    writer->writeDTD(QString::fromUtf8(m_data));
+}
+
+OutboundQueue::OutboundQueue(QXmppClient *client, QObject *parent) :
+    QObject(parent),
+    m_client(client),
+    m_depth(0),
+    m_queuedBytes(0),
+    m_throttled(false),
+    m_dispatchScheduled(false)
+{
+    m_clock.start();
+
+    for (int i = 0; i < PriorityCount; ++i) {
+        PriorityClass &priorityClass = m_classes[i];
+        priorityClass.tokens = bucketSize[i];
+        priorityClass.refilled = 0;
+        priorityClass.sent = 0;
+        priorityClass.totalWait = 0;
+        priorityClass.maxWait = 0;
+    }
+
+    m_dispatchTimer.setSingleShot(true);
+    connect(&m_dispatchTimer, &QTimer::timeout, this, &OutboundQueue::dispatch);
+}
+
+bool OutboundQueue::send(const QXmppStanza &stanza, Priority priority)
+{
+    if (!m_client->isConnected()) {
+        return false;
+    }
+
+    PendingStanza pending;
+    QXmlStreamWriter writer(&pending.data);
+    stanza.toXml(&writer);
+    pending.queued = m_clock.elapsed();
+
+    m_queuedBytes += pending.data.size();
+    ++m_depth;
+    m_classes[priority].queue.enqueue(pending);
+
+    /* Cork: everything we produce during this event loop iteration goes out in one write */
+    if (canCork()) {
+        if (!m_dispatchScheduled) {
+            m_dispatchScheduled = true;
+            QMetaObject::invokeMethod(this, "dispatch", Qt::QueuedConnection);
+        }
+    } else {
+        dispatch();
+    }
+
+    if (m_depth > 0 && m_depth % 100 == 0) {
+        qCDebug(metrics) << "outbound queue depth" << m_depth << "stanzas," << m_queuedBytes << "bytes";
+    }
+
+    return true;
+}
+
+bool OutboundQueue::isFull() const
+{
+    return m_depth >= maxQueuedStanzas || m_queuedBytes >= maxQueuedBytes;
+}
+
+int OutboundQueue::depth() const
+{
+    return m_depth;
+}
+
+void OutboundQueue::clear()
+{
+    if (m_depth > 0) {
+        qCDebug(metrics) << "outbound queue: dropping" << m_depth << "stanzas";
+    }
+
+    for (PriorityClass &priorityClass : m_classes) {
+        priorityClass.queue.clear();
+    }
+
+    m_depth = 0;
+    m_queuedBytes = 0;
+    m_throttled = false;
+    m_dispatchTimer.stop();
+}
+
+bool OutboundQueue::canCork() const
+{
+    /* With stream management every write is counted as one stanza */
+#if QXMPP_VERSION >= 0x010400
+    return m_client->streamManagementState() == QXmppClient::NoStreamManagement;
+#elif QXMPP_VERSION >= 0x010000
+    return false;
+#else
+    return true;
+#endif
+}
+
+void OutboundQueue::dispatch()
+{
+    m_dispatchScheduled = false;
+
+    QSslSocket *sslSocket = socket();
+    const qint64 now = m_clock.elapsed();
+    const bool cork = canCork();
+    QByteArray batch;
+
+    while (m_depth > 0) {
+        if (sslSocket) {
+            const qint64 buffered = sslSocket->bytesToWrite() + batch.size();
+            if (buffered >= highWatermark || (m_throttled && buffered > lowWatermark)) {
+                if (!m_throttled) {
+                    m_throttled = true;
+                    qCDebug(metrics) << "outbound queue: socket buffer full, holding" << m_depth << "stanzas back";
+                }
+                /* bytesWritten will call us again */
+                break;
+            }
+            m_throttled = false;
+        }
+
+        int priority = 0;
+        for (; priority < PriorityCount; ++priority) {
+            PriorityClass &priorityClass = m_classes[priority];
+            if (priorityClass.queue.isEmpty()) {
+                continue;
+            }
+
+            refill(priorityClass, priority, now);
+            if (priorityClass.tokens >= requiredTokens(priorityClass, priority)) {
+                break;
+            }
+        }
+
+        if (priority == PriorityCount) {
+            break;
+        }
+
+        PriorityClass &priorityClass = m_classes[priority];
+        const PendingStanza pending = priorityClass.queue.dequeue();
+        priorityClass.tokens = qMax(-bucketSize[priority], priorityClass.tokens - pending.data.size());
+        m_queuedBytes -= pending.data.size();
+        --m_depth;
+
+        recordWait(priorityClass, priority, now - pending.queued);
+
+        if (!cork) {
+            m_client->sendPacket(RawStanza(pending.data));
+            continue;
+        }
+
+        if (!batch.isEmpty() && batch.size() + pending.data.size() > maxBatchSize) {
+            m_client->sendPacket(RawStanza(batch));
+            batch.clear();
+        }
+        batch.append(pending.data);
+    }
+
+    if (!batch.isEmpty()) {
+        m_client->sendPacket(RawStanza(batch));
+    }
+
+    if (m_throttled) {
+        return;
+    }
+
+    if (m_depth == 0) {
+        m_dispatchTimer.stop();
+        return;
+    }
+
+    /* Everything that is left waits for tokens, wake up when the first class has some again */
+    qint64 wait = -1;
+    for (int i = 0; i < PriorityCount; ++i) {
+        const PriorityClass &priorityClass = m_classes[i];
+        if (priorityClass.queue.isEmpty()) {
+            continue;
+        }
+
+        const double missing = requiredTokens(priorityClass, i) - priorityClass.tokens;
+        const qint64 classWait = qint64(missing * 1000 / bucketRate[i]) + 1;
+        if (wait < 0 || classWait < wait) {
+            wait = classWait;
+        }
+    }
+
+    m_dispatchTimer.start(int(wait));
+}
+
+double OutboundQueue::requiredTokens(const PriorityClass &priorityClass, int priority)
+{
+    return qMin(double(priorityClass.queue.head().data.size()), bucketSize[priority]);
+}
+
+void OutboundQueue::refill(PriorityClass &priorityClass, int priority, qint64 now)
+{
+    const qint64 elapsed = now - priorityClass.refilled;
+    priorityClass.refilled = now;
+    priorityClass.tokens = qMin(bucketSize[priority], priorityClass.tokens + elapsed * bucketRate[priority] / 1000);
+}
+
+void OutboundQueue::recordWait(PriorityClass &priorityClass, int priority, qint64 wait)
+{
+    ++priorityClass.sent;
+    priorityClass.totalWait += wait;
+    priorityClass.maxWait = qMax(priorityClass.maxWait, wait);
+
+    if (priorityClass.sent % 100 == 0 || wait >= 1000) {
+        qCDebug(metrics) << "outbound" << priorityNames[priority] << "queue latency" << wait << "ms, mean"
+                         << priorityClass.totalWait / qint64(priorityClass.sent) << "ms, max" << priorityClass.maxWait
+                         << "ms over" << priorityClass.sent << "stanzas";
+    }
+}
+
+QSslSocket *OutboundQueue::socket()
+{
+    if (!m_socket) {
+        /* The stream creates its socket itself, there is no accessor for it */
+        m_socket = m_client->findChild<QSslSocket *>();
+        if (m_socket) {
+            connect(m_socket.data(), &QSslSocket::bytesWritten, this, &OutboundQueue::dispatch);
+        }
+    }
+
+    return m_socket.data();
+}
@@ -0,0 +1,121 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef OUTBOUNDQUEUE_HH
+#define OUTBOUNDQUEUE_HH
+
+#include <QElapsedTimer>
+#include <QObject>
+#include <QPointer>
+#include <QQueue>
+#include <QTimer>
+
+#include <QXmppStanza.h>
+
+class QSslSocket;
+class QXmppClient;
+
+/* A stanza that has already been serialized */
+class RawStanza : public QXmppStanza
+{
+public:
+    explicit RawStanza(const QByteArray &data);
+
+    void parse(const QDomElement &element) override;
+    void toXml(QXmlStreamWriter *writer) const override;
+
+private:
+    QByteArray m_data;
+};
+
+/* Send window and scheduler between us and the socket.
+ *
+ * Stanzas are sorted into priority classes, each with its own token bucket
+ * (in bytes) modelled after the traffic shaping servers typically apply.
+ * Whenever the socket can take more data, the highest class that has both
+ * stanzas and tokens goes first, so a burst of roster or vCard requests
+ * does not hold back a chat message.
+ *
+ * Stanzas are only passed on while the socket's write buffer stays below
+ * the high watermark. Beyond that they are held back until the buffer has
+ * drained below the low watermark, so that we do not pile up data that
+ * the server is not reading anyway. Callers that can refuse work (like
+ * SendMessage) check isFull() first.
+ *
+ * Unless stream management counts our writes, stanzas are corked: all of
+ * them produced during one event loop iteration are written at once. */
+class OutboundQueue : public QObject
+{
+    Q_OBJECT
+public:
+    enum Priority {
+        Interactive,
+        Markers,
+        Presence,
+        BulkIq,
+        PriorityCount
+    };
+
+    explicit OutboundQueue(QXmppClient *client, QObject *parent = nullptr);
+
+    bool send(const QXmppStanza &stanza, Priority priority);
+
+    bool isFull() const;
+    int depth() const;
+
+    void clear();
+
+private slots:
+    void dispatch();
+
+private:
+    struct PendingStanza {
+        QByteArray data;
+        qint64 queued;
+    };
+
+    struct PriorityClass {
+        QQueue<PendingStanza> queue;
+        double tokens;
+        qint64 refilled;
+
+        quint64 sent;
+        qint64 totalWait;
+        qint64 maxWait;
+    };
+
+    static double requiredTokens(const PriorityClass &priorityClass, int priority);
+    void refill(PriorityClass &priorityClass, int priority, qint64 now);
+    void recordWait(PriorityClass &priorityClass, int priority, qint64 wait);
+    bool canCork() const;
+    QSslSocket *socket();
+
+    QXmppClient *m_client;
+    QPointer<QSslSocket> m_socket;
+
+    PriorityClass m_classes[PriorityCount];
+    int m_depth;
+    qint64 m_queuedBytes;
+    bool m_throttled;
+    bool m_dispatchScheduled;
+
+    QElapsedTimer m_clock;
+    QTimer m_dispatchTimer;
+};
+
+#endif // OUTBOUNDQUEUE_HH
@@ -0,0 +1,224 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#include "outboundstanza.hh"
+
+#include <QUuid>
+#include <QXmlStreamWriter>
+
+StanzaIdGenerator::StanzaIdGenerator() :
+    m_prefix(QUuid::createUuid().toString().mid(1, 8) + QLatin1Char('-')),
+    m_counter(0)
+{
+}
+
+QString StanzaIdGenerator::next()
+{
+    return m_prefix + QString::number(++m_counter, 36);
+}
+
+static void appendEscaped(QString &xml, const QString &text)
+{
+    xml.reserve(xml.size() + text.size());
+    for (const QChar c : text) {
+        switch (c.unicode()) {
+        case '&':
+            xml.append(QLatin1String("&amp;"));
+            break;
+        case '<':
+            xml.append(QLatin1String("&lt;"));
+            break;
+        case '>':
+            xml.append(QLatin1String("&gt;"));
+            break;
+        case '"':
+            xml.append(QLatin1String("&quot;"));
+            break;
+        case '\'':
+            xml.append(QLatin1String("&apos;"));
+            break;
+        case '\r':
+            xml.append(QLatin1String("&#13;"));
+            break;
+        default:
+            xml.append(c);
+            break;
+        }
+    }
+}
+
+static void appendAttribute(QString &xml, QLatin1String name, const QString &value)
+{
+    if (value.isEmpty()) {
+        return;
+    }
+
+    xml.append(QLatin1Char(' '));
+    xml.append(name);
+    xml.append(QLatin1String("=\""));
+    appendEscaped(xml, value);
+    xml.append(QLatin1Char('"'));
+}
+
+static QLatin1String typeName(QXmppMessage::Type type)
+{
+    switch (type) {
+    case QXmppMessage::Error:
+        return QLatin1String("error");
+    case QXmppMessage::Normal:
+        return QLatin1String("normal");
+    case QXmppMessage::GroupChat:
+        return QLatin1String("groupchat");
+    case QXmppMessage::Headline:
+        return QLatin1String("headline");
+    case QXmppMessage::Chat:
+    default:
+        return QLatin1String("chat");
+    }
+}
+
+static QLatin1String markerTemplate(QXmppMessage::Marker marker)
+{
+    switch (marker) {
+    case QXmppMessage::Displayed:
+        return QLatin1String("<displayed xmlns=\"urn:xmpp:chat-markers:0\" id=\"");
+    case QXmppMessage::Acknowledged:
+        return QLatin1String("<acknowledged xmlns=\"urn:xmpp:chat-markers:0\" id=\"");
+    case QXmppMessage::Received:
+    default:
+        return QLatin1String("<received xmlns=\"urn:xmpp:chat-markers:0\" id=\"");
+    }
+}
+
+static QLatin1String chatStateTemplate(QXmppMessage::State state)
+{
+    switch (state) {
+    case QXmppMessage::Inactive:
+        return QLatin1String("<inactive xmlns=\"http://jabber.org/protocol/chatstates\"/>");
+    case QXmppMessage::Gone:
+        return QLatin1String("<gone xmlns=\"http://jabber.org/protocol/chatstates\"/>");
+    case QXmppMessage::Composing:
+        return QLatin1String("<composing xmlns=\"http://jabber.org/protocol/chatstates\"/>");
+    case QXmppMessage::Paused:
+        return QLatin1String("<paused xmlns=\"http://jabber.org/protocol/chatstates\"/>");
+    case QXmppMessage::Active:
+    default:
+        return QLatin1String("<active xmlns=\"http://jabber.org/protocol/chatstates\"/>");
+    }
+}
+
+OutboundStanza::OutboundStanza(Kind kind) :
+    m_kind(kind),
+    m_type(QXmppMessage::Chat),
+    m_marker(QXmppMessage::NoMarker),
+    m_state(QXmppMessage::None),
+    m_requestReceipt(false)
+{
+}
+
+OutboundStanza OutboundStanza::chatMessage(const QString &body, bool requestReceipt, QXmppMessage::State state)
+{
+    OutboundStanza stanza(ChatMessage);
+    stanza.m_text = body;
+    stanza.m_requestReceipt = requestReceipt;
+    stanza.m_state = state;
+    return stanza;
+}
+
+OutboundStanza OutboundStanza::marker(QXmppMessage::Marker marker, const QString &markerId)
+{
+    OutboundStanza stanza(Marker);
+    stanza.m_marker = marker;
+    stanza.m_text = markerId;
+    return stanza;
+}
+
+OutboundStanza OutboundStanza::chatState(QXmppMessage::State state)
+{
+    OutboundStanza stanza(ChatState);
+    stanza.m_state = state;
+    return stanza;
+}
+
+OutboundStanza::Kind OutboundStanza::kind() const
+{
+    return m_kind;
+}
+
+QString OutboundStanza::body() const
+{
+    return m_kind == ChatMessage ? m_text : QString();
+}
+
+QXmppMessage::Type OutboundStanza::type() const
+{
+    return m_type;
+}
+
+void OutboundStanza::setType(QXmppMessage::Type type)
+{
+    m_type = type;
+}
+
+void OutboundStanza::parse(const QDomElement &element)
+{
+    /* Only ever sent, never received */
+    Q_UNUSED(element);
+}
+
+void OutboundStanza::toXml(QXmlStreamWriter *writer) const
+{
+    QString xml;
+    xml.reserve(160 + id().size() + to().size() + from().size() + m_text.size());
+
+    xml.append(QLatin1String("<message"));
+    appendAttribute(xml, QLatin1String("id"), id());
+    appendAttribute(xml, QLatin1String("to"), to());
+    appendAttribute(xml, QLatin1String("from"), from());
+    xml.append(QLatin1String(" type=\""));
+    xml.append(typeName(m_type));
+    xml.append(QLatin1String("\">"));
+
+    switch (m_kind) {
+    case ChatMessage:
+        xml.append(QLatin1String("<body>"));
+        appendEscaped(xml, m_text);
+        xml.append(QLatin1String("</body>"));
+        if (m_state != QXmppMessage::None) {
+            xml.append(chatStateTemplate(m_state));
+        }
+        if (m_requestReceipt) {
+            xml.append(QLatin1String("<request xmlns=\"urn:xmpp:receipts\"/><markable xmlns=\"urn:xmpp:chat-markers:0\"/>"));
+        }
+        break;
+    case Marker:
+        xml.append(markerTemplate(m_marker));
+        appendEscaped(xml, m_text);
+        xml.append(QLatin1String("\"/>"));
+        break;
+    case ChatState:
+        xml.append(chatStateTemplate(m_state));
+        break;
+    }
+
+    xml.append(QLatin1String("</message>"));
+
+    /* writeDTD() is the writer's only way to take verbatim markup. It closes
+     * a pending start tag first and also works when writing to a string. */
+    writer->writeDTD(xml);
+}
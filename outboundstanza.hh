@@ -0,0 +1,75 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef OUTBOUNDSTANZA_HH
+#define OUTBOUNDSTANZA_HH
+
+#include <QXmppMessage.h>
+
+/* Hands out stanza IDs that are unique for the lifetime of a connection:
+ * a random prefix picked once plus a running counter. */
+class StanzaIdGenerator
+{
+public:
+    StanzaIdGenerator();
+
+    QString next();
+
+private:
+    QString m_prefix;
+    quint64 m_counter;
+};
+
+/* The message shapes we send all the time (chat body, chat marker, chat
+ * state), serialized straight from fixed templates into a single buffer
+ * instead of going through QXmppMessage. */
+class OutboundStanza : public QXmppStanza
+{
+public:
+    enum Kind {
+        ChatMessage,
+        Marker,
+        ChatState
+    };
+
+    static OutboundStanza chatMessage(const QString &body, bool requestReceipt,
+                                      QXmppMessage::State state = QXmppMessage::None);
+    static OutboundStanza marker(QXmppMessage::Marker marker, const QString &markerId);
+    static OutboundStanza chatState(QXmppMessage::State state);
+
+    Kind kind() const;
+    QString body() const;
+
+    QXmppMessage::Type type() const;
+    void setType(QXmppMessage::Type type);
+
+    void parse(const QDomElement &element) override;
+    void toXml(QXmlStreamWriter *writer) const override;
+
+private:
+    explicit OutboundStanza(Kind kind);
+
+    Kind m_kind;
+    QXmppMessage::Type m_type;
+    QXmppMessage::Marker m_marker;
+    QXmppMessage::State m_state;
+    QString m_text;
+    bool m_requestReceipt;
+};
+
+#endif // OUTBOUNDSTANZA_HH
@@ -0,0 +1,229 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#include "pendingspool.hh"
+#include "common.hh"
+
+#include <QDataStream>
+#include <QtEndian>
+
+static const quint32 spoolMagic = 0x4e53504c; /* "NSPL" */
+/* The magic followed by the little endian offset of the first unacknowledged message */
+static const int headerSize = sizeof(quint32) + sizeof(qint64);
+
+PendingSpool::PendingSpool() :
+    m_readOffset(headerSize),
+    m_acknowledgedOffset(headerSize),
+    m_count(0)
+{
+}
+
+bool PendingSpool::open(const QString &fileName)
+{
+    m_file.setFileName(fileName);
+    if (!m_file.open(QIODevice::ReadWrite)) {
+        qCWarning(general) << "Could not open the pending message spool" << fileName << m_file.errorString();
+        return false;
+    }
+
+    m_count = 0;
+    m_inFlight.clear();
+
+    uchar header[headerSize];
+    if (m_file.read(reinterpret_cast<char *>(header), headerSize) != headerSize
+            || qFromLittleEndian<quint32>(header) != spoolMagic) {
+        if (m_file.size() > 0) {
+            qCWarning(general) << "Discarding the pending message spool" << fileName << "without a valid header";
+        }
+        reset();
+        return true;
+    }
+
+    m_acknowledgedOffset = qFromLittleEndian<qint64>(header + sizeof(quint32));
+    if (m_acknowledgedOffset < headerSize || m_acknowledgedOffset > m_file.size()) {
+        qCWarning(general) << "Discarding the pending message spool" << fileName << "with a broken header";
+        reset();
+        return true;
+    }
+    m_readOffset = m_acknowledgedOffset;
+
+    /* Count what is left over from the last time */
+    QDataStream stream(&m_file);
+    stream.setVersion(QDataStream::Qt_5_0);
+    m_file.seek(m_readOffset);
+    qint64 end = m_readOffset;
+    while (!stream.atEnd()) {
+        QList<QVariantMap> parts;
+        stream >> parts;
+        if (stream.status() != QDataStream::Ok) {
+            break;
+        }
+        end = m_file.pos();
+        ++m_count;
+    }
+
+    if (end != m_file.size()) {
+        qCWarning(general) << "Dropping" << m_file.size() - end << "bytes of garbage from the pending message spool";
+        m_file.resize(end);
+    }
+
+    if (m_count == 0) {
+        reset();
+    }
+
+    return true;
+}
+
+bool PendingSpool::isOpen() const
+{
+    return m_file.isOpen();
+}
+
+bool PendingSpool::isEmpty() const
+{
+    return m_count == 0;
+}
+
+int PendingSpool::count() const
+{
+    return m_count;
+}
+
+bool PendingSpool::enqueue(const Tp::MessagePartList &message)
+{
+    return enqueue(Tp::MessagePartListList() << message);
+}
+
+bool PendingSpool::enqueue(const Tp::MessagePartListList &messages)
+{
+    if (!m_file.isOpen()) {
+        return false;
+    }
+
+    QDataStream stream(&m_file);
+    stream.setVersion(QDataStream::Qt_5_0);
+    m_file.seek(m_file.size());
+
+    for (const Tp::MessagePartList &message : messages) {
+        QList<QVariantMap> parts;
+        for (const Tp::MessagePart &part : message) {
+            QVariantMap map;
+            for (auto it = part.constBegin(); it != part.constEnd(); ++it) {
+                map.insert(it.key(), it.value().variant());
+            }
+            parts.append(map);
+        }
+        stream << parts;
+    }
+    m_file.flush();
+
+    m_count += messages.count();
+    return true;
+}
+
+Tp::MessagePartList PendingSpool::dequeue()
+{
+    Tp::MessagePartList message;
+    if (isEmpty()) {
+        return message;
+    }
+
+    QDataStream stream(&m_file);
+    stream.setVersion(QDataStream::Qt_5_0);
+    m_file.seek(m_readOffset);
+
+    QList<QVariantMap> parts;
+    stream >> parts;
+    m_readOffset = m_file.pos();
+    --m_count;
+
+    for (const QVariantMap &map : parts) {
+        Tp::MessagePart part;
+        for (auto it = map.constBegin(); it != map.constEnd(); ++it) {
+            part.insert(it.key(), QDBusVariant(it.value()));
+        }
+        message.append(part);
+    }
+
+    /* The message stays on disk until it is acknowledged. One without a
+     * token cannot be matched, so it counts as acknowledged right away. */
+    const QString token = message.isEmpty() ? QString() : message.first().value(QStringLiteral("message-token")).variant().toString();
+    m_inFlight.enqueue(InFlightMessage { token, m_readOffset, token.isEmpty() });
+    advance();
+
+    return message;
+}
+
+void PendingSpool::acknowledge(const QString &messageToken)
+{
+    if (m_inFlight.isEmpty()) {
+        return;
+    }
+
+    for (InFlightMessage &message : m_inFlight) {
+        if (!message.acknowledged && message.token == messageToken) {
+            message.acknowledged = true;
+            advance();
+            return;
+        }
+    }
+}
+
+void PendingSpool::advance()
+{
+    const qint64 acknowledgedOffset = m_acknowledgedOffset;
+    while (!m_inFlight.isEmpty() && m_inFlight.head().acknowledged) {
+        m_acknowledgedOffset = m_inFlight.dequeue().end;
+    }
+
+    /* Reclaim the space once everything has been acknowledged */
+    if (m_count == 0 && m_inFlight.isEmpty()) {
+        reset();
+        return;
+    }
+
+    if (m_acknowledgedOffset != acknowledgedOffset) {
+        writeHeader();
+    }
+}
+
+bool PendingSpool::writeHeader()
+{
+    uchar header[headerSize];
+    qToLittleEndian<quint32>(spoolMagic, header);
+    qToLittleEndian<qint64>(m_acknowledgedOffset, header + sizeof(quint32));
+
+    m_file.seek(0);
+    if (m_file.write(reinterpret_cast<const char *>(header), headerSize) != headerSize) {
+        qCWarning(general) << "Could not write the pending message spool header:" << m_file.errorString();
+        return false;
+    }
+
+    m_file.flush();
+    return true;
+}
+
+void PendingSpool::reset()
+{
+    m_file.resize(0);
+    m_readOffset = headerSize;
+    m_acknowledgedOffset = headerSize;
+    m_count = 0;
+    m_inFlight.clear();
+    writeHeader();
+}
@@ -0,0 +1,69 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef PENDINGSPOOL_HH
+#define PENDINGSPOOL_HH
+
+#include <QFile>
+#include <QQueue>
+
+#include <TelepathyQt/Types>
+
+/* On-disk FIFO for received messages that do not fit into the pending
+ * message queue of a text channel.
+ *
+ * The file starts with a header that holds the offset of the oldest
+ * message that has not been acknowledged yet. Messages that were paged
+ * back in but not acknowledged before a restart are delivered again. */
+class PendingSpool
+{
+public:
+    PendingSpool();
+
+    bool open(const QString &fileName);
+
+    bool isOpen() const;
+    bool isEmpty() const;
+    int count() const;
+
+    bool enqueue(const Tp::MessagePartList &message);
+    bool enqueue(const Tp::MessagePartListList &messages);
+    Tp::MessagePartList dequeue();
+    void acknowledge(const QString &messageToken);
+
+private:
+    struct InFlightMessage {
+        QString token;
+        qint64 end;
+        bool acknowledged;
+    };
+
+    void advance();
+    bool writeHeader();
+    void reset();
+
+    QFile m_file;
+    qint64 m_readOffset;
+    qint64 m_acknowledgedOffset;
+    int m_count;
+
+    /* Paged back in, in the order of the file */
+    QQueue<InFlightMessage> m_inFlight;
+};
+
+#endif // PENDINGSPOOL_HH
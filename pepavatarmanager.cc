@@ -0,0 +1,264 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#include "pepavatarmanager.hh"
+#include "avatarcache.hh"
+#include "common.hh"
+#include "connection.hh"
+
+#include <QDomElement>
+
+#include <QXmppIq.h>
+#include <QXmppUtils.h>
+
+static const QString nsPubSub = QStringLiteral("http://jabber.org/protocol/pubsub");
+static const QString nsPubSubEvent = QStringLiteral("http://jabber.org/protocol/pubsub#event");
+static const QString nsAvatarData = QStringLiteral("urn:xmpp:avatar:data");
+static const QString nsAvatarMetadata = QStringLiteral("urn:xmpp:avatar:metadata");
+
+namespace {
+
+class AvatarDataRequest : public QXmppIq
+{
+public:
+    AvatarDataRequest(const QString &jid, const QString &itemId) :
+        m_itemId(itemId)
+    {
+        setType(QXmppIq::Get);
+        setTo(jid);
+    }
+
+protected:
+    void toXmlElementFromChild(QXmlStreamWriter *writer) const override
+    {
+        writer->writeStartElement(QStringLiteral("pubsub"));
+        writer->writeDefaultNamespace(nsPubSub);
+        writer->writeStartElement(QStringLiteral("items"));
+        writer->writeAttribute(QStringLiteral("node"), nsAvatarData);
+        writer->writeStartElement(QStringLiteral("item"));
+        writer->writeAttribute(QStringLiteral("id"), m_itemId);
+        writer->writeEndElement();
+        writer->writeEndElement();
+        writer->writeEndElement();
+    }
+
+private:
+    QString m_itemId;
+};
+
+}
+
+PepAvatarManager::PepAvatarManager(Connection *connection) :
+    m_connection(connection)
+{
+}
+
+QStringList PepAvatarManager::discoveryFeatures() const
+{
+    return QStringList() << nsAvatarMetadata + QLatin1String("+notify");
+}
+
+bool PepAvatarManager::handleStanza(const QDomElement &element)
+{
+    if (element.tagName() == QLatin1String("message")) {
+        return handleEvent(element);
+    }
+
+    if (element.tagName() == QLatin1String("iq")) {
+        return handleResult(element);
+    }
+
+    return false;
+}
+
+bool PepAvatarManager::hasMetadata(const QString &jid) const
+{
+    return m_metadata.contains(jid);
+}
+
+void PepAvatarManager::requestData(const QString &jid)
+{
+    const auto metadata = m_metadata.constFind(jid);
+    if (metadata == m_metadata.constEnd() || metadata->id.isEmpty() || m_requestedJids.contains(jid)) {
+        return;
+    }
+
+    AvatarDataRequest request(jid, metadata->id);
+    const QString id = m_connection->scheduleIq(QLatin1String("avatar ") + jid + QLatin1Char(' ') + metadata->id,
+                                                request, IqScheduler::Interactive);
+
+    m_requests.insert(id, Request { jid, metadata.value() });
+    m_requestedJids.insert(jid);
+}
+
+void PepAvatarManager::handleTimeout(const QString &id)
+{
+    const auto it = m_requests.find(id);
+    if (it == m_requests.end()) {
+        return;
+    }
+
+    const QString jid = it->jid;
+    m_requests.erase(it);
+    m_requestedJids.remove(jid);
+    emit dataFailed(jid);
+}
+
+void PepAvatarManager::clear()
+{
+    m_requests.clear();
+    m_requestedJids.clear();
+}
+
+bool PepAvatarManager::handleEvent(const QDomElement &element)
+{
+    const QDomElement items = element.firstChildElement(QStringLiteral("event")).firstChildElement(QStringLiteral("items"));
+    if (items.namespaceURI() != nsPubSubEvent || items.attribute(QStringLiteral("node")) != nsAvatarMetadata) {
+        return false;
+    }
+
+    const QString jid = QXmppUtils::jidToBareJid(element.attribute(QStringLiteral("from")));
+    const QDomElement metadata = items.firstChildElement(QStringLiteral("item")).firstChildElement(QStringLiteral("metadata"));
+
+    QList<Info> infos;
+    bool rejected = false;
+    for (QDomElement info = metadata.firstChildElement(QStringLiteral("info")); !info.isNull(); info = info.nextSiblingElement(QStringLiteral("info"))) {
+        /* Versions with a URL are not stored in the data node */
+        if (info.hasAttribute(QStringLiteral("url"))) {
+            continue;
+        }
+
+        /* The id becomes our avatar token, which has to be a SHA-1 hash */
+        if (!AvatarCache::isValidToken(info.attribute(QStringLiteral("id")))) {
+            qCWarning(general) << "Ignoring avatar of" << jid << "with invalid id" << info.attribute(QStringLiteral("id"));
+            rejected = true;
+            continue;
+        }
+
+        infos.append(Info {
+            info.attribute(QStringLiteral("id")),
+            info.attribute(QStringLiteral("type")),
+            info.attribute(QStringLiteral("bytes")).toUInt(),
+            info.attribute(QStringLiteral("width")).toUInt(),
+            info.attribute(QStringLiteral("height")).toUInt()
+        });
+    }
+
+    if (infos.isEmpty() && rejected) {
+        return true;
+    }
+
+    if (infos.isEmpty()) {
+        /* An empty metadata element means that the avatar has been disabled */
+        m_metadata.insert(jid, Info { QString(), QString(), 0, 0, 0 });
+        emit metadataReceived(jid, QString());
+        return true;
+    }
+
+    const Info info = selectInfo(infos);
+    m_metadata.insert(jid, info);
+    emit metadataReceived(jid, info.id);
+    return true;
+}
+
+bool PepAvatarManager::handleResult(const QDomElement &element)
+{
+    const auto it = m_requests.find(element.attribute(QStringLiteral("id")));
+    if (it == m_requests.end()) {
+        return false;
+    }
+
+    const Request request = it.value();
+    m_requests.erase(it);
+    m_requestedJids.remove(request.jid);
+
+    if (element.attribute(QStringLiteral("type")) != QLatin1String("result")) {
+        qCDebug(general) << "Could not fetch the PEP avatar of" << request.jid;
+        emit dataFailed(request.jid);
+        return true;
+    }
+
+    const QDomElement data = element.firstChildElement(QStringLiteral("pubsub"))
+            .firstChildElement(QStringLiteral("items"))
+            .firstChildElement(QStringLiteral("item"))
+            .firstChildElement(QStringLiteral("data"));
+    if (data.namespaceURI() != nsAvatarData) {
+        emit dataFailed(request.jid);
+        return true;
+    }
+
+    emit dataReceived(request.jid, request.info.id, QByteArray::fromBase64(data.text().toLatin1()), request.info.type);
+    return true;
+}
+
+PepAvatarManager::Info PepAvatarManager::selectInfo(const QList<Info> &infos)
+{
+    const Tp::AvatarSpec spec = Common::getAvatarSpec();
+
+    auto satisfiesSpec = [&spec](const Info &info) {
+        if (!spec.supportedMimeTypes().contains(info.type)) {
+            return false;
+        }
+        if (spec.maximumBytes() && info.bytes > spec.maximumBytes()) {
+            return false;
+        }
+        if (info.width && ((spec.maximumWidth() && info.width > spec.maximumWidth()) || info.width < spec.minimumWidth())) {
+            return false;
+        }
+        if (info.height && ((spec.maximumHeight() && info.height > spec.maximumHeight()) || info.height < spec.minimumHeight())) {
+            return false;
+        }
+        return true;
+    };
+    auto isLargeEnough = [&spec](const Info &info) {
+        return info.width >= spec.recommendedWidth() && info.height >= spec.recommendedHeight();
+    };
+
+    /* Prefer the smallest version that is at least as large as recommended,
+     * otherwise the largest version that we can use at all */
+    const Info *best = nullptr;
+    for (const Info &info : infos) {
+        if (!satisfiesSpec(info)) {
+            continue;
+        }
+
+        if (!best) {
+            best = &info;
+        } else if (isLargeEnough(info) != isLargeEnough(*best)) {
+            if (isLargeEnough(info)) {
+                best = &info;
+            }
+        } else if (isLargeEnough(info) ? info.bytes < best->bytes : info.bytes > best->bytes) {
+            best = &info;
+        }
+    }
+
+    if (best) {
+        return *best;
+    }
+
+    /* Nothing fits, take the smallest one and hope for the best */
+    best = &infos.first();
+    for (const Info &info : infos) {
+        if (info.bytes < best->bytes) {
+            best = &info;
+        }
+    }
+
+    return *best;
+}
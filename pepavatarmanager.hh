@@ -0,0 +1,79 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef PEPAVATARMANAGER_HH
+#define PEPAVATARMANAGER_HH
+
+#include <QHash>
+#include <QSet>
+
+#include <QXmppClientExtension.h>
+
+class Connection;
+
+/* User avatars published via PEP (XEP-0084).
+ *
+ * We subscribe to metadata notifications through +notify and report the
+ * advertised token for each contact. Image data is only fetched on request,
+ * so avatars that are cached already never cause any traffic. If a contact
+ * publishes several versions, the smallest one that satisfies our avatar
+ * requirements is used. */
+class PepAvatarManager : public QXmppClientExtension
+{
+    Q_OBJECT
+public:
+    explicit PepAvatarManager(Connection *connection);
+
+    QStringList discoveryFeatures() const override;
+    bool handleStanza(const QDomElement &element) override;
+
+    bool hasMetadata(const QString &jid) const;
+    void requestData(const QString &jid);
+    void handleTimeout(const QString &id);
+    void clear();
+
+signals:
+    void metadataReceived(const QString &jid, const QString &token);
+    void dataReceived(const QString &jid, const QString &token, const QByteArray &data, const QString &mimeType);
+    void dataFailed(const QString &jid);
+
+private:
+    struct Info {
+        QString id;
+        QString type;
+        uint bytes;
+        uint width;
+        uint height;
+    };
+
+    struct Request {
+        QString jid;
+        Info info;
+    };
+
+    bool handleEvent(const QDomElement &element);
+    bool handleResult(const QDomElement &element);
+    static Info selectInfo(const QList<Info> &infos);
+
+    Connection *m_connection;
+    QHash<QString, Info> m_metadata;
+    QHash<QString, Request> m_requests;
+    QSet<QString> m_requestedJids;
+};
+
+#endif // PEPAVATARMANAGER_HH
@@ -53,6 +53,7 @@ Protocol::Protocol(const QDBusConnection &dbusConnection, const QString &name)
                   << Tp::ProtocolParameter(QStringLiteral("priority"), QDBusSignature(QLatin1String("u")), Tp::ConnMgrParamFlagHasDefault, 0)
                   << Tp::ProtocolParameter(QStringLiteral("require-encryption"), QDBusSignature(QLatin1String("b")), Tp::ConnMgrParamFlagHasDefault, true)
                   << Tp::ProtocolParameter(QStringLiteral("ignore-ssl-errors"), QDBusSignature(QLatin1String("b")), Tp::ConnMgrParamFlagHasDefault, false)
+                  << Tp::ProtocolParameter(QStringLiteral("pending-message-limit"), QDBusSignature(QLatin1String("u")), Tp::ConnMgrParamFlagHasDefault, 500u)
                   );
 
     m_addrIface = Tp::BaseProtocolAddressingInterface::create();
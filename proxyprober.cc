@@ -0,0 +1,330 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#include "proxyprober.hh"
+#include "common.hh"
+#include "connection.hh"
+
+#include <QDomElement>
+#include <QTcpSocket>
+
+#include <QXmppIq.h>
+
+static const QString nsByteStreams = QStringLiteral("http://jabber.org/protocol/bytestreams");
+
+/* Proxies are probed again after this long */
+static const int probeInterval = 30 * 60 * 1000;
+
+/* A TCP connection that takes longer than this counts as failed */
+static const int connectTimeout = 10 * 1000;
+
+/* Another proxy has to connect this much faster (in percent) to replace the current one */
+static const int switchMargin = 20;
+
+namespace {
+
+class StreamHostRequest : public QXmppIq
+{
+public:
+    explicit StreamHostRequest(const QString &jid)
+    {
+        setType(QXmppIq::Get);
+        setTo(jid);
+    }
+
+protected:
+    void toXmlElementFromChild(QXmlStreamWriter *writer) const override
+    {
+        writer->writeStartElement(QStringLiteral("query"));
+        writer->writeDefaultNamespace(nsByteStreams);
+        writer->writeEndElement();
+    }
+};
+
+}
+
+ProxyProber::ProxyProber(Connection *connection) :
+    m_connection(connection)
+{
+    m_probeTimer.setInterval(probeInterval);
+    connect(&m_probeTimer, &QTimer::timeout, this, &ProxyProber::probe);
+}
+
+ProxyProber::~ProxyProber()
+{
+    clear();
+}
+
+bool ProxyProber::handleStanza(const QDomElement &element)
+{
+    if (element.tagName() != QLatin1String("iq")) {
+        return false;
+    }
+
+    const auto it = m_requests.find(element.attribute(QStringLiteral("id")));
+    if (it == m_requests.end()) {
+        return false;
+    }
+
+    const QString jid = it->jid;
+    const qint64 queryRtt = it->sent.elapsed();
+    m_requests.erase(it);
+
+    auto proxy = m_proxies.find(jid);
+    if (proxy == m_proxies.end()) {
+        /* No longer offered by the server */
+        return true;
+    }
+
+    const QDomElement streamHost = element.firstChildElement(QStringLiteral("query")).firstChildElement(QStringLiteral("streamhost"));
+    proxy->host = streamHost.attribute(QStringLiteral("host"));
+    proxy->port = streamHost.attribute(QStringLiteral("port")).toUShort();
+    proxy->queryRtt = queryRtt;
+
+    if (element.attribute(QStringLiteral("type")) != QLatin1String("result") || proxy->host.isEmpty() || proxy->port == 0) {
+        finishProbe(jid, false);
+    } else {
+        connectToProxy(jid);
+    }
+
+    return true;
+}
+
+void ProxyProber::setProxies(const QStringList &jids)
+{
+    for (auto it = m_proxies.begin(); it != m_proxies.end();) {
+        if (jids.contains(it.key())) {
+            ++it;
+        } else {
+            abortProbe(it.key());
+            it = m_proxies.erase(it);
+        }
+    }
+
+    for (const QString &jid : jids) {
+        auto proxy = m_proxies.find(jid);
+        if (proxy == m_proxies.end()) {
+            proxy = m_proxies.insert(jid, Proxy { Unprobed, QString(), 0, -1, -1, 0 });
+        }
+        if (proxy->state == Unprobed) {
+            probeProxy(jid);
+        }
+    }
+
+    if (m_proxies.isEmpty()) {
+        m_probeTimer.stop();
+    } else if (!m_probeTimer.isActive()) {
+        m_probeTimer.start();
+    }
+
+    select();
+}
+
+void ProxyProber::probe()
+{
+    for (auto it = m_proxies.constBegin(); it != m_proxies.constEnd(); ++it) {
+        probeProxy(it.key());
+    }
+}
+
+void ProxyProber::reportFailure(const QString &jid)
+{
+    auto proxy = m_proxies.find(jid);
+    if (proxy == m_proxies.end()) {
+        return;
+    }
+
+    /* Fail over right away, the proxy gets another chance if it passes a probe */
+    qCDebug(general) << "Transfer via proxy" << jid << "failed";
+    proxy->state = Failed;
+    ++proxy->failures;
+    select();
+    probeProxy(jid);
+}
+
+void ProxyProber::handleFailure(const QString &id)
+{
+    const auto it = m_requests.find(id);
+    if (it == m_requests.end()) {
+        return;
+    }
+
+    const QString jid = it->jid;
+    m_requests.erase(it);
+    finishProbe(jid, false);
+}
+
+void ProxyProber::clear()
+{
+    /* A probe cut short by the disconnect tells nothing about the proxy,
+     * setProxies() probes it again after the next login */
+    for (const Request &request : m_requests) {
+        auto proxy = m_proxies.find(request.jid);
+        if (proxy != m_proxies.end()) {
+            proxy->state = Unprobed;
+        }
+    }
+    m_requests.clear();
+
+    for (auto it = m_sockets.constBegin(); it != m_sockets.constEnd(); ++it) {
+        auto proxy = m_proxies.find(it.key());
+        if (proxy != m_proxies.end()) {
+            proxy->state = Unprobed;
+        }
+
+        QTcpSocket *socket = it.value();
+        socket->disconnect(this);
+        socket->abort();
+        socket->deleteLater();
+    }
+    m_sockets.clear();
+    m_probeTimer.stop();
+}
+
+QString ProxyProber::bestProxy() const
+{
+    return m_best;
+}
+
+void ProxyProber::probeProxy(const QString &jid)
+{
+    if (m_sockets.contains(jid)) {
+        return;
+    }
+
+    for (const Request &request : m_requests) {
+        if (request.jid == jid) {
+            return;
+        }
+    }
+
+    /* The query round trip also covers the time spent in the IQ scheduler,
+     * it only breaks ties between proxies that connect equally fast */
+    StreamHostRequest request(jid);
+    const QString id = m_connection->scheduleIq(QLatin1String("streamhost ") + jid, request, IqScheduler::Background);
+    if (id.isEmpty()) {
+        return;
+    }
+
+    Request &entry = m_requests[id];
+    entry.jid = jid;
+    entry.sent.start();
+}
+
+void ProxyProber::connectToProxy(const QString &jid)
+{
+    const Proxy &proxy = m_proxies[jid];
+
+    QTcpSocket *socket = new QTcpSocket(this);
+    m_sockets.insert(jid, socket);
+
+    QElapsedTimer timer;
+    timer.start();
+
+    connect(socket, &QTcpSocket::connected, this, [this, jid, timer]() {
+        auto proxy = m_proxies.find(jid);
+        if (proxy != m_proxies.end()) {
+            proxy->connectRtt = timer.elapsed();
+        }
+        finishProbe(jid, true);
+    });
+    connect(socket, static_cast<void (QAbstractSocket::*)(QAbstractSocket::SocketError)>(&QAbstractSocket::error), this, [this, jid]() {
+        finishProbe(jid, false);
+    });
+    QTimer::singleShot(connectTimeout, socket, [this, jid]() {
+        finishProbe(jid, false);
+    });
+
+    socket->connectToHost(proxy.host, proxy.port);
+}
+
+void ProxyProber::finishProbe(const QString &jid, bool healthy)
+{
+    abortProbe(jid);
+
+    auto proxy = m_proxies.find(jid);
+    if (proxy == m_proxies.end()) {
+        return;
+    }
+
+    proxy->state = healthy ? Healthy : Failed;
+    if (!healthy) {
+        ++proxy->failures;
+    }
+
+    qCDebug(metrics) << "proxy" << jid << (healthy ? "healthy" : "failed") << "at" << proxy->host << proxy->port
+                     << "query" << proxy->queryRtt << "ms, connect" << proxy->connectRtt << "ms," << proxy->failures << "failures";
+    select();
+}
+
+void ProxyProber::abortProbe(const QString &jid)
+{
+    for (auto it = m_requests.begin(); it != m_requests.end();) {
+        if (it->jid == jid) {
+            it = m_requests.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    QTcpSocket *socket = m_sockets.take(jid);
+    if (socket) {
+        socket->disconnect(this);
+        socket->abort();
+        socket->deleteLater();
+    }
+}
+
+void ProxyProber::select()
+{
+    const auto current = m_proxies.constFind(m_best);
+    const bool currentHealthy = current != m_proxies.constEnd() && current->state == Healthy;
+
+    QString fastest;
+    const Proxy *fastestProxy = nullptr;
+    QString untested;
+    for (auto it = m_proxies.constBegin(); it != m_proxies.constEnd(); ++it) {
+        if (it->state == Healthy) {
+            if (!fastestProxy || it->connectRtt < fastestProxy->connectRtt
+                    || (it->connectRtt == fastestProxy->connectRtt && it->queryRtt < fastestProxy->queryRtt)) {
+                fastest = it.key();
+                fastestProxy = &it.value();
+            }
+        } else if (it->state == Unprobed && (untested.isEmpty() || it.key() < untested)) {
+            untested = it.key();
+        }
+    }
+
+    QString selected;
+    if (!fastestProxy) {
+        /* Nothing measured yet, an untested proxy is better than none */
+        selected = current != m_proxies.constEnd() && current->state != Failed ? m_best : untested;
+    } else if (currentHealthy && fastestProxy->connectRtt * 100 >= current->connectRtt * (100 - switchMargin)) {
+        selected = m_best;
+    } else {
+        selected = fastest;
+    }
+
+    if (selected == m_best) {
+        return;
+    }
+
+    qCDebug(metrics) << "proxy selected" << selected << "instead of" << m_best;
+    m_best = selected;
+    emit bestProxyChanged(selected);
+}
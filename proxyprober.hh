@@ -0,0 +1,94 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef PROXYPROBER_HH
+#define PROXYPROBER_HH
+
+#include <QElapsedTimer>
+#include <QHash>
+#include <QStringList>
+#include <QTimer>
+
+#include <QXmppClientExtension.h>
+
+class Connection;
+class QTcpSocket;
+
+/* Picks the SOCKS5 bytestream proxy (XEP-0065) to offer for file transfers.
+ *
+ * Every proxy the server offers is asked for its network address, then we
+ * time a TCP connection to it. The proxy that is closest to us is used; it is
+ * only replaced by a clearly faster one so that transfers keep the same
+ * relay. Proxies that fail are skipped until a later probe succeeds, and all
+ * of them are probed again every half hour. */
+class ProxyProber : public QXmppClientExtension
+{
+    Q_OBJECT
+public:
+    explicit ProxyProber(Connection *connection);
+    ~ProxyProber();
+
+    bool handleStanza(const QDomElement &element) override;
+
+    void setProxies(const QStringList &jids);
+    void probe();
+    void reportFailure(const QString &jid);
+    void handleFailure(const QString &id);
+    void clear();
+
+    QString bestProxy() const;
+
+signals:
+    void bestProxyChanged(const QString &jid);
+
+private:
+    enum State {
+        Unprobed,
+        Healthy,
+        Failed
+    };
+
+    struct Proxy {
+        State state;
+        QString host;
+        quint16 port;
+        qint64 queryRtt;
+        qint64 connectRtt;
+        int failures;
+    };
+
+    struct Request {
+        QString jid;
+        QElapsedTimer sent;
+    };
+
+    void probeProxy(const QString &jid);
+    void connectToProxy(const QString &jid);
+    void finishProbe(const QString &jid, bool healthy);
+    void abortProbe(const QString &jid);
+    void select();
+
+    Connection *m_connection;
+    QHash<QString, Proxy> m_proxies;
+    QHash<QString, Request> m_requests;
+    QHash<QString, QTcpSocket *> m_sockets;
+    QString m_best;
+    QTimer m_probeTimer;
+};
+
+#endif // PROXYPROBER_HH
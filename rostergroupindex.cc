@@ -0,0 +1,82 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#include "rostergroupindex.hh"
+
+void RosterGroupIndex::clear()
+{
+    m_members.clear();
+    m_groups.clear();
+}
+
+void RosterGroupIndex::setGroups(const QString &jid, const QSet<QString> &groups)
+{
+    const QSet<QString> oldGroups = m_groups.value(jid);
+    if (oldGroups == groups) {
+        return;
+    }
+
+    for (const QString &group : oldGroups) {
+        if (groups.contains(group)) {
+            continue;
+        }
+
+        auto it = m_members.find(group);
+        if (it != m_members.end()) {
+            it->remove(jid);
+            if (it->isEmpty()) {
+                m_members.erase(it);
+            }
+        }
+    }
+
+    for (const QString &group : groups) {
+        m_members[group].insert(jid);
+    }
+
+    if (groups.isEmpty()) {
+        m_groups.remove(jid);
+    } else {
+        m_groups.insert(jid, groups);
+    }
+}
+
+void RosterGroupIndex::remove(const QString &jid)
+{
+    setGroups(jid, QSet<QString>());
+}
+
+QSet<QString> RosterGroupIndex::groups(const QString &jid) const
+{
+    return m_groups.value(jid);
+}
+
+QSet<QString> RosterGroupIndex::members(const QString &group) const
+{
+    return m_members.value(group);
+}
+
+bool RosterGroupIndex::contains(const QString &group) const
+{
+    return m_members.contains(group);
+}
+
+QStringList RosterGroupIndex::allGroups() const
+{
+    return m_members.keys();
+}
@@ -0,0 +1,46 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef ROSTERGROUPINDEX_HH
+#define ROSTERGROUPINDEX_HH
+
+#include <QHash>
+#include <QSet>
+#include <QStringList>
+
+/* Roster groups in both directions: the members of each group and the groups
+ * of each contact. Contacts without any group are not part of the index. */
+class RosterGroupIndex
+{
+public:
+    void clear();
+
+    void setGroups(const QString &jid, const QSet<QString> &groups);
+    void remove(const QString &jid);
+
+    QSet<QString> groups(const QString &jid) const;
+    QSet<QString> members(const QString &group) const;
+    bool contains(const QString &group) const;
+    QStringList allGroups() const;
+
+private:
+    QHash<QString, QSet<QString>> m_members;
+    QHash<QString, QSet<QString>> m_groups;
+};
+
+#endif // ROSTERGROUPINDEX_HH
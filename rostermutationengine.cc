@@ -0,0 +1,187 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#include "rostermutationengine.hh"
+#include "common.hh"
+#include "connection.hh"
+
+#include <QXmppClient.h>
+#include <QXmppRosterIq.h>
+#include <QXmppRosterManager.h>
+
+/* Number of roster IQs we wait for at the same time */
+static const int maxInFlight = 16;
+/* After this time we give up on an answer */
+static const qint64 requestTimeout = 30000;
+static const int timeoutCheckInterval = 5000;
+
+RosterMutationEngine::RosterMutationEngine(Connection *connection, QXmppClient *client, QObject *parent) :
+    QObject(parent),
+    m_connection(connection),
+    m_client(client),
+    m_nextBatch(1)
+{
+    m_clock.start();
+
+    m_timeoutTimer.setInterval(timeoutCheckInterval);
+    connect(&m_timeoutTimer, &QTimer::timeout, this, &RosterMutationEngine::checkTimeouts);
+
+    /* Results of roster sets are not handled by the roster manager */
+    connect(m_client, &QXmppClient::iqReceived, this, &RosterMutationEngine::onIqReceived);
+}
+
+void RosterMutationEngine::submit(const QList<RosterMutation> &mutations, const QSet<QString> &existingGroups)
+{
+    if (mutations.isEmpty()) {
+        return;
+    }
+
+    const quint64 id = m_nextBatch++;
+
+    Batch batch;
+    batch.mutations = mutations;
+    batch.existingGroups = existingGroups;
+    batch.outstanding = mutations.count();
+    batch.failed = 0;
+    m_batches.insert(id, batch);
+
+    for (int i = 0; i < mutations.count(); ++i) {
+        m_waiting.enqueue(qMakePair(id, i));
+        ++m_pendingJids[mutations.at(i).jid];
+    }
+
+    pump();
+}
+
+bool RosterMutationEngine::isPending(const QString &jid) const
+{
+    return m_pendingJids.contains(jid);
+}
+
+void RosterMutationEngine::clear()
+{
+    for (auto it = m_batches.constBegin(); it != m_batches.constEnd(); ++it) {
+        qCWarning(general) << "Dropping" << it->outstanding << "unconfirmed roster changes";
+    }
+
+    m_batches.clear();
+    m_waiting.clear();
+    m_inFlight.clear();
+    m_pendingJids.clear();
+    m_timeoutTimer.stop();
+}
+
+void RosterMutationEngine::onIqReceived(const QXmppIq &iq)
+{
+    if (!m_inFlight.contains(iq.id())) {
+        return;
+    }
+
+    if (iq.type() == QXmppIq::Error) {
+        qCWarning(general) << "The server rejected a roster change:" << iq.error().text();
+    }
+
+    finish(iq.id(), iq.type() == QXmppIq::Result);
+    pump();
+}
+
+void RosterMutationEngine::checkTimeouts()
+{
+    const qint64 now = m_clock.elapsed();
+
+    QStringList expired;
+    for (auto it = m_inFlight.constBegin(); it != m_inFlight.constEnd(); ++it) {
+        if (now - it->sent >= requestTimeout) {
+            expired.append(it.key());
+        }
+    }
+
+    for (const QString &iqId : expired) {
+        qCWarning(general) << "No answer to roster change" << iqId;
+        finish(iqId, false);
+    }
+
+    pump();
+}
+
+void RosterMutationEngine::pump()
+{
+    while (m_inFlight.count() < maxInFlight && !m_waiting.isEmpty()) {
+        const QPair<quint64, int> next = m_waiting.dequeue();
+
+        auto batchIt = m_batches.find(next.first);
+        if (batchIt == m_batches.end()) {
+            continue;
+        }
+
+        const RosterMutation &mutation = batchIt->mutations.at(next.second);
+
+        QXmppRosterIq::Item item = m_client->rosterManager().getRosterEntry(mutation.jid);
+        item.setBareJid(mutation.jid);
+        item.setGroups(mutation.newGroups);
+
+        QXmppRosterIq iq;
+        iq.setType(QXmppIq::Set);
+        iq.setId(m_connection->nextStanzaId());
+        iq.addItem(item);
+
+        m_inFlight.insert(iq.id(), Request { next.first, next.second, m_clock.elapsed() });
+
+        if (!m_connection->sendStanza(iq, OutboundQueue::BulkIq)) {
+            finish(iq.id(), false);
+        }
+    }
+
+    if (m_inFlight.isEmpty()) {
+        m_timeoutTimer.stop();
+    } else if (!m_timeoutTimer.isActive()) {
+        m_timeoutTimer.start();
+    }
+}
+
+void RosterMutationEngine::finish(const QString &iqId, bool success)
+{
+    const Request request = m_inFlight.take(iqId);
+
+    auto batchIt = m_batches.find(request.batch);
+    if (batchIt == m_batches.end()) {
+        return;
+    }
+
+    Batch &batch = batchIt.value();
+    const RosterMutation &mutation = batch.mutations.at(request.index);
+
+    auto pendingIt = m_pendingJids.find(mutation.jid);
+    if (pendingIt != m_pendingJids.end() && --pendingIt.value() <= 0) {
+        m_pendingJids.erase(pendingIt);
+    }
+
+    if (success) {
+        batch.confirmed.append(mutation);
+    } else {
+        ++batch.failed;
+    }
+
+    if (--batch.outstanding > 0) {
+        return;
+    }
+
+    const Batch finished = batchIt.value();
+    m_batches.erase(batchIt);
+    emit batchFinished(finished.confirmed, finished.failed, finished.existingGroups);
+}
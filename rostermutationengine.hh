@@ -0,0 +1,95 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef ROSTERMUTATIONENGINE_HH
+#define ROSTERMUTATIONENGINE_HH
+
+#include <QElapsedTimer>
+#include <QHash>
+#include <QObject>
+#include <QQueue>
+#include <QSet>
+#include <QTimer>
+
+class Connection;
+class QXmppClient;
+class QXmppIq;
+
+struct RosterMutation
+{
+    QString jid;
+    uint handle;
+    QSet<QString> oldGroups;
+    QSet<QString> newGroups;
+};
+
+/* Sends the roster changes of ContactGroups operations.
+ *
+ * Every operation is submitted as one batch. Its roster IQs are sent with
+ * a bounded number in flight, and the batch is reported once the server
+ * has answered all of them (or they timed out), so that the caller can
+ * announce the confirmed changes at once. */
+class RosterMutationEngine : public QObject
+{
+    Q_OBJECT
+public:
+    RosterMutationEngine(Connection *connection, QXmppClient *client, QObject *parent = nullptr);
+
+    void submit(const QList<RosterMutation> &mutations, const QSet<QString> &existingGroups);
+    bool isPending(const QString &jid) const;
+    void clear();
+
+signals:
+    void batchFinished(const QList<RosterMutation> &confirmed, int failed, const QSet<QString> &existingGroups);
+
+private slots:
+    void onIqReceived(const QXmppIq &iq);
+    void checkTimeouts();
+
+private:
+    struct Batch {
+        QList<RosterMutation> mutations;
+        QList<RosterMutation> confirmed;
+        QSet<QString> existingGroups;
+        int outstanding;
+        int failed;
+    };
+
+    struct Request {
+        quint64 batch;
+        int index;
+        qint64 sent;
+    };
+
+    void pump();
+    void finish(const QString &iqId, bool success);
+
+    Connection *m_connection;
+    QXmppClient *m_client;
+
+    quint64 m_nextBatch;
+    QHash<quint64, Batch> m_batches;
+    QQueue<QPair<quint64, int>> m_waiting;
+    QHash<QString, Request> m_inFlight;
+    QHash<QString, int> m_pendingJids;
+
+    QElapsedTimer m_clock;
+    QTimer m_timeoutTimer;
+};
+
+#endif // ROSTERMUTATIONENGINE_HH
@@ -0,0 +1,732 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#include "searchindex.hh"
+#include "common.hh"
+
+#include <QDataStream>
+#include <QDir>
+#include <QFile>
+#include <QPointer>
+#include <QRunnable>
+#include <QSaveFile>
+#include <QSet>
+#include <QtEndian>
+
+#include <algorithm>
+#include <iterator>
+
+/* Number of documents that are kept in memory before writing a segment */
+static const int liveSegmentSize = 4096;
+/* Write the in-memory segment at the latest this long after a document was added */
+static const int flushDelay = 30000;
+/* Merge adjacent segments once there are more than this */
+static const int maxSegments = 8;
+/* Prefix queries expand to at most this many terms */
+static const int maxPrefixExpansion = 256;
+static const int maxTermLength = 64;
+
+static const quint32 segmentMagic = 0x4e534958; /* "NSIX" */
+static const int segmentFooterSize = sizeof(quint64) + sizeof(quint32);
+
+struct Posting
+{
+    quint32 document;
+    QVector<quint32> positions;
+};
+
+struct DocumentInfo
+{
+    QString conversation;
+    QString messageId;
+};
+
+static void writeVarint(QByteArray &out, quint32 value)
+{
+    while (value >= 0x80) {
+        out.append(char((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    out.append(char(value));
+}
+
+static quint32 readVarint(const uchar *&data, const uchar *end)
+{
+    quint32 value = 0;
+    int shift = 0;
+    while (data < end && shift < 32) {
+        const uchar byte = *data++;
+        value |= quint32(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            break;
+        }
+        shift += 7;
+    }
+    return value;
+}
+
+class SearchSegment
+{
+public:
+    SearchSegment() : m_firstDocument(0) { }
+    virtual ~SearchSegment() { }
+
+    quint32 firstDocument() const { return m_firstDocument; }
+    quint32 endDocument() const { return m_firstDocument + m_documents.count(); }
+    int documentCount() const { return m_documents.count(); }
+    DocumentInfo document(quint32 document) const { return m_documents.value(document - m_firstDocument); }
+    const QVector<DocumentInfo> &documents() const { return m_documents; }
+    QString fileName() const { return m_fileName; }
+
+    /* Sorted by document */
+    virtual QVector<Posting> postings(const QString &term) const = 0;
+    /* Sorted */
+    virtual QStringList terms() const = 0;
+    virtual QStringList termsWithPrefix(const QString &prefix, int limit) const = 0;
+
+protected:
+    quint32 m_firstDocument;
+    QVector<DocumentInfo> m_documents;
+    QString m_fileName;
+};
+
+class LiveSegment : public SearchSegment
+{
+public:
+    explicit LiveSegment(quint32 firstDocument)
+    {
+        m_firstDocument = firstDocument;
+    }
+
+    quint32 addDocument(const QString &conversation, const QString &messageId, const QStringList &tokens)
+    {
+        const quint32 document = endDocument();
+        m_documents.append(DocumentInfo { conversation, messageId });
+
+        for (int position = 0; position < tokens.count(); ++position) {
+            QVector<Posting> &postings = m_postings[tokens.at(position)];
+            if (postings.isEmpty() || postings.last().document != document) {
+                postings.append(Posting { document, QVector<quint32>() });
+            }
+            postings.last().positions.append(position);
+        }
+
+        return document;
+    }
+
+    QVector<Posting> postings(const QString &term) const override
+    {
+        return m_postings.value(term);
+    }
+
+    QStringList terms() const override
+    {
+        QStringList result = m_postings.keys();
+        std::sort(result.begin(), result.end());
+        return result;
+    }
+
+    QStringList termsWithPrefix(const QString &prefix, int limit) const override
+    {
+        QStringList result;
+        for (auto it = m_postings.constBegin(); it != m_postings.constEnd() && result.count() < limit; ++it) {
+            if (it.key().startsWith(prefix)) {
+                result.append(it.key());
+            }
+        }
+        return result;
+    }
+
+private:
+    QHash<QString, QVector<Posting>> m_postings;
+};
+
+/* On disk, a segment is the encoded postings of all terms, followed by the
+ * dictionary (documents and term offsets) and a footer that points to it. */
+class DiskSegment : public SearchSegment
+{
+public:
+    DiskSegment() : m_map(nullptr), m_postingsEnd(0) { }
+
+    ~DiskSegment()
+    {
+        if (m_map) {
+            m_file.unmap(m_map);
+        }
+    }
+
+    bool open(const QString &fileName)
+    {
+        m_fileName = fileName;
+        m_file.setFileName(fileName);
+        if (!m_file.open(QIODevice::ReadOnly) || m_file.size() < segmentFooterSize) {
+            return false;
+        }
+
+        const qint64 size = m_file.size();
+        m_map = m_file.map(0, size);
+        if (!m_map) {
+            return false;
+        }
+
+        const quint64 dictionaryOffset = qFromLittleEndian<quint64>(m_map + size - segmentFooterSize);
+        const quint32 magic = qFromLittleEndian<quint32>(m_map + size - sizeof(quint32));
+        if (magic != segmentMagic || dictionaryOffset > quint64(size - segmentFooterSize)) {
+            return false;
+        }
+
+        m_postingsEnd = dictionaryOffset;
+
+        const QByteArray dictionary = QByteArray::fromRawData(reinterpret_cast<const char *>(m_map + dictionaryOffset),
+                                                              size - segmentFooterSize - dictionaryOffset);
+        QDataStream stream(dictionary);
+        stream.setVersion(QDataStream::Qt_5_0);
+
+        quint32 documentCount;
+        stream >> m_firstDocument >> documentCount;
+        m_documents.resize(documentCount);
+        for (DocumentInfo &info : m_documents) {
+            stream >> info.conversation >> info.messageId;
+        }
+
+        quint32 termCount;
+        stream >> termCount;
+        m_terms.resize(termCount);
+        for (TermEntry &entry : m_terms) {
+            stream >> entry.term >> entry.offset >> entry.length;
+        }
+
+        return stream.status() == QDataStream::Ok;
+    }
+
+    QVector<Posting> postings(const QString &term) const override
+    {
+        QVector<Posting> result;
+
+        const auto it = std::lower_bound(m_terms.constBegin(), m_terms.constEnd(), term,
+                                         [](const TermEntry &entry, const QString &term) { return entry.term < term; });
+        if (it == m_terms.constEnd() || it->term != term || it->offset + it->length > m_postingsEnd) {
+            return result;
+        }
+
+        const uchar *data = m_map + it->offset;
+        const uchar *end = data + it->length;
+
+        quint32 document = m_firstDocument;
+        const quint32 count = readVarint(data, end);
+        result.reserve(count);
+        for (quint32 i = 0; i < count && data < end; ++i) {
+            document += readVarint(data, end);
+
+            Posting posting { document, QVector<quint32>() };
+            const quint32 positionCount = readVarint(data, end);
+            posting.positions.reserve(positionCount);
+            quint32 position = 0;
+            for (quint32 j = 0; j < positionCount; ++j) {
+                position += readVarint(data, end);
+                posting.positions.append(position);
+            }
+            result.append(posting);
+        }
+
+        return result;
+    }
+
+    QStringList terms() const override
+    {
+        QStringList result;
+        result.reserve(m_terms.count());
+        for (const TermEntry &entry : m_terms) {
+            result.append(entry.term);
+        }
+        return result;
+    }
+
+    QStringList termsWithPrefix(const QString &prefix, int limit) const override
+    {
+        QStringList result;
+
+        auto it = std::lower_bound(m_terms.constBegin(), m_terms.constEnd(), prefix,
+                                   [](const TermEntry &entry, const QString &prefix) { return entry.term < prefix; });
+        for (; it != m_terms.constEnd() && it->term.startsWith(prefix) && result.count() < limit; ++it) {
+            result.append(it->term);
+        }
+
+        return result;
+    }
+
+private:
+    struct TermEntry {
+        QString term;
+        quint32 offset;
+        quint32 length;
+    };
+
+    QFile m_file;
+    uchar *m_map;
+    quint64 m_postingsEnd;
+    QVector<TermEntry> m_terms;
+};
+
+static QString segmentFileName(const QString &path, quint32 firstDocument, quint32 endDocument)
+{
+    return QStringLiteral("%1/%2-%3.seg").arg(path)
+            .arg(firstDocument, 8, 16, QLatin1Char('0'))
+            .arg(endDocument, 8, 16, QLatin1Char('0'));
+}
+
+/* Writes the union of the given segments, which must cover consecutive
+ * document ranges and be sorted by their first document. */
+static bool writeSegment(const QString &fileName, const QList<const SearchSegment *> &sources)
+{
+    QSet<QString> termSet;
+    QVector<DocumentInfo> documents;
+    for (const SearchSegment *source : sources) {
+        termSet.unite(source->terms().toSet());
+        documents += source->documents();
+    }
+
+    QStringList terms = termSet.toList();
+    std::sort(terms.begin(), terms.end());
+
+    const quint32 firstDocument = sources.first()->firstDocument();
+
+    QByteArray postingsData;
+    QByteArray dictionary;
+    QDataStream dictionaryStream(&dictionary, QIODevice::WriteOnly);
+    dictionaryStream.setVersion(QDataStream::Qt_5_0);
+    dictionaryStream << firstDocument << quint32(documents.count());
+    for (const DocumentInfo &info : documents) {
+        dictionaryStream << info.conversation << info.messageId;
+    }
+    dictionaryStream << quint32(terms.count());
+
+    for (const QString &term : terms) {
+        QVector<Posting> postings;
+        for (const SearchSegment *source : sources) {
+            postings += source->postings(term);
+        }
+
+        const quint32 offset = postingsData.size();
+        quint32 previousDocument = firstDocument;
+        writeVarint(postingsData, postings.count());
+        for (const Posting &posting : postings) {
+            writeVarint(postingsData, posting.document - previousDocument);
+            previousDocument = posting.document;
+
+            writeVarint(postingsData, posting.positions.count());
+            quint32 previousPosition = 0;
+            for (quint32 position : posting.positions) {
+                writeVarint(postingsData, position - previousPosition);
+                previousPosition = position;
+            }
+        }
+
+        dictionaryStream << term << offset << quint32(postingsData.size() - offset);
+    }
+
+    uchar footer[segmentFooterSize];
+    qToLittleEndian<quint64>(postingsData.size(), footer);
+    qToLittleEndian<quint32>(segmentMagic, footer + sizeof(quint64));
+
+    QSaveFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly)) {
+        return false;
+    }
+    file.write(postingsData);
+    file.write(dictionary);
+    file.write(reinterpret_cast<const char *>(footer), segmentFooterSize);
+    return file.commit();
+}
+
+class SegmentMergeTask : public QRunnable
+{
+public:
+    SegmentMergeTask(SearchIndex *index, const QString &path, const QStringList &sourceFileNames) :
+        m_index(index),
+        m_path(path),
+        m_sourceFileNames(sourceFileNames)
+    {
+    }
+
+    void run() override
+    {
+        QString mergedFileName;
+        const bool success = merge(mergedFileName);
+
+        /* The index waits for us even if we failed */
+        QMetaObject::invokeMethod(m_index, "onMergeFinished", Qt::QueuedConnection, Q_ARG(bool, success),
+                                  Q_ARG(QString, mergedFileName), Q_ARG(QStringList, m_sourceFileNames));
+    }
+
+private:
+    bool merge(QString &mergedFileName)
+    {
+        QList<QSharedPointer<DiskSegment>> segments;
+        QList<const SearchSegment *> sources;
+        for (const QString &fileName : m_sourceFileNames) {
+            QSharedPointer<DiskSegment> segment(new DiskSegment);
+            if (!segment->open(fileName)) {
+                return false;
+            }
+            segments.append(segment);
+            sources.append(segment.data());
+        }
+
+        mergedFileName = segmentFileName(m_path, sources.first()->firstDocument(), sources.last()->endDocument());
+        return writeSegment(mergedFileName, sources);
+    }
+
+    QPointer<SearchIndex> m_index;
+    QString m_path;
+    QStringList m_sourceFileNames;
+};
+
+SearchIndex::SearchIndex(QObject *parent) :
+    QObject(parent),
+    m_nextDocument(0),
+    m_merging(false)
+{
+    m_mergePool.setMaxThreadCount(1);
+
+    m_flushTimer.setSingleShot(true);
+    m_flushTimer.setInterval(flushDelay);
+    connect(&m_flushTimer, &QTimer::timeout, this, &SearchIndex::flush);
+}
+
+SearchIndex::~SearchIndex()
+{
+    flush();
+    m_mergePool.waitForDone();
+}
+
+bool SearchIndex::open(const QString &path)
+{
+    m_path = path;
+    QDir dir(path);
+    if (!dir.mkpath(path)) {
+        return false;
+    }
+
+    QList<QSharedPointer<SearchSegment>> segments;
+    for (const QString &entry : dir.entryList(QStringList() << QStringLiteral("*.seg"), QDir::Files)) {
+        QSharedPointer<DiskSegment> segment(new DiskSegment);
+        if (segment->open(dir.filePath(entry))) {
+            segments.append(segment);
+        } else {
+            qCWarning(general) << "Ignoring broken search index segment" << entry;
+        }
+    }
+
+    std::sort(segments.begin(), segments.end(), [](const QSharedPointer<SearchSegment> &a, const QSharedPointer<SearchSegment> &b) {
+        if (a->firstDocument() != b->firstDocument()) {
+            return a->firstDocument() < b->firstDocument();
+        }
+        return a->endDocument() > b->endDocument();
+    });
+
+    /* A merge might have been interrupted before the sources were removed */
+    for (const QSharedPointer<SearchSegment> &segment : segments) {
+        if (!m_segments.isEmpty() && segment->endDocument() <= m_segments.last()->endDocument()) {
+            QFile::remove(segment->fileName());
+            continue;
+        }
+        m_segments.append(segment);
+    }
+
+    m_nextDocument = m_segments.isEmpty() ? 0 : m_segments.last()->endDocument();
+    m_liveSegment.reset(new LiveSegment(m_nextDocument));
+
+    scheduleMerge();
+    return true;
+}
+
+void SearchIndex::flush()
+{
+    m_flushTimer.stop();
+
+    if (!m_liveSegment || m_liveSegment->documentCount() == 0 || m_path.isEmpty()) {
+        return;
+    }
+
+    const QString fileName = segmentFileName(m_path, m_liveSegment->firstDocument(), m_liveSegment->endDocument());
+    if (!writeSegment(fileName, QList<const SearchSegment *>() << m_liveSegment.data())) {
+        qCWarning(general) << "Could not write search index segment" << fileName;
+        return;
+    }
+
+    QSharedPointer<DiskSegment> segment(new DiskSegment);
+    if (segment->open(fileName)) {
+        m_segments.append(segment);
+    }
+
+    m_liveSegment.reset(new LiveSegment(m_nextDocument));
+    scheduleMerge();
+}
+
+void SearchIndex::addDocument(const QString &conversation, const QString &messageId, const QString &text)
+{
+    if (!m_liveSegment) {
+        return;
+    }
+
+    const QStringList tokens = tokenize(text);
+    if (tokens.isEmpty()) {
+        return;
+    }
+
+    static_cast<LiveSegment *>(m_liveSegment.data())->addDocument(conversation, messageId, tokens);
+    ++m_nextDocument;
+
+    if (m_liveSegment->documentCount() >= liveSegmentSize) {
+        flush();
+    } else if (!m_flushTimer.isActive()) {
+        m_flushTimer.start();
+    }
+}
+
+QList<SearchHit> SearchIndex::search(const QString &query, int limit) const
+{
+    QList<SearchHit> hits;
+
+    const QList<Clause> clauses = parseQuery(query);
+    if (clauses.isEmpty() || !m_liveSegment) {
+        return hits;
+    }
+
+    /* Newest documents first */
+    QList<QSharedPointer<SearchSegment>> segments = m_segments;
+    segments.append(m_liveSegment);
+
+    for (int i = segments.count() - 1; i >= 0 && hits.count() < limit; --i) {
+        const SearchSegment *segment = segments.at(i).data();
+
+        QVector<quint32> documents = matchClause(segment, clauses.first());
+        for (int j = 1; j < clauses.count() && !documents.isEmpty(); ++j) {
+            const QVector<quint32> other = matchClause(segment, clauses.at(j));
+            QVector<quint32> intersection;
+            std::set_intersection(documents.constBegin(), documents.constEnd(), other.constBegin(), other.constEnd(),
+                                  std::back_inserter(intersection));
+            documents = intersection;
+        }
+
+        for (int j = documents.count() - 1; j >= 0 && hits.count() < limit; --j) {
+            const DocumentInfo info = segment->document(documents.at(j));
+            hits.append(SearchHit { info.conversation, info.messageId });
+        }
+    }
+
+    return hits;
+}
+
+int SearchIndex::segmentCount() const
+{
+    return m_segments.count();
+}
+
+bool SearchIndex::isMerging() const
+{
+    return m_merging;
+}
+
+QStringList SearchIndex::tokenize(const QString &text)
+{
+    QStringList tokens;
+    QString current;
+
+    for (const QChar &c : text) {
+        if (c.isLetterOrNumber()) {
+            if (current.size() < maxTermLength) {
+                current.append(c.toLower());
+            }
+        } else if (!current.isEmpty()) {
+            tokens.append(current);
+            current.clear();
+        }
+    }
+
+    if (!current.isEmpty()) {
+        tokens.append(current);
+    }
+
+    return tokens;
+}
+
+QList<SearchIndex::Clause> SearchIndex::parseQuery(const QString &query)
+{
+    QList<Clause> clauses;
+
+    int i = 0;
+    while (i < query.size()) {
+        if (query.at(i).isSpace()) {
+            ++i;
+            continue;
+        }
+
+        int end;
+        QStringList terms;
+        bool prefix = false;
+
+        if (query.at(i) == QLatin1Char('"')) {
+            end = query.indexOf(QLatin1Char('"'), i + 1);
+            if (end < 0) {
+                end = query.size();
+            }
+            terms = tokenize(query.mid(i + 1, end - i - 1));
+            ++end;
+        } else {
+            end = i;
+            while (end < query.size() && !query.at(end).isSpace()) {
+                ++end;
+            }
+            const QString word = query.mid(i, end - i);
+            prefix = word.endsWith(QLatin1Char('*'));
+            terms = tokenize(word);
+        }
+        i = end;
+
+        if (terms.isEmpty()) {
+            continue;
+        }
+
+        Clause clause;
+        clause.terms = terms;
+        if (terms.count() > 1) {
+            clause.type = Clause::Phrase;
+        } else if (prefix) {
+            clause.type = Clause::Prefix;
+        } else {
+            clause.type = Clause::Term;
+        }
+        clauses.append(clause);
+    }
+
+    return clauses;
+}
+
+QVector<quint32> SearchIndex::matchClause(const SearchSegment *segment, const Clause &clause)
+{
+    QVector<quint32> documents;
+
+    switch (clause.type) {
+    case Clause::Term:
+        for (const Posting &posting : segment->postings(clause.terms.first())) {
+            documents.append(posting.document);
+        }
+        break;
+    case Clause::Prefix:
+        for (const QString &term : segment->termsWithPrefix(clause.terms.first(), maxPrefixExpansion)) {
+            for (const Posting &posting : segment->postings(term)) {
+                documents.append(posting.document);
+            }
+        }
+        std::sort(documents.begin(), documents.end());
+        documents.erase(std::unique(documents.begin(), documents.end()), documents.end());
+        break;
+    case Clause::Phrase: {
+        const QVector<Posting> first = segment->postings(clause.terms.first());
+        if (first.isEmpty()) {
+            break;
+        }
+
+        QList<QHash<quint32, QVector<quint32>>> following;
+        for (int i = 1; i < clause.terms.count(); ++i) {
+            QHash<quint32, QVector<quint32>> positions;
+            for (const Posting &posting : segment->postings(clause.terms.at(i))) {
+                positions.insert(posting.document, posting.positions);
+            }
+            if (positions.isEmpty()) {
+                return documents;
+            }
+            following.append(positions);
+        }
+
+        for (const Posting &posting : first) {
+            for (quint32 position : posting.positions) {
+                bool matches = true;
+                for (int i = 0; i < following.count() && matches; ++i) {
+                    const QVector<quint32> positions = following.at(i).value(posting.document);
+                    matches = std::binary_search(positions.constBegin(), positions.constEnd(), position + i + 1);
+                }
+                if (matches) {
+                    documents.append(posting.document);
+                    break;
+                }
+            }
+        }
+        break;
+    }
+    }
+
+    return documents;
+}
+
+void SearchIndex::scheduleMerge()
+{
+    if (m_merging || m_segments.count() <= maxSegments) {
+        return;
+    }
+
+    /* Merge the two adjacent segments that are smallest together */
+    int best = 0;
+    for (int i = 1; i + 1 < m_segments.count(); ++i) {
+        if (m_segments.at(i)->documentCount() + m_segments.at(i + 1)->documentCount()
+                < m_segments.at(best)->documentCount() + m_segments.at(best + 1)->documentCount()) {
+            best = i;
+        }
+    }
+
+    m_merging = true;
+    m_mergePool.start(new SegmentMergeTask(this, m_path, QStringList()
+                                           << m_segments.at(best)->fileName()
+                                           << m_segments.at(best + 1)->fileName()));
+}
+
+void SearchIndex::onMergeFinished(bool success, const QString &mergedFileName, const QStringList &sourceFileNames)
+{
+    m_merging = false;
+
+    /* The next flush tries again */
+    if (!success) {
+        qCWarning(general) << "Could not merge search index segments" << sourceFileNames;
+        return;
+    }
+
+    int index = -1;
+    for (int i = 0; i + 1 < m_segments.count(); ++i) {
+        if (m_segments.at(i)->fileName() == sourceFileNames.first()
+                && m_segments.at(i + 1)->fileName() == sourceFileNames.last()) {
+            index = i;
+            break;
+        }
+    }
+
+    QSharedPointer<DiskSegment> merged(new DiskSegment);
+    if (index < 0 || !merged->open(mergedFileName)) {
+        QFile::remove(mergedFileName);
+        return;
+    }
+
+    m_segments.removeAt(index + 1);
+    m_segments.replace(index, merged);
+    for (const QString &fileName : sourceFileNames) {
+        QFile::remove(fileName);
+    }
+
+    scheduleMerge();
+}
@@ -0,0 +1,96 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef SEARCHINDEX_HH
+#define SEARCHINDEX_HH
+
+#include <QHash>
+#include <QObject>
+#include <QSharedPointer>
+#include <QStringList>
+#include <QThreadPool>
+#include <QTimer>
+#include <QVector>
+
+class SearchSegment;
+
+struct SearchHit
+{
+    QString conversation;
+    QString messageId;
+};
+
+/* Incremental inverted index over message bodies.
+ *
+ * New documents go to an in-memory segment which is written to disk as an
+ * immutable segment once it is large enough, or shortly after the last
+ * document was added so that a crash loses little. Segments cover disjoint,
+ * consecutive ranges of document IDs; adjacent segments are merged in the
+ * background to keep their number small.
+ *
+ * Queries are a list of clauses that all have to match: plain terms,
+ * prefixes ("foo*") and phrases ("\"foo bar\""). */
+class SearchIndex : public QObject
+{
+    Q_OBJECT
+public:
+    explicit SearchIndex(QObject *parent = nullptr);
+    ~SearchIndex();
+
+    bool open(const QString &path);
+    void flush();
+
+    void addDocument(const QString &conversation, const QString &messageId, const QString &text);
+    QList<SearchHit> search(const QString &query, int limit) const;
+
+    int segmentCount() const;
+    bool isMerging() const;
+
+    static QStringList tokenize(const QString &text);
+
+private slots:
+    void onMergeFinished(bool success, const QString &mergedFileName, const QStringList &sourceFileNames);
+
+private:
+    struct Clause {
+        enum Type {
+            Term,
+            Prefix,
+            Phrase
+        };
+
+        Type type;
+        QStringList terms;
+    };
+
+    static QList<Clause> parseQuery(const QString &query);
+    static QVector<quint32> matchClause(const SearchSegment *segment, const Clause &clause);
+    void scheduleMerge();
+
+    QString m_path;
+    quint32 m_nextDocument;
+
+    QList<QSharedPointer<SearchSegment>> m_segments;
+    QSharedPointer<SearchSegment> m_liveSegment;
+
+    QTimer m_flushTimer;
+    QThreadPool m_mergePool;
+    bool m_merging;
+};
+
+#endif // SEARCHINDEX_HH
@@ -0,0 +1,67 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#include "searchinterface.hh"
+#include "common.hh"
+#include "connection.hh"
+
+SearchInterface::SearchInterface(Connection *connection)
+    : Tp::AbstractConnectionInterface(QLatin1String(NONSENSE_IFACE_CONNECTION_SEARCH)),
+      m_connection(connection)
+{
+}
+
+SearchInterfacePtr SearchInterface::create(Connection *connection)
+{
+    return SearchInterfacePtr(new SearchInterface(connection));
+}
+
+QVariantMap SearchInterface::immutableProperties() const
+{
+    return QVariantMap();
+}
+
+void SearchInterface::createAdaptor()
+{
+    new SearchAdaptor(m_connection, dbusObject());
+}
+
+SearchAdaptor::SearchAdaptor(Connection *connection, QObject *parent)
+    : QDBusAbstractAdaptor(parent),
+      m_connection(connection)
+{
+}
+
+Tp::MessagePartListList SearchAdaptor::Search(const QString &query, uint limit)
+{
+    Tp::MessagePartListList result;
+
+    for (const SearchHit &hit : m_connection->searchIndex()->search(query, Common::clampLimit(limit))) {
+        const StoredMessage message = m_connection->messageStore()->message(hit.conversation, hit.messageId);
+        if (!message.isValid()) {
+            continue;
+        }
+
+        Tp::MessagePartList parts = m_connection->storedMessageToParts(message);
+        /* Tell the client where the message belongs to */
+        parts[0][QStringLiteral("nonsense-conversation-id")] = QDBusVariant(message.conversation);
+        result << parts;
+    }
+
+    return result;
+}
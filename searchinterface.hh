@@ -0,0 +1,63 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef SEARCHINTERFACE_HH
+#define SEARCHINTERFACE_HH
+
+#include <QDBusAbstractAdaptor>
+
+#include <TelepathyQt/BaseConnection>
+
+#define NONSENSE_IFACE_CONNECTION_SEARCH "org.freedesktop.Telepathy.Connection.Interface.Nonsense.Search"
+
+class Connection;
+class SearchInterface;
+
+typedef Tp::SharedPtr<SearchInterface> SearchInterfacePtr;
+
+/* Full-text search over all stored messages of the account */
+class SearchInterface : public Tp::AbstractConnectionInterface
+{
+    Q_OBJECT
+public:
+    static SearchInterfacePtr create(Connection *connection);
+
+    QVariantMap immutableProperties() const override;
+
+private:
+    SearchInterface(Connection *connection);
+    void createAdaptor() override;
+
+    Connection *m_connection;
+};
+
+class SearchAdaptor : public QDBusAbstractAdaptor
+{
+    Q_OBJECT
+    Q_CLASSINFO("D-Bus Interface", NONSENSE_IFACE_CONNECTION_SEARCH)
+public:
+    SearchAdaptor(Connection *connection, QObject *parent);
+
+public slots:
+    Tp::MessagePartListList Search(const QString &query, uint limit);
+
+private:
+    Connection *m_connection;
+};
+
+#endif // SEARCHINTERFACE_HH
@@ -0,0 +1,328 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#include "servicedirectory.hh"
+#include "common.hh"
+#include "connection.hh"
+
+#include <QDataStream>
+#include <QDateTime>
+#include <QFile>
+#include <QSaveFile>
+
+#include <QXmppDiscoveryIq.h>
+
+static const quint32 fileVersion = 1;
+static const int saveDelay = 2000;
+
+/* Services rarely change, a day old directory is still good enough */
+static const qint64 directoryTtl = 24 * 60 * 60 * 1000;
+
+/* Info queries of a crawl that are in flight at the same time */
+static const int maxParallelQueries = 3;
+
+ServiceDirectory::ServiceDirectory(Connection *connection) :
+    m_connection(connection),
+    m_crawled(0),
+    m_crawling(false)
+{
+    m_saveTimer.setSingleShot(true);
+    m_saveTimer.setInterval(saveDelay);
+    connect(&m_saveTimer, &QTimer::timeout, this, &ServiceDirectory::save);
+}
+
+ServiceDirectory::~ServiceDirectory()
+{
+    if (m_saveTimer.isActive()) {
+        save();
+    }
+}
+
+bool ServiceDirectory::open(const QString &fileName, const QString &domain)
+{
+    m_fileName = fileName;
+    m_domain = domain;
+    m_crawled = 0;
+    m_entities.clear();
+
+    QFile file(fileName);
+    if (!file.exists()) {
+        return true;
+    }
+
+    if (!file.open(QIODevice::ReadOnly)) {
+        qCWarning(general) << "Could not open the service directory" << fileName << file.errorString();
+        return false;
+    }
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_0);
+
+    quint32 version;
+    stream >> version;
+    if (version != fileVersion) {
+        qCWarning(general) << "Ignoring service directory of unknown version" << version;
+        return false;
+    }
+
+    QString storedDomain;
+    qint64 crawled;
+    quint32 count;
+    stream >> storedDomain >> crawled >> count;
+    if (storedDomain != domain) {
+        qCDebug(general) << "Ignoring service directory of domain" << storedDomain;
+        return true;
+    }
+
+    QHash<QString, Entity> entities;
+    for (quint32 i = 0; i < count && stream.status() == QDataStream::Ok; ++i) {
+        QString jid;
+        Entity entity;
+        stream >> jid >> entity.node >> entity.identities >> entity.features >> entity.updated;
+        entities.insert(jid, entity);
+    }
+
+    if (stream.status() != QDataStream::Ok) {
+        qCWarning(general) << "Ignoring corrupt service directory";
+        return false;
+    }
+
+    m_crawled = crawled;
+    m_entities = entities;
+    qCDebug(general) << "Service directory knows" << m_entities.count() << "entities of" << domain;
+    return true;
+}
+
+void ServiceDirectory::save()
+{
+    m_saveTimer.stop();
+
+    if (m_fileName.isEmpty()) {
+        return;
+    }
+
+    QSaveFile file(m_fileName);
+    if (!file.open(QIODevice::WriteOnly)) {
+        qCWarning(general) << "Could not save the service directory" << file.fileName() << file.errorString();
+        return;
+    }
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_0);
+    stream << fileVersion << m_domain << m_crawled << quint32(m_entities.count());
+    for (auto it = m_entities.constBegin(); it != m_entities.constEnd(); ++it) {
+        stream << it.key() << it->node << it->identities << it->features << it->updated;
+    }
+
+    if (!file.commit()) {
+        qCWarning(general) << "Could not save the service directory" << file.fileName() << file.errorString();
+    }
+}
+
+void ServiceDirectory::refresh()
+{
+    if (!isStale()) {
+        qCDebug(general) << "Service directory of" << m_domain << "is up to date";
+        /* Finish what an interrupted crawl left unanswered */
+        m_queue.clear();
+        for (auto it = m_entities.constBegin(); it != m_entities.constEnd(); ++it) {
+            if (it->updated == 0 && it.key() != m_domain) {
+                m_queue.enqueue(qMakePair(it.key(), it->node));
+            }
+        }
+        dispatch();
+        return;
+    }
+
+    if (!m_entities.contains(m_domain)) {
+        m_entities.insert(m_domain, Entity { QString(), QStringList(), QStringList(), 0 });
+    }
+
+    /* Without a directory there is nothing to fall back to, so do not wait */
+    const IqScheduler::Priority priority = m_crawled ? IqScheduler::Background : IqScheduler::Interactive;
+
+    QXmppDiscoveryIq request;
+    request.setType(QXmppIq::Get);
+    request.setQueryType(QXmppDiscoveryIq::ItemsQuery);
+    request.setTo(m_domain);
+    m_itemsRequest = m_connection->scheduleIq(QLatin1String("disco#items ") + m_domain, request, priority);
+}
+
+void ServiceDirectory::stop()
+{
+    m_queue.clear();
+    m_inFlight.clear();
+    m_itemsRequest.clear();
+    m_crawling = false;
+    save();
+}
+
+bool ServiceDirectory::handleInfo(const QXmppDiscoveryIq &iq)
+{
+    auto entity = m_entities.find(iq.from());
+    if (entity == m_entities.end()) {
+        return false;
+    }
+
+    if (m_inFlight.remove(iq.id())) {
+        dispatch();
+    }
+
+    QStringList identities;
+    for (const QXmppDiscoveryIq::Identity &identity : iq.identities()) {
+        identities.append(identity.category() + QLatin1Char('/') + identity.type());
+    }
+
+    entity->updated = QDateTime::currentMSecsSinceEpoch();
+    if (entity->identities != identities || entity->features != iq.features()) {
+        entity->identities = identities;
+        entity->features = iq.features();
+        emit servicesChanged();
+    }
+
+    scheduleSave();
+    return true;
+}
+
+bool ServiceDirectory::handleItems(const QXmppDiscoveryIq &iq)
+{
+    if (iq.from() != m_domain) {
+        return false;
+    }
+
+    m_itemsRequest.clear();
+
+    QHash<QString, Entity> entities;
+    entities.insert(m_domain, m_entities.value(m_domain));
+
+    m_queue.clear();
+    for (const QXmppDiscoveryIq::Item &item : iq.items()) {
+        Entity entity = m_entities.value(item.jid(), Entity { QString(), QStringList(), QStringList(), 0 });
+        entity.node = item.node();
+        entities.insert(item.jid(), entity);
+        m_queue.enqueue(qMakePair(item.jid(), item.node()));
+    }
+
+    bool removed = false;
+    for (auto it = m_entities.constBegin(); it != m_entities.constEnd(); ++it) {
+        if (!entities.contains(it.key())) {
+            removed = true;
+            break;
+        }
+    }
+
+    m_entities = entities;
+    m_crawling = true;
+    scheduleSave();
+
+    if (removed) {
+        emit servicesChanged();
+    }
+
+    qCDebug(general) << "Crawling" << m_queue.count() << "services of" << m_domain;
+    dispatch();
+    return true;
+}
+
+void ServiceDirectory::handleFailure(const QString &id)
+{
+    if (id == m_itemsRequest) {
+        /* Keep what we have and try again on the next login */
+        m_itemsRequest.clear();
+        return;
+    }
+
+    if (m_inFlight.remove(id)) {
+        dispatch();
+    }
+}
+
+bool ServiceDirectory::contains(const QString &jid) const
+{
+    return m_entities.contains(jid);
+}
+
+QStringList ServiceDirectory::services(const QString &category, const QString &type) const
+{
+    const QString identity = category + QLatin1Char('/') + type;
+
+    QStringList result;
+    for (auto it = m_entities.constBegin(); it != m_entities.constEnd(); ++it) {
+        if (it->identities.contains(identity)) {
+            result.append(it.key());
+        }
+    }
+
+    result.sort();
+    return result;
+}
+
+QStringList ServiceDirectory::servicesWithFeature(const QString &feature) const
+{
+    QStringList result;
+    for (auto it = m_entities.constBegin(); it != m_entities.constEnd(); ++it) {
+        if (it->features.contains(feature)) {
+            result.append(it.key());
+        }
+    }
+
+    result.sort();
+    return result;
+}
+
+bool ServiceDirectory::isStale() const
+{
+    return m_crawled == 0 || QDateTime::currentMSecsSinceEpoch() - m_crawled > directoryTtl;
+}
+
+void ServiceDirectory::dispatch()
+{
+    while (m_inFlight.count() < maxParallelQueries && !m_queue.isEmpty()) {
+        const QPair<QString, QString> next = m_queue.dequeue();
+
+        QXmppDiscoveryIq request;
+        request.setType(QXmppIq::Get);
+        request.setQueryType(QXmppDiscoveryIq::InfoQuery);
+        request.setTo(next.first);
+        if (!next.second.isEmpty()) {
+            request.setQueryNode(next.second);
+        }
+
+        const QString id = m_connection->scheduleIq(QLatin1String("disco#info ") + next.first + QLatin1Char(' ') + next.second,
+                                                    request, IqScheduler::Background);
+        if (!id.isEmpty()) {
+            m_inFlight.insert(id, next.first);
+        }
+    }
+
+    /* The directory only counts as crawled once every info query got its
+     * answer or failed, a crawl cut short is picked up again on the next login */
+    if (m_crawling && m_inFlight.isEmpty() && m_queue.isEmpty()) {
+        m_crawling = false;
+        m_crawled = QDateTime::currentMSecsSinceEpoch();
+        scheduleSave();
+        qCDebug(general) << "Crawled the services of" << m_domain;
+    }
+}
+
+void ServiceDirectory::scheduleSave()
+{
+    if (!m_saveTimer.isActive()) {
+        m_saveTimer.start();
+    }
+}
@@ -0,0 +1,91 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef SERVICEDIRECTORY_HH
+#define SERVICEDIRECTORY_HH
+
+#include <QHash>
+#include <QObject>
+#include <QPair>
+#include <QQueue>
+#include <QStringList>
+#include <QTimer>
+
+#include "iqscheduler.hh"
+
+class Connection;
+class QXmppDiscoveryIq;
+
+/* The entities our server offers (the domain itself and the items it lists:
+ * MUC, upload, proxies, ...) together with what service discovery told us
+ * about them.
+ *
+ * The directory is stored on disk so that the services are known right after
+ * login. It is crawled again once it is older than a day, in the background
+ * and with only a few queries in flight at a time. */
+class ServiceDirectory : public QObject
+{
+    Q_OBJECT
+public:
+    explicit ServiceDirectory(Connection *connection);
+    ~ServiceDirectory();
+
+    bool open(const QString &fileName, const QString &domain);
+    void save();
+
+    void refresh();
+    void stop();
+
+    bool handleInfo(const QXmppDiscoveryIq &iq);
+    bool handleItems(const QXmppDiscoveryIq &iq);
+    void handleFailure(const QString &id);
+
+    bool contains(const QString &jid) const;
+    QStringList services(const QString &category, const QString &type) const;
+    QStringList servicesWithFeature(const QString &feature) const;
+
+signals:
+    void servicesChanged();
+
+private:
+    struct Entity {
+        QString node;
+        QStringList identities;
+        QStringList features;
+        qint64 updated;
+    };
+
+    bool isStale() const;
+    void dispatch();
+    void scheduleSave();
+
+    Connection *m_connection;
+    QString m_fileName;
+    QString m_domain;
+    qint64 m_crawled;
+    bool m_crawling;
+    QHash<QString, Entity> m_entities;
+
+    QQueue<QPair<QString, QString>> m_queue;
+    QHash<QString, QString> m_inFlight;
+    QString m_itemsRequest;
+
+    QTimer m_saveTimer;
+};
+
+#endif // SERVICEDIRECTORY_HH
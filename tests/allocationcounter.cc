@@ -0,0 +1,126 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#include "allocationcounter.hh"
+
+#include <atomic>
+
+#ifdef __GLIBC__
+
+#include <malloc.h>
+
+namespace {
+
+std::atomic<quint64> s_allocations(0);
+std::atomic<qint64> s_liveBytes(0);
+
+void allocated(void *pointer)
+{
+    if (pointer) {
+        ++s_allocations;
+        s_liveBytes += malloc_usable_size(pointer);
+    }
+}
+
+void released(void *pointer)
+{
+    if (pointer) {
+        s_liveBytes -= malloc_usable_size(pointer);
+    }
+}
+
+}
+
+/* Aligned allocations are not interposed. Qt's containers and strings never
+ * use them, so they only skew the numbers by what the libraries do on their
+ * own. */
+extern "C" {
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *pointer, size_t size);
+void __libc_free(void *pointer);
+
+void *malloc(size_t size)
+{
+    void *pointer = __libc_malloc(size);
+    allocated(pointer);
+    return pointer;
+}
+
+void *calloc(size_t count, size_t size)
+{
+    void *pointer = __libc_calloc(count, size);
+    allocated(pointer);
+    return pointer;
+}
+
+void *realloc(void *pointer, size_t size)
+{
+    released(pointer);
+    void *result = __libc_realloc(pointer, size);
+    if (!result && size) {
+        /* The old block is still there */
+        s_liveBytes += malloc_usable_size(pointer);
+        return result;
+    }
+    allocated(result);
+    return result;
+}
+
+void free(void *pointer)
+{
+    released(pointer);
+    __libc_free(pointer);
+}
+
+}
+
+bool AllocationCounter::isAvailable()
+{
+    return true;
+}
+
+quint64 AllocationCounter::allocations()
+{
+    return s_allocations;
+}
+
+qint64 AllocationCounter::liveBytes()
+{
+    return s_liveBytes;
+}
+
+#else
+
+bool AllocationCounter::isAvailable()
+{
+    return false;
+}
+
+quint64 AllocationCounter::allocations()
+{
+    return 0;
+}
+
+qint64 AllocationCounter::liveBytes()
+{
+    return 0;
+}
+
+#endif
@@ -0,0 +1,40 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef ALLOCATIONCOUNTER_HH
+#define ALLOCATIONCOUNTER_HH
+
+#include <QtGlobal>
+
+/* Counts heap allocations of the whole process.
+ *
+ * With glibc, malloc() and friends are interposed so that the benchmarks can
+ * report allocations per operation and the heap held by a data structure.
+ * Elsewhere the counter is not available and those benchmarks are skipped. */
+class AllocationCounter
+{
+public:
+    static bool isAvailable();
+
+    /* Number of allocations since the process started */
+    static quint64 allocations();
+    /* Bytes currently held on the heap, as reported by malloc_usable_size() */
+    static qint64 liveBytes();
+};
+
+#endif // ALLOCATIONCOUNTER_HH
@@ -0,0 +1,107 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#include "avatartranscoderbenchmark.hh"
+
+#include <QBuffer>
+#include <QImage>
+#include <QImageWriter>
+#include <QTest>
+
+#include <random>
+
+#include "avatartranscoder.hh"
+
+namespace {
+
+/* Noise does not compress, which makes for the largest files and the most
+ * work per pixel */
+QImage noise(const QSize &size, QImage::Format format)
+{
+    std::mt19937 random(1);
+    QImage image(size, format);
+    const QRgb opaque = image.hasAlphaChannel() ? 0 : 0xff000000;
+    for (int y = 0; y < image.height(); ++y) {
+        QRgb *line = reinterpret_cast<QRgb *>(image.scanLine(y));
+        for (int x = 0; x < image.width(); ++x) {
+            line[x] = QRgb(random()) | opaque;
+        }
+    }
+    return image;
+}
+
+QByteArray encode(const QImage &image, const char *format, int quality = -1)
+{
+    QByteArray data;
+    QBuffer buffer(&data);
+    buffer.open(QIODevice::WriteOnly);
+
+    QImageWriter writer(&buffer, format);
+    writer.setQuality(quality);
+    writer.write(image);
+    return data;
+}
+
+}
+
+void AvatarTranscoderBenchmark::initTestCase()
+{
+    /* Handed back untouched, only the header is read */
+    m_inputs.insert(QStringLiteral("fitting"), encode(noise(QSize(256, 256), QImage::Format_RGB32), "png"));
+    /* Too large in every respect, and PNG cannot be decoded at a reduced size */
+    m_inputs.insert(QStringLiteral("large png"), encode(noise(QSize(4096, 4096), QImage::Format_RGB32), "png"));
+    /* Has to stay PNG, which needs several rounds of halving to get below 1 MB */
+    m_inputs.insert(QStringLiteral("alpha png"), encode(noise(QSize(2048, 2048), QImage::Format_ARGB32), "png"));
+    /* A 48 megapixel photo */
+    m_inputs.insert(QStringLiteral("oversized jpeg"), encode(noise(QSize(8000, 6000), QImage::Format_RGB32), "jpeg", 95));
+    /* Small enough, but just over the byte limit */
+    m_inputs.insert(QStringLiteral("dense png"), encode(noise(QSize(512, 512), QImage::Format_ARGB32), "png"));
+
+    for (auto it = m_inputs.constBegin(); it != m_inputs.constEnd(); ++it) {
+        QVERIFY2(!it.value().isEmpty(), qPrintable(it.key()));
+    }
+}
+
+void AvatarTranscoderBenchmark::convert_data()
+{
+    QTest::addColumn<QString>("input");
+    QTest::addColumn<QString>("mimeType");
+
+    QTest::newRow("fitting") << QStringLiteral("fitting") << QStringLiteral("image/png");
+    QTest::newRow("large png") << QStringLiteral("large png") << QStringLiteral("image/png");
+    QTest::newRow("alpha png") << QStringLiteral("alpha png") << QStringLiteral("image/png");
+    QTest::newRow("oversized jpeg") << QStringLiteral("oversized jpeg") << QStringLiteral("image/jpeg");
+    QTest::newRow("dense png") << QStringLiteral("dense png") << QStringLiteral("image/png");
+}
+
+void AvatarTranscoderBenchmark::convert()
+{
+    QFETCH(QString, input);
+    QFETCH(QString, mimeType);
+
+    const QByteArray data = m_inputs.value(input);
+    QByteArray result;
+    QString resultMimeType;
+
+    QBENCHMARK {
+        result.clear();
+        QVERIFY(AvatarTranscoder::convert(data, mimeType, &result, &resultMimeType));
+    }
+
+    QVERIFY(uint(result.size()) <= 1024 * 1024);
+}
@@ -0,0 +1,38 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef AVATARTRANSCODERBENCHMARK_HH
+#define AVATARTRANSCODERBENCHMARK_HH
+
+#include <QHash>
+#include <QObject>
+
+class AvatarTranscoderBenchmark : public QObject
+{
+    Q_OBJECT
+private slots:
+    void initTestCase();
+
+    void convert_data();
+    void convert();
+
+private:
+    QHash<QString, QByteArray> m_inputs;
+};
+
+#endif // AVATARTRANSCODERBENCHMARK_HH
@@ -0,0 +1,168 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#include "contactstatebenchmark.hh"
+
+#include <QDebug>
+#include <QTest>
+
+#include "allocationcounter.hh"
+#include "contactstatetable.hh"
+#include "uniquehandlemap.hh"
+
+namespace {
+
+const int contactCount = 1000;
+
+QString contactJid(int contact)
+{
+    return QStringLiteral("contact%1@example.com").arg(contact);
+}
+
+QString resourceName(int resource)
+{
+    return QStringLiteral("resource%1").arg(resource);
+}
+
+/* Cycles through the usual shows, so that the most available resource keeps changing */
+QXmppPresence resourcePresence(int resource, int round)
+{
+    static const QXmppPresence::AvailableStatusType shows[] = {
+        QXmppPresence::Online, QXmppPresence::Away, QXmppPresence::XA, QXmppPresence::DND, QXmppPresence::Chat
+    };
+
+    QXmppPresence presence(QXmppPresence::Available);
+    presence.setAvailableStatusType(shows[(resource + round) % 5]);
+    presence.setPriority(resource % 3);
+    presence.setStatusText(QStringLiteral("Somewhere else"));
+    return presence;
+}
+
+void fill(ContactStateTable &table, int resourceCount)
+{
+    for (int contact = 0; contact < contactCount; ++contact) {
+        for (int resource = 0; resource < resourceCount; ++resource) {
+            table.updatePresence(contactJid(contact), resourceName(resource), resourcePresence(resource, 0));
+        }
+    }
+}
+
+void addResourceCounts()
+{
+    QTest::addColumn<int>("resourceCount");
+
+    QTest::newRow("1 resource") << 1;
+    QTest::newRow("2 resources") << 2;
+    QTest::newRow("4 resources") << 4;
+    QTest::newRow("16 resources") << 16;
+    QTest::newRow("64 resources") << 64;
+}
+
+}
+
+void ContactStateBenchmark::updatePresence_data()
+{
+    addResourceCounts();
+}
+
+void ContactStateBenchmark::updatePresence()
+{
+    QFETCH(int, resourceCount);
+
+    UniqueHandleMap handles;
+    ContactStateTable table(handles);
+    fill(table, resourceCount);
+
+    /* Prepared up front, only the aggregation is measured */
+    QStringList jids;
+    QList<QXmppPresence> presences;
+    for (int contact = 0; contact < contactCount; ++contact) {
+        jids.append(contactJid(contact));
+    }
+    for (int resource = 0; resource < resourceCount; ++resource) {
+        presences.append(resourcePresence(resource, 1));
+    }
+    const QString resource = resourceName(resourceCount - 1);
+
+    /* One iteration changes the presence of one resource of every contact */
+    int iteration = 0;
+    QBENCHMARK {
+        const QXmppPresence &presence = presences.at(iteration++ % resourceCount);
+        for (const QString &jid : jids) {
+            table.updatePresence(jid, resource, presence);
+        }
+    }
+}
+
+void ContactStateBenchmark::presence_data()
+{
+    addResourceCounts();
+}
+
+void ContactStateBenchmark::presence()
+{
+    QFETCH(int, resourceCount);
+
+    UniqueHandleMap handles;
+    ContactStateTable table(handles);
+    fill(table, resourceCount);
+
+    /* One iteration looks up the aggregated presence of every contact */
+    QBENCHMARK {
+        for (uint handle = 1; handle <= uint(contactCount); ++handle) {
+            const Tp::SimplePresence presence = table.presence(handle);
+            Q_UNUSED(presence);
+        }
+    }
+}
+
+void ContactStateBenchmark::memory_data()
+{
+    addResourceCounts();
+}
+
+void ContactStateBenchmark::memory()
+{
+    QFETCH(int, resourceCount);
+
+    if (!AllocationCounter::isAvailable()) {
+        QSKIP("Allocations cannot be counted on this platform");
+    }
+
+    /* The handles exist before, they are not part of the table */
+    UniqueHandleMap handles;
+    for (int contact = 0; contact < contactCount; ++contact) {
+        handles[contactJid(contact)];
+    }
+
+    const qint64 before = AllocationCounter::liveBytes();
+    const quint64 allocationsBefore = AllocationCounter::allocations();
+    {
+        ContactStateTable table(handles);
+        fill(table, resourceCount);
+
+        const qint64 bytes = AllocationCounter::liveBytes() - before;
+        /* The bytes are what the table keeps, including the resource names
+         * and status messages; the allocations include temporaries */
+        qDebug() << resourceCount << "resources:" << bytes / contactCount << "bytes held and"
+                 << double(AllocationCounter::allocations() - allocationsBefore) / contactCount
+                 << "allocations made per contact";
+
+        QTest::setBenchmarkResult(qreal(bytes) / contactCount, QTest::BytesAllocated);
+    }
+}
@@ -0,0 +1,59 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <QCoreApplication>
+#include <QTest>
+
+#include "avatartranscoderbenchmark.hh"
+#include "contactstatebenchmark.hh"
+#include "messagearchivesynctest.hh"
+#include "messagepartsbenchmark.hh"
+#include "outboundqueuebenchmark.hh"
+#include "outboundstanzabenchmark.hh"
+#include "searchindexbenchmark.hh"
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    app.setApplicationName(QStringLiteral("nonsense-benchmarks"));
+
+    int status = 0;
+
+    AvatarTranscoderBenchmark avatarTranscoder;
+    status |= QTest::qExec(&avatarTranscoder, argc, argv);
+
+    ContactStateBenchmark contactState;
+    status |= QTest::qExec(&contactState, argc, argv);
+
+    MessageArchiveSyncTest messageArchiveSync;
+    status |= QTest::qExec(&messageArchiveSync, argc, argv);
+
+    MessagePartsBenchmark messageParts;
+    status |= QTest::qExec(&messageParts, argc, argv);
+
+    OutboundQueueBenchmark outboundQueue;
+    status |= QTest::qExec(&outboundQueue, argc, argv);
+
+    OutboundStanzaBenchmark outboundStanza;
+    status |= QTest::qExec(&outboundStanza, argc, argv);
+
+    SearchIndexBenchmark searchIndex;
+    status |= QTest::qExec(&searchIndex, argc, argv);
+
+    return status;
+}
@@ -0,0 +1,188 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#include "messagearchivesynctest.hh"
+
+#include <QSettings>
+#include <QSignalSpy>
+#include <QTemporaryDir>
+#include <QTest>
+
+#include <QXmppClient.h>
+#include <QXmppConfiguration.h>
+
+#include "messagearchivesync.hh"
+#include "scriptedserver.hh"
+
+namespace {
+
+typedef QPair<QString, QStringList> Batch;
+
+/* Records every batch as the contact and the IDs of its messages */
+void recordBatches(MessageArchiveSync *sync, QList<Batch> *batches)
+{
+    QObject::connect(sync, &MessageArchiveSync::messagesReceived, sync,
+                     [batches](const QString &contactJid, const QList<QXmppMessage> &messages) {
+        QStringList ids;
+        for (const QXmppMessage &message : messages) {
+            ids.append(message.id());
+        }
+        batches->append(qMakePair(contactJid, ids));
+    });
+}
+
+void presetLastId(const QString &statePath, const QString &lastId)
+{
+    QSettings state(statePath, QSettings::IniFormat);
+    state.setValue(QStringLiteral("mam/last-id"), lastId);
+}
+
+QString savedLastId(const QString &statePath)
+{
+    QSettings state(statePath, QSettings::IniFormat);
+    return state.value(QStringLiteral("mam/last-id")).toString();
+}
+
+}
+
+void MessageArchiveSyncTest::init()
+{
+    m_dir = new QTemporaryDir;
+    m_server = new ScriptedServer;
+    m_client = new QXmppClient;
+
+    if (!MessageArchiveSync::isSupported()) {
+        QSKIP("QXmpp has no support for the message archive");
+    }
+
+    QVERIFY(m_dir->isValid());
+    QVERIFY(m_server->listen());
+}
+
+void MessageArchiveSyncTest::cleanup()
+{
+    delete m_client;
+    delete m_server;
+    delete m_dir;
+    m_client = nullptr;
+    m_server = nullptr;
+    m_dir = nullptr;
+}
+
+void MessageArchiveSyncTest::pagesAndBatches()
+{
+    presetLastId(statePath(), QStringLiteral("a0"));
+
+    MessageArchiveSync sync(m_client, statePath());
+    QList<Batch> batches;
+    recordBatches(&sync, &batches);
+    QSignalSpy finished(&sync, &MessageArchiveSync::finished);
+
+    QVERIFY(connectClient());
+    sync.start();
+    QVERIFY(sync.isRunning());
+
+    QTRY_VERIFY(m_server->hasArchiveQuery());
+    ScriptedServer::ArchiveQuery query = m_server->takeArchiveQuery();
+    QCOMPARE(query.after, QStringLiteral("a0"));
+    QCOMPARE(query.max, 250);
+
+    m_server->sendArchivedMessage(query, QStringLiteral("a1"), QStringLiteral("alice@localhost/phone"),
+                                  QStringLiteral("m1"), QStringLiteral("one"));
+    m_server->sendArchivedMessage(query, QStringLiteral("a2"), QStringLiteral("bob@localhost/laptop"),
+                                  QStringLiteral("m2"), QStringLiteral("two"));
+    m_server->sendArchivedMessage(query, QStringLiteral("a3"), QStringLiteral("alice@localhost/phone"),
+                                  QStringLiteral("m3"), QStringLiteral("three"));
+    m_server->sendArchiveFin(query, QStringLiteral("a3"), false);
+
+    /* The next page is asked for from the end of this one, and the page is
+     * handed out as one batch per conversation in archive order */
+    QTRY_VERIFY(m_server->hasArchiveQuery());
+    query = m_server->takeArchiveQuery();
+    QCOMPARE(query.after, QStringLiteral("a3"));
+    QCOMPARE(batches.count(), 2);
+    QCOMPARE(batches.at(0), Batch(QStringLiteral("alice@localhost"), QStringList() << QStringLiteral("m1") << QStringLiteral("m3")));
+    QCOMPARE(batches.at(1), Batch(QStringLiteral("bob@localhost"), QStringList() << QStringLiteral("m2")));
+    QCOMPARE(finished.count(), 0);
+
+    /* Delivered live while the catch-up was running */
+    QXmppMessage live(QStringLiteral("bob@localhost/laptop"), QStringLiteral("me@localhost"), QStringLiteral("five"));
+    live.setId(QStringLiteral("m5"));
+    QVERIFY(!sync.checkAndRemember(live));
+
+    m_server->sendArchivedMessage(query, QStringLiteral("a4"), QStringLiteral("alice@localhost/phone"),
+                                  QStringLiteral("m3"), QStringLiteral("three"));
+    m_server->sendArchivedMessage(query, QStringLiteral("a5"), QStringLiteral("bob@localhost/laptop"),
+                                  QStringLiteral("m4"), QStringLiteral("four"));
+    m_server->sendArchivedMessage(query, QStringLiteral("a6"), QStringLiteral("bob@localhost/laptop"),
+                                  QStringLiteral("m5"), QStringLiteral("five"));
+    m_server->sendArchiveFin(query, QStringLiteral("a6"), true);
+
+    QTRY_COMPARE(finished.count(), 1);
+    QVERIFY(!sync.isRunning());
+    QVERIFY(!m_server->hasArchiveQuery());
+    QCOMPARE(batches.count(), 3);
+    QCOMPARE(batches.at(2), Batch(QStringLiteral("bob@localhost"), QStringList() << QStringLiteral("m4")));
+    QCOMPARE(savedLastId(statePath()), QStringLiteral("a6"));
+}
+
+void MessageArchiveSyncTest::prunedPosition()
+{
+    presetLastId(statePath(), QStringLiteral("pruned"));
+
+    MessageArchiveSync sync(m_client, statePath());
+    QList<Batch> batches;
+    recordBatches(&sync, &batches);
+    QSignalSpy finished(&sync, &MessageArchiveSync::finished);
+
+    QVERIFY(connectClient());
+    sync.start();
+
+    QTRY_VERIFY(m_server->hasArchiveQuery());
+    ScriptedServer::ArchiveQuery query = m_server->takeArchiveQuery();
+    QCOMPARE(query.after, QStringLiteral("pruned"));
+    m_server->sendArchiveError(query, QStringLiteral("item-not-found"));
+
+    /* Starts over from the newest archive ID */
+    QTRY_VERIFY(m_server->hasArchiveQuery());
+    query = m_server->takeArchiveQuery();
+    QVERIFY(query.before);
+    QCOMPARE(query.max, 1);
+    QVERIFY(sync.isRunning());
+
+    m_server->sendArchivedMessage(query, QStringLiteral("b9"), QStringLiteral("alice@localhost/phone"),
+                                  QStringLiteral("m9"), QStringLiteral("old"));
+    m_server->sendArchiveFin(query, QStringLiteral("b9"), false);
+
+    QTRY_COMPARE(finished.count(), 1);
+    QVERIFY(!sync.isRunning());
+    QVERIFY(batches.isEmpty());
+    QCOMPARE(savedLastId(statePath()), QStringLiteral("b9"));
+}
+
+QString MessageArchiveSyncTest::statePath() const
+{
+    return m_dir->filePath(QStringLiteral("state.ini"));
+}
+
+bool MessageArchiveSyncTest::connectClient()
+{
+    QSignalSpy connected(m_client, &QXmppClient::connected);
+    m_client->connectToServer(m_server->clientConfiguration());
+    return connected.count() > 0 || connected.wait(5000);
+}
@@ -0,0 +1,128 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#include "messagepartsbenchmark.hh"
+
+#include <QTest>
+
+#include <TelepathyQt/Constants>
+
+#include "allocationcounter.hh"
+#include "messageparts.hh"
+
+namespace {
+
+enum Shape {
+    Plain,
+    ReceiptRequested,
+    Marker,
+    Error
+};
+
+const int messagesPerRun = 1000;
+
+/* Fills in the parts the way TextChannel::processReceivedMessage does for
+ * the given kind of stanza. The body is copied in first, like the stanza
+ * hands it out. */
+Tp::MessagePartList build(Shape shape, const QString &id, const QString &body)
+{
+    MessagePartsBuilder builder;
+    builder.setToken(id)
+           .setSent(1460000000)
+           .setReceived(1460000001)
+           .setSender(42, QStringLiteral("juliet@capulet.example"));
+
+    switch (shape) {
+    case Plain:
+    case ReceiptRequested:
+        builder.setType(Tp::ChannelTextMessageTypeNormal).setTextContent(body);
+        break;
+    case Marker:
+        builder.setType(Tp::ChannelTextMessageTypeDeliveryReport)
+               .setDeliveryStatus(Tp::DeliveryStatusRead)
+               .setDeliveryToken(id);
+        break;
+    case Error:
+        builder.setType(Tp::ChannelTextMessageTypeDeliveryReport)
+               .setDeliveryToken(id)
+               .setDeliveryStatus(Tp::DeliveryStatusPermanentlyFailed)
+               .setDeliveryErrorMessage(QStringLiteral("service-unavailable (code 503)"));
+        break;
+    }
+
+    return builder.take();
+}
+
+void addShapes()
+{
+    QTest::addColumn<int>("shape");
+
+    QTest::newRow("plain") << int(Plain);
+    QTest::newRow("receipt") << int(ReceiptRequested);
+    QTest::newRow("marker") << int(Marker);
+    QTest::newRow("error") << int(Error);
+}
+
+}
+
+void MessagePartsBenchmark::build_data()
+{
+    addShapes();
+}
+
+void MessagePartsBenchmark::build()
+{
+    QFETCH(int, shape);
+
+    const QString id = QStringLiteral("5d1c2b7e-3b86-4a3f-9d63-0f4bd8d1a0c2");
+    const QString body = QStringLiteral("Wherefore art thou Romeo? Deny thy father and refuse thy name.");
+
+    /* One iteration converts messagesPerRun messages */
+    QBENCHMARK {
+        for (int i = 0; i < messagesPerRun; ++i) {
+            Tp::MessagePartList parts = build(Shape(shape), id, body);
+            Q_UNUSED(parts);
+        }
+    }
+}
+
+void MessagePartsBenchmark::allocations_data()
+{
+    addShapes();
+}
+
+void MessagePartsBenchmark::allocations()
+{
+    QFETCH(int, shape);
+
+    if (!AllocationCounter::isAvailable()) {
+        QSKIP("Allocations cannot be counted on this platform");
+    }
+
+    const QString id = QStringLiteral("5d1c2b7e-3b86-4a3f-9d63-0f4bd8d1a0c2");
+    const QString body = QStringLiteral("Wherefore art thou Romeo? Deny thy father and refuse thy name.");
+
+    const quint64 before = AllocationCounter::allocations();
+    for (int i = 0; i < messagesPerRun; ++i) {
+        Tp::MessagePartList parts = build(Shape(shape), id, body);
+        Q_UNUSED(parts);
+    }
+    const quint64 after = AllocationCounter::allocations();
+
+    QTest::setBenchmarkResult(qreal(after - before) / messagesPerRun, QTest::Events);
+}
@@ -0,0 +1,109 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#include "outboundqueuebenchmark.hh"
+
+#include <QSignalSpy>
+#include <QSslSocket>
+#include <QTest>
+
+#include <QXmppClient.h>
+#include <QXmppConfiguration.h>
+
+#include "outboundqueue.hh"
+#include "outboundstanza.hh"
+#include "scriptedserver.hh"
+
+namespace {
+
+const QString to = QStringLiteral("juliet@localhost/balcony");
+
+/* A burst like the one a group of acknowledged messages causes */
+OutboundStanza displayedMarker(int i)
+{
+    OutboundStanza marker = OutboundStanza::marker(QXmppMessage::Displayed, QString::number(i));
+    marker.setTo(to);
+    marker.setId(QStringLiteral("marker-%1").arg(i));
+    return marker;
+}
+
+}
+
+void OutboundQueueBenchmark::init()
+{
+    m_server = new ScriptedServer;
+    m_client = new QXmppClient;
+    QVERIFY(m_server->listen());
+
+    QSignalSpy connected(m_client, &QXmppClient::connected);
+    m_client->connectToServer(m_server->clientConfiguration());
+    QVERIFY(connected.count() > 0 || connected.wait(5000));
+}
+
+void OutboundQueueBenchmark::cleanup()
+{
+    delete m_client;
+    delete m_server;
+    m_client = nullptr;
+    m_server = nullptr;
+}
+
+void OutboundQueueBenchmark::writes_data()
+{
+    QTest::addColumn<bool>("corked");
+    QTest::addColumn<int>("burst");
+
+    QTest::newRow("uncorked 10") << false << 10;
+    QTest::newRow("corked 10") << true << 10;
+    QTest::newRow("uncorked 50") << false << 50;
+    QTest::newRow("corked 50") << true << 50;
+}
+
+/* Reports the socket writes that one burst of small stanzas takes. Every
+ * bytesWritten() of the socket stands for one write() to the kernel.
+ *
+ * The uncorked rows hand each stanza to QXmpp right away, like the queue did
+ * before corking. The corked rows go through OutboundQueue, which only corks
+ * when stream management cannot be active (QXmpp 1.4 or later, or before 1.0). */
+void OutboundQueueBenchmark::writes()
+{
+    QFETCH(bool, corked);
+    QFETCH(int, burst);
+
+    QSslSocket *socket = m_client->findChild<QSslSocket *>();
+    QVERIFY(socket);
+
+    /* Let the presence and roster request of the login go out first */
+    QTRY_COMPARE(socket->bytesToWrite(), qint64(0));
+    QTest::qWait(100);
+
+    OutboundQueue queue(m_client);
+    QSignalSpy written(socket, &QSslSocket::bytesWritten);
+
+    for (int i = 0; i < burst; ++i) {
+        if (corked) {
+            QVERIFY(queue.send(displayedMarker(i), OutboundQueue::Interactive));
+        } else {
+            QVERIFY(m_client->sendPacket(displayedMarker(i)));
+        }
+    }
+
+    QTRY_VERIFY(queue.depth() == 0 && socket->bytesToWrite() == 0);
+
+    QTest::setBenchmarkResult(written.count(), QTest::Events);
+}
@@ -0,0 +1,154 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#include "outboundstanzabenchmark.hh"
+
+#include <QTest>
+#include <QUuid>
+#include <QXmlStreamWriter>
+
+#include "outboundstanza.hh"
+
+namespace {
+
+enum Shape {
+    Chat,
+    Receipt,
+    Displayed,
+    ChatState
+};
+
+const int stanzasPerRun = 1000;
+
+const QString to = QStringLiteral("juliet@capulet.example/balcony");
+const QString from = QStringLiteral("romeo@montague.example/garden");
+const QString markerId = QStringLiteral("5d1c2b7e-3b86-4a3f-9d63-0f4bd8d1a0c2");
+const QString body = QStringLiteral("It is the east, and Juliet is the sun. <Arise>, fair sun & kill the envious moon.");
+
+/* What TextChannel did before the templates: a QUuid per stanza and a QXmppMessage */
+QByteArray serializeMessage(Shape shape)
+{
+    QXmppMessage message;
+    message.setTo(to);
+    message.setFrom(from);
+    message.setId(QUuid::createUuid().toString());
+
+    switch (shape) {
+    case Chat:
+        message.setBody(body);
+        message.setReceiptRequested(true);
+        message.setMarkable(true);
+        message.setState(QXmppMessage::Active);
+        break;
+    case Receipt:
+        message.setMarker(QXmppMessage::Received);
+        message.setMarkerId(markerId);
+        break;
+    case Displayed:
+        message.setMarker(QXmppMessage::Displayed);
+        message.setMarkerId(markerId);
+        break;
+    case ChatState:
+        message.setState(QXmppMessage::Composing);
+        break;
+    }
+
+    /* The way QXmppStream::sendPacket() serializes a packet */
+    QByteArray data;
+    QXmlStreamWriter writer(&data);
+    message.toXml(&writer);
+    return data;
+}
+
+QByteArray serializeOutboundStanza(Shape shape, StanzaIdGenerator &ids)
+{
+    OutboundStanza stanza = OutboundStanza::chatState(QXmppMessage::Composing);
+    switch (shape) {
+    case Chat:
+        stanza = OutboundStanza::chatMessage(body, /* requestReceipt */ true, QXmppMessage::Active);
+        break;
+    case Receipt:
+        stanza = OutboundStanza::marker(QXmppMessage::Received, markerId);
+        break;
+    case Displayed:
+        stanza = OutboundStanza::marker(QXmppMessage::Displayed, markerId);
+        break;
+    case ChatState:
+        break;
+    }
+    stanza.setTo(to);
+    stanza.setFrom(from);
+    stanza.setId(ids.next());
+
+    QByteArray data;
+    QXmlStreamWriter writer(&data);
+    stanza.toXml(&writer);
+    return data;
+}
+
+}
+
+void OutboundStanzaBenchmark::serialize_data()
+{
+    QTest::addColumn<int>("shape");
+    QTest::addColumn<bool>("templates");
+
+    QTest::newRow("chat/qxmpp") << int(Chat) << false;
+    QTest::newRow("chat/templates") << int(Chat) << true;
+    QTest::newRow("receipt/qxmpp") << int(Receipt) << false;
+    QTest::newRow("receipt/templates") << int(Receipt) << true;
+    QTest::newRow("displayed/qxmpp") << int(Displayed) << false;
+    QTest::newRow("displayed/templates") << int(Displayed) << true;
+    QTest::newRow("chat state/qxmpp") << int(ChatState) << false;
+    QTest::newRow("chat state/templates") << int(ChatState) << true;
+}
+
+void OutboundStanzaBenchmark::serialize()
+{
+    QFETCH(int, shape);
+    QFETCH(bool, templates);
+
+    StanzaIdGenerator ids;
+
+    /* One iteration serializes stanzasPerRun stanzas */
+    QBENCHMARK {
+        for (int i = 0; i < stanzasPerRun; ++i) {
+            const QByteArray data = templates ? serializeOutboundStanza(Shape(shape), ids) : serializeMessage(Shape(shape));
+            Q_UNUSED(data);
+        }
+    }
+}
+
+void OutboundStanzaBenchmark::writeToString()
+{
+    /* The templates go through the writer, so they also work without a device */
+    StanzaIdGenerator ids;
+    OutboundStanza stanza = OutboundStanza::marker(QXmppMessage::Displayed, markerId);
+    stanza.setTo(to);
+    stanza.setId(ids.next());
+
+    QString xml;
+    QXmlStreamWriter writer(&xml);
+    writer.writeStartElement(QStringLiteral("stream"));
+    stanza.toXml(&writer);
+    writer.writeEndElement();
+
+    QVERIFY(xml.startsWith(QLatin1String("<stream><message id=\"")));
+    QVERIFY(xml.contains(QLatin1String("<displayed xmlns=\"urn:xmpp:chat-markers:0\" id=\"") + markerId + QLatin1String("\"/>")));
+    QVERIFY(xml.endsWith(QLatin1String("</message></stream>")));
+}
@@ -0,0 +1,220 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#include "scriptedserver.hh"
+
+#include <QRegularExpression>
+#include <QTcpSocket>
+
+#include <QXmppConfiguration.h>
+
+namespace {
+
+const QString streamHeader = QStringLiteral("<?xml version='1.0'?><stream:stream xmlns='jabber:client' "
+                                            "xmlns:stream='http://etherx.jabber.org/streams' "
+                                            "id='scripted' from='localhost' version='1.0'>");
+
+}
+
+ScriptedServer::ScriptedServer(QObject *parent) :
+    QObject(parent),
+    m_socket(nullptr),
+    m_step(StreamStart)
+{
+    connect(&m_server, &QTcpServer::newConnection, this, &ScriptedServer::onNewConnection);
+}
+
+bool ScriptedServer::listen()
+{
+    return m_server.listen(QHostAddress::LocalHost);
+}
+
+QXmppConfiguration ScriptedServer::clientConfiguration() const
+{
+    QXmppConfiguration config;
+    config.setHost(QStringLiteral("127.0.0.1"));
+    config.setPort(m_server.serverPort());
+    config.setDomain(QStringLiteral("localhost"));
+    config.setUser(QStringLiteral("me"));
+    config.setPassword(QStringLiteral("secret"));
+    config.setResource(QStringLiteral("test"));
+    config.setStreamSecurityMode(QXmppConfiguration::TLSDisabled);
+    return config;
+}
+
+bool ScriptedServer::hasArchiveQuery() const
+{
+    return !m_queries.isEmpty();
+}
+
+ScriptedServer::ArchiveQuery ScriptedServer::takeArchiveQuery()
+{
+    return m_queries.dequeue();
+}
+
+void ScriptedServer::sendArchivedMessage(const ArchiveQuery &query, const QString &archiveId,
+                                         const QString &from, const QString &id, const QString &body)
+{
+    send(QStringLiteral("<message to='me@localhost/test'>"
+                        "<result xmlns='urn:xmpp:mam:2' queryid='%1' id='%2'>"
+                        "<forwarded xmlns='urn:xmpp:forward:0'>"
+                        "<delay xmlns='urn:xmpp:delay' stamp='2016-04-07T12:00:00Z'/>"
+                        "<message xmlns='jabber:client' type='chat' from='%3' to='me@localhost' id='%4'>"
+                        "<body>%5</body>"
+                        "</message></forwarded></result></message>")
+         .arg(query.queryId, archiveId, from, id, body.toHtmlEscaped()));
+}
+
+void ScriptedServer::sendArchiveFin(const ArchiveQuery &query, const QString &lastId, bool complete)
+{
+    send(QStringLiteral("<iq type='result' id='%1'>"
+                        "<fin xmlns='urn:xmpp:mam:2' complete='%2'>"
+                        "<set xmlns='http://jabber.org/protocol/rsm'><last>%3</last></set>"
+                        "</fin></iq>")
+         .arg(query.id, complete ? QStringLiteral("true") : QStringLiteral("false"), lastId));
+}
+
+void ScriptedServer::sendArchiveError(const ArchiveQuery &query, const QString &condition)
+{
+    send(QStringLiteral("<iq type='error' id='%1'>"
+                        "<error type='cancel'><%2 xmlns='urn:ietf:params:xml:ns:xmpp-stanzas'/></error>"
+                        "</iq>")
+         .arg(query.id, condition));
+}
+
+void ScriptedServer::onNewConnection()
+{
+    QTcpSocket *socket = m_server.nextPendingConnection();
+    if (m_socket) {
+        /* One client per test */
+        socket->abort();
+        socket->deleteLater();
+        return;
+    }
+
+    m_socket = socket;
+    connect(m_socket, &QTcpSocket::readyRead, this, &ScriptedServer::onReadyRead);
+}
+
+void ScriptedServer::onReadyRead()
+{
+    m_buffer += QString::fromUtf8(m_socket->readAll());
+    process();
+}
+
+void ScriptedServer::process()
+{
+    static const QRegularExpression bindRequest(QStringLiteral("<iq\\b[^>]*\\bid=[\"']([^\"']+)[\"'][^>]*>\\s*"
+                                                               "<bind\\b.*?</iq>"),
+                                                QRegularExpression::DotMatchesEverythingOption);
+    static const QRegularExpression archiveRequest(QStringLiteral("<iq\\b[^>]*\\bid=[\"']([^\"']+)[\"'][^>]*>\\s*"
+                                                                  "<query xmlns=[\"']urn:xmpp:mam:2[\"'](.*?)</iq>"),
+                                                   QRegularExpression::DotMatchesEverythingOption);
+    static const QRegularExpression queryId(QStringLiteral("\\bqueryid=[\"']([^\"']+)[\"']"));
+    static const QRegularExpression max(QStringLiteral("<max>(\\d+)</max>"));
+    static const QRegularExpression after(QStringLiteral("<after>([^<]*)</after>"));
+
+    for (;;) {
+        switch (m_step) {
+        case StreamStart:
+            if (!consumeStreamHeader()) {
+                return;
+            }
+            send(streamHeader + QStringLiteral("<stream:features>"
+                                               "<mechanisms xmlns='urn:ietf:params:xml:ns:xmpp-sasl'>"
+                                               "<mechanism>PLAIN</mechanism>"
+                                               "</mechanisms></stream:features>"));
+            m_step = Auth;
+            break;
+        case Auth: {
+            const int end = m_buffer.indexOf(QLatin1String("</auth>"));
+            if (end < 0) {
+                return;
+            }
+            m_buffer.remove(0, end + 7);
+            send(QStringLiteral("<success xmlns='urn:ietf:params:xml:ns:xmpp-sasl'/>"));
+            m_step = StreamRestart;
+            break;
+        }
+        case StreamRestart:
+            if (!consumeStreamHeader()) {
+                return;
+            }
+            send(streamHeader + QStringLiteral("<stream:features>"
+                                               "<bind xmlns='urn:ietf:params:xml:ns:xmpp-bind'/>"
+                                               "</stream:features>"));
+            m_step = Bind;
+            break;
+        case Bind: {
+            const QRegularExpressionMatch match = bindRequest.match(m_buffer);
+            if (!match.hasMatch()) {
+                return;
+            }
+            m_buffer.remove(0, match.capturedEnd());
+            send(QStringLiteral("<iq type='result' id='%1'>"
+                                "<bind xmlns='urn:ietf:params:xml:ns:xmpp-bind'><jid>me@localhost/test</jid></bind>"
+                                "</iq>").arg(match.captured(1)));
+            m_step = Ready;
+            break;
+        }
+        case Ready: {
+            /* Presence, roster requests and the like go unanswered */
+            const QRegularExpressionMatch match = archiveRequest.match(m_buffer);
+            if (!match.hasMatch()) {
+                return;
+            }
+            m_buffer.remove(0, match.capturedEnd());
+
+            const QString request = match.captured(2);
+            const QRegularExpressionMatch maxMatch = max.match(request);
+
+            ArchiveQuery query;
+            query.id = match.captured(1);
+            query.queryId = queryId.match(request).captured(1);
+            query.max = maxMatch.hasMatch() ? maxMatch.captured(1).toInt() : -1;
+            query.after = after.match(request).captured(1);
+            query.before = request.contains(QLatin1String("<before"));
+            m_queries.enqueue(query);
+            break;
+        }
+        }
+    }
+}
+
+bool ScriptedServer::consumeStreamHeader()
+{
+    const int start = m_buffer.indexOf(QLatin1String("<stream:stream"));
+    if (start < 0) {
+        return false;
+    }
+
+    const int end = m_buffer.indexOf(QLatin1Char('>'), start);
+    if (end < 0) {
+        return false;
+    }
+
+    m_buffer.remove(0, end + 1);
+    return true;
+}
+
+void ScriptedServer::send(const QString &xml)
+{
+    if (m_socket) {
+        m_socket->write(xml.toUtf8());
+    }
+}
@@ -0,0 +1,81 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef SCRIPTEDSERVER_HH
+#define SCRIPTEDSERVER_HH
+
+#include <QObject>
+#include <QQueue>
+#include <QTcpServer>
+
+class QTcpSocket;
+class QXmppConfiguration;
+
+/* A minimal XMPP server on the loopback interface for the tests.
+ *
+ * It logs in one client (SASL PLAIN without TLS, resource binding) and then
+ * only records the archive queries (XEP-0313) that it gets. The test answers
+ * them with scripted result pages, fins or errors. */
+class ScriptedServer : public QObject
+{
+    Q_OBJECT
+public:
+    struct ArchiveQuery {
+        QString id;
+        QString queryId;
+        int max;
+        QString after;
+        bool before;
+    };
+
+    explicit ScriptedServer(QObject *parent = nullptr);
+
+    bool listen();
+    QXmppConfiguration clientConfiguration() const;
+
+    bool hasArchiveQuery() const;
+    ArchiveQuery takeArchiveQuery();
+
+    void sendArchivedMessage(const ArchiveQuery &query, const QString &archiveId,
+                             const QString &from, const QString &id, const QString &body);
+    void sendArchiveFin(const ArchiveQuery &query, const QString &lastId, bool complete);
+    void sendArchiveError(const ArchiveQuery &query, const QString &condition);
+
+private:
+    enum Step {
+        StreamStart,
+        Auth,
+        StreamRestart,
+        Bind,
+        Ready
+    };
+
+    void onNewConnection();
+    void onReadyRead();
+    void process();
+    bool consumeStreamHeader();
+    void send(const QString &xml);
+
+    QTcpServer m_server;
+    QTcpSocket *m_socket;
+    Step m_step;
+    QString m_buffer;
+    QQueue<ArchiveQuery> m_queries;
+};
+
+#endif // SCRIPTEDSERVER_HH
@@ -0,0 +1,147 @@
+/*
+ * This file is part of the telepathy-nonsense connection manager.
+ * Copyright (C) 2016 Niels Ole Salscheider <niels_ole@salscheider-online.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#include "searchindexbenchmark.hh"
+
+#include <QDebug>
+#include <QTest>
+
+#include <random>
+
+#include "searchindex.hh"
+
+namespace {
+
+/* Size of the index that is queried */
+const int indexedMessages = 1000000;
+/* Messages added per iteration of the indexing benchmark */
+const int messagesPerRun = 10000;
+const int vocabularySize = 20000;
+const int conversations = 200;
+
+QString word(int index)
+{
+    QString result;
+    do {
+        result.append(QLatin1Char('a' + index % 26));
+        index /= 26;
+    } while (index > 0);
+    return result;
+}
+
+/* Random messages whose words roughly follow Zipf's law */
+class MessageGenerator
+{
+public:
+    MessageGenerator() : m_random(1), m_vocabulary(vocabularySize), m_length(3, 25)
+    {
+        for (int i = 0; i < vocabularySize; ++i) {
+            m_words.append(word(i));
+        }
+    }
+
+    QString next()
+    {
+        QString text;
+        const int length = m_length(m_random);
+        for (int i = 0; i < length; ++i) {
+            const double uniform = m_vocabulary(m_random) / double(vocabularySize);
+            text.append(m_words.at(int(uniform * uniform * uniform * (vocabularySize - 1))));
+            text.append(QLatin1Char(' '));
+        }
+        return text;
+    }
+
+    QString conversation()
+    {
+        return QStringLiteral("contact%1@example.com").arg(m_random() % conversations);
+    }
+
+private:
+    std::mt19937 m_random;
+    std::uniform_int_distribution<int> m_vocabulary;
+    std::uniform_int_distribution<int> m_length;
+    QStringList m_words;
+};
+
+}
+
+void SearchIndexBenchmark::initTestCase()
+{
+    QVERIFY(m_dir.isValid());
+
+    m_index = new SearchIndex;
+    QVERIFY(m_index->open(m_dir.path() + QLatin1String("/queried")));
+
+    MessageGenerator generator;
+    for (int i = 0; i < indexedMessages; ++i) {
+        m_index->addDocument(generator.conversation(), QString::number(i), generator.next());
+    }
+    m_index->flush();
+
+    /* Query the index the way it looks once the merges have caught up */
+    QTRY_VERIFY_WITH_TIMEOUT(!m_index->isMerging(), 30 * 60 * 1000);
+    qDebug() << indexedMessages << "messages in" << m_index->segmentCount() << "segments";
+}
+
+void SearchIndexBenchmark::cleanupTestCase()
+{
+    delete m_index;
+}
+
+void SearchIndexBenchmark::addDocument()
+{
+    SearchIndex index;
+    QVERIFY(index.open(m_dir.path() + QLatin1String("/indexed")));
+
+    MessageGenerator generator;
+    QStringList texts;
+    for (int i = 0; i < messagesPerRun; ++i) {
+        texts.append(generator.next());
+    }
+    const QString conversation = generator.conversation();
+
+    /* One iteration indexes messagesPerRun messages, including the segments that are written */
+    int id = 0;
+    QBENCHMARK {
+        for (const QString &text : texts) {
+            index.addDocument(conversation, QString::number(id++), text);
+        }
+    }
+}
+
+void SearchIndexBenchmark::search_data()
+{
+    QTest::addColumn<QString>("query");
+
+    QTest::newRow("frequent term") << word(0);
+    QTest::newRow("rare term") << word(vocabularySize - 1);
+    QTest::newRow("two terms") << word(1) + QLatin1Char(' ') + word(2);
+    QTest::newRow("prefix") << QStringLiteral("ab*");
+    QTest::newRow("phrase") << QLatin1Char('"') + word(0) + QLatin1Char(' ') + word(1) + QLatin1Char('"');
+}
+
+void SearchIndexBenchmark::search()
+{
+    QFETCH(QString, query);
+
+    QBENCHMARK {
+        const QList<SearchHit> hits = m_index->search(query, 50);
+        Q_UNUSED(hits);
+    }
+}
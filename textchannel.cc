@@ -20,6 +20,17 @@
 #include "textchannel.hh"
 #include "common.hh"
 #include "connection.hh"
+#include "messageparts.hh"
+#include "messagestore.hh"
+
+#include <QDir>
+#include <QFileInfo>
+
+#include <limits>
+
+#include <TelepathyQt/Utils>
+
+#include <QXmppUtils.h>
 
 QString xmppConditionToStr(QXmppStanza::Error::Condition condition)
 {
@@ -77,7 +88,9 @@ TextChannel::TextChannel(Connection *connection, Tp::BaseChannel *baseChannel)
     : Tp::BaseChannelTextType(baseChannel),
       m_connection(connection),
       m_targetHandle(baseChannel->targetHandle()),
-      m_targetJid(baseChannel->targetID())
+      m_targetJid(baseChannel->targetID()),
+      m_pendingCount(0),
+      m_trackDelivery(baseChannel->targetHandleType() == Tp::HandleTypeContact)
 {
     DBG;
     QStringList supportedContentTypes = QStringList() << QStringLiteral("text/plain");
@@ -101,6 +114,23 @@ TextChannel::TextChannel(Connection *connection, Tp::BaseChannel *baseChannel)
     m_chatStateIface = Tp::BaseChannelChatStateInterface::create();
     m_chatStateIface->setSetChatStateCallback(Tp::memFun(this, &TextChannel::setChatState));
     baseChannel->plugInterface(Tp::AbstractChannelInterfacePtr::dynamicCast(m_chatStateIface));
+    connect(&m_chatStates, &ChatStateThrottle::sendState, this, &TextChannel::sendChatState);
+    connect(&m_markers, &MarkerAggregator::sendMarker, this, &TextChannel::sendMarker);
+    /* Markers that are still collected would be lost with the channel */
+    connect(baseChannel, &Tp::BaseChannel::closed, &m_markers, &MarkerAggregator::flush);
+
+    m_historyIface = HistoryInterface::create(this);
+    baseChannel->plugInterface(Tp::AbstractChannelInterfacePtr::dynamicCast(m_historyIface));
+
+    /* Messages that were spilled to disk before a restart are still pending */
+    if (QFile::exists(pendingSpoolFileName()) && openPendingSpool()) {
+        pageInSpooledMessages();
+    }
+}
+
+TextChannel::~TextChannel()
+{
+    m_markers.flush();
 }
 
 TextChannelPtr TextChannel::create(Connection *connection, Tp::BaseChannel *baseChannel)
@@ -110,17 +140,16 @@ TextChannelPtr TextChannel::create(Connection *connection, Tp::BaseChannel *base
 
 QString TextChannel::sendMessage(const Tp::MessagePartList &messageParts, uint flags, Tp::DBusError *error)
 {
-    QUuid messageToken = QUuid::createUuid();
-    QXmppMessage message;
-    message.setTo(targetJid());
-    message.setFrom(selfJid());
-    message.setId(messageToken.toString());
-
-    if (flags & (Tp::MessageSendingFlagReportDelivery | Tp::MessageSendingFlagReportRead)) {
-        message.setReceiptRequested(true);
-        message.setMarkable(true);
+    /* There is no way to delay the D-Bus reply, so tell the sender to retry later */
+    if (m_connection->isOutboundQueueFull()) {
+        if (error) {
+            error->set(TP_QT_ERROR_SERVICE_BUSY, QStringLiteral("Too many messages are waiting to be sent"));
+        }
+        return QString();
     }
 
+    const QString messageToken = m_connection->nextStanzaId();
+
     QString content;
     for (auto &part : messageParts) {
         // TODO handle other parts?
@@ -129,10 +158,32 @@ QString TextChannel::sendMessage(const Tp::MessagePartList &messageParts, uint f
             break;
         }
     }
-    message.setBody(content);
 
-    sendQXmppMessage(message);
-    return messageToken.toString();
+    const bool requestReceipt = flags & (Tp::MessageSendingFlagReportDelivery | Tp::MessageSendingFlagReportRead);
+    /* Once we use chat states, every message has to say that we are active */
+    const QXmppMessage::State state = m_chatStates.sentState() != QXmppMessage::None ? QXmppMessage::Active : QXmppMessage::None;
+    OutboundStanza message = OutboundStanza::chatMessage(content, requestReceipt, state);
+    message.setTo(targetJid());
+    message.setFrom(selfJid());
+    message.setId(messageToken);
+
+    if (!sendStanza(message)) {
+        if (error) {
+            error->set(TP_QT_ERROR_NETWORK_ERROR, QStringLiteral("Could not send the message"));
+        }
+        return QString();
+    }
+
+    if (state != QXmppMessage::None) {
+        m_chatStates.messageSent();
+    }
+    if (m_trackDelivery) {
+        /* Without receipts or markers, we would only ever resend the message and then give up on it */
+        const bool expectReceipt = requestReceipt && m_connection->supportsDeliveryReceipts(m_targetJid);
+        m_connection->deliveryTracker()->track(messageToken, m_targetJid, content, expectReceipt);
+    }
+    storeMessage(messageToken, QDateTime::currentMSecsSinceEpoch(), selfJid(), content, /* outgoing */ true);
+    return messageToken;
 }
 
 void TextChannel::onMessageReceived(const QXmppMessage &message)
@@ -140,16 +191,61 @@ void TextChannel::onMessageReceived(const QXmppMessage &message)
     processReceivedMessage(message, m_targetHandle, m_targetJid);
 }
 
-void TextChannel::processReceivedMessage(const QXmppMessage &message, uint senderHandle, const QString &senderID)
+void TextChannel::processArchivedMessages(const QList<QXmppMessage> &messages)
 {
-    Tp::MessagePart header;
-    header[QStringLiteral("message-token")] = QDBusVariant(message.id());
-    if (message.stamp().isValid()) {
-        header[QStringLiteral("message-sent")]  = QDBusVariant(message.stamp().toMSecsSinceEpoch() / 1000);
+    const QString selfBareJid = QXmppUtils::jidToBareJid(selfJid());
+    const qint64 received = QDateTime::currentMSecsSinceEpoch() / 1000;
+
+    Tp::MessagePartListList batch;
+    batch.reserve(messages.count());
+
+    for (const QXmppMessage &message : messages) {
+        /* Chat states, markers and errors from the archive are stale */
+        if (message.body().isEmpty() || message.type() == QXmppMessage::Error) {
+            continue;
+        }
+
+        if (QXmppUtils::jidToBareJid(message.from()) == selfBareJid) {
+            /* Sent from another resource of ours */
+            onCarbonMessageSent(message);
+            continue;
+        }
+
+        /* Markers for a whole page collapse into one like for live bursts */
+        if (message.isReceiptRequested()) {
+            m_markers.addReceived(message.from(), message.id());
+        }
+        m_markers.addMessage(message.id());
+
+        MessagePartsBuilder builder;
+        builder.setToken(message.id());
+        if (message.stamp().isValid()) {
+            builder.setSent(message.stamp().toMSecsSinceEpoch() / 1000);
+        }
+        builder.setReceived(received)
+               .setSender(m_targetHandle, m_targetJid)
+               .setType(Tp::ChannelTextMessageTypeNormal)
+               .setTextContent(message.body());
+        batch.append(builder.take());
+
+        storeMessage(message, m_targetJid, /* outgoing */ false);
     }
-    header[QStringLiteral("message-received")]  = QDBusVariant(QDateTime::currentMSecsSinceEpoch() / 1000);
-    header[QStringLiteral("message-sender")]    = QDBusVariant(senderHandle);
-    header[QStringLiteral("message-sender-id")] = QDBusVariant(senderID);
+
+    addPendingMessages(batch);
+}
+
+void TextChannel::processReceivedMessage(const QXmppMessage &message, uint senderHandle, const QString &senderID)
+{
+    const qint64 received = QDateTime::currentMSecsSinceEpoch() / 1000;
+    const qint64 sent = message.stamp().isValid() ? message.stamp().toMSecsSinceEpoch() / 1000 : -1;
+
+    auto header = [&](MessagePartsBuilder &builder) -> MessagePartsBuilder & {
+        builder.setToken(message.id());
+        if (sent >= 0) {
+            builder.setSent(sent);
+        }
+        return builder.setReceived(received).setSender(senderHandle, senderID);
+    };
 
     /* Handle chat states */
     if (message.state() != QXmppMessage::None) {
@@ -177,18 +273,20 @@ void TextChannel::processReceivedMessage(const QXmppMessage &message, uint sende
     }
 
     if (message.type() == QXmppMessage::Error) {
-        Tp::MessagePartList partList;
-        header[QStringLiteral("message-type")]  = QDBusVariant(Tp::ChannelTextMessageTypeDeliveryReport);
+        m_connection->deliveryTracker()->fail(message.id());
+
+        MessagePartsBuilder builder;
+        header(builder).setType(Tp::ChannelTextMessageTypeDeliveryReport).setDeliveryToken(message.id());
 
         switch (message.error().type()) {
         // It seems that there is no "continue" error type in the spec
         case QXmppStanza::Error::Cancel:
         case QXmppStanza::Error::Modify:
         case QXmppStanza::Error::Auth:
-            header[QStringLiteral("delivery-status")] = QDBusVariant(Tp::DeliveryStatusPermanentlyFailed);
+            builder.setDeliveryStatus(Tp::DeliveryStatusPermanentlyFailed);
             break;
         case QXmppStanza::Error::Wait:
-            header[QStringLiteral("delivery-status")] = QDBusVariant(Tp::DeliveryStatusTemporarilyFailed);
+            builder.setDeliveryStatus(Tp::DeliveryStatusTemporarilyFailed);
             break;
         default:
             break;
@@ -200,90 +298,179 @@ void TextChannel::processReceivedMessage(const QXmppMessage &message, uint sende
             errorMessage.append(QString(QStringLiteral(" (code %1)")).arg(message.error().code()));
         }
 
-        header[QStringLiteral("delivery-error-message")] = QDBusVariant(errorMessage);
-
-        partList << header;
-        addReceivedMessage(partList);
+        builder.setDeliveryErrorMessage(std::move(errorMessage));
+        addPendingMessage(builder.take());
         return;
     }
 
+    /* Reports for everything a receipt or marker acknowledged */
+    auto reportDelivery = [&](const QString &token, uint status, bool cumulative) {
+        Tp::MessagePartListList reports;
+        for (const QString &acknowledged : m_connection->deliveryTracker()->acknowledge(token, status, cumulative)) {
+            MessagePartsBuilder builder;
+            header(builder).setType(Tp::ChannelTextMessageTypeDeliveryReport)
+                           .setDeliveryStatus(status)
+                           .setDeliveryToken(acknowledged);
+            if (!reports.isEmpty()) {
+                /* Only one of them can have the ID of the stanza */
+                builder.setToken(m_connection->nextStanzaId());
+            }
+            reports.append(builder.take());
+
+            m_connection->messageStore()->setDeliveryStatus(m_targetJid, acknowledged, status);
+        }
+        addPendingMessages(reports);
+    };
+
+    /* Handle delivery receipts */
+    if (!message.receiptId().isEmpty()) {
+        reportDelivery(message.receiptId(), Tp::DeliveryStatusDelivered, /* cumulative */ false);
+    }
+
     /* Handle chat markers */
     if (message.marker() != QXmppMessage::NoMarker) {
-        Tp::MessagePartList partList;
-        header[QStringLiteral("message-type")]  = QDBusVariant(Tp::ChannelTextMessageTypeDeliveryReport);
-
+        uint status = Tp::DeliveryStatusUnknown;
         switch (message.marker()) {
         case QXmppMessage::Acknowledged:
-            header[QStringLiteral("delivery-status")] = QDBusVariant(Tp::DeliveryStatusRead);
-            break;
         case QXmppMessage::Displayed:
+            status = Tp::DeliveryStatusRead;
+            break;
         case QXmppMessage::Received:
-            header[QStringLiteral("delivery-status")] = QDBusVariant(Tp::DeliveryStatusDelivered);
+            status = Tp::DeliveryStatusDelivered;
             break;
         default:
             Q_ASSERT(0);
         }
-        partList << header;
-        addReceivedMessage(partList);
+
+        /* Our message tokens are the stanza IDs the markers refer to, and
+         * a marker implies the same for all earlier messages */
+        reportDelivery(message.markerId(), status, /* cumulative */ true);
     }
 
     /* Send receipt */
     if (message.isReceiptRequested()) {
-        QUuid outMessageToken = QUuid::createUuid();
-        QXmppMessage outMessage;
-        outMessage.setMarker(QXmppMessage::Received);
-        outMessage.setTo(message.from());
-        outMessage.setFrom(selfJid());
-        outMessage.setMarkerId(message.id());
-        outMessage.setId(outMessageToken.toString());
-
-        sendQXmppMessage(outMessage);
+        m_markers.addReceived(message.from(), message.id());
     }
 
     /* Text message */
     if (!message.body().isEmpty()) {
-        Tp::MessagePartList body;
-        Tp::MessagePart text;
-        text[QStringLiteral("content-type")] = QDBusVariant(QStringLiteral("text/plain"));
-        text[QStringLiteral("content")]      = QDBusVariant(message.body());
-        body << text;
-
-        Tp::MessagePartList partList;
-        header[QStringLiteral("message-type")]  = QDBusVariant(Tp::ChannelTextMessageTypeNormal);
-        partList << header << body;
-        addReceivedMessage(partList);
+        m_markers.addMessage(message.id());
+
+        MessagePartsBuilder builder;
+        header(builder).setType(Tp::ChannelTextMessageTypeNormal).setTextContent(message.body());
+        addPendingMessage(builder.take());
+
+        storeMessage(message, senderID, /* outgoing */ false);
     }
 }
 
 void TextChannel::onCarbonMessageSent(const QXmppMessage &message)
 {
-    Tp::MessagePart header;
-    header[QStringLiteral("message-token")] = QDBusVariant(message.id());
+    /* Text message */
+    if (message.body().isEmpty()) {
+        return;
+    }
+
+    const QString self = selfJid();
+
+    MessagePartsBuilder builder;
+    builder.setToken(message.id());
     if (message.stamp().isValid()) {
-        header[QStringLiteral("message-sent")]  = QDBusVariant(message.stamp().toMSecsSinceEpoch() / 1000);
+        builder.setSent(message.stamp().toMSecsSinceEpoch() / 1000);
     }
-    header[QStringLiteral("message-received")]  = QDBusVariant(QDateTime::currentMSecsSinceEpoch() / 1000);
-    header[QStringLiteral("message-sender")]    = QDBusVariant(m_connection->ensureContactHandle(selfJid()));
-    header[QStringLiteral("message-sender-id")] = QDBusVariant(selfJid());
+    builder.setReceived(QDateTime::currentMSecsSinceEpoch() / 1000)
+           .setSender(m_connection->ensureContactHandle(self), self)
+           .setType(Tp::ChannelTextMessageTypeNormal)
+           .setTextContent(message.body());
+    m_messagesIface->messageSent(builder.take(), 0, message.id());
 
-    /* Text message */
-    if (!message.body().isEmpty()) {
-        Tp::MessagePartList body;
-        Tp::MessagePart text;
-        text[QStringLiteral("content-type")] = QDBusVariant(QStringLiteral("text/plain"));
-        text[QStringLiteral("content")]      = QDBusVariant(message.body());
-        body << text;
-
-        Tp::MessagePartList partList;
-        header[QStringLiteral("message-type")]  = QDBusVariant(Tp::ChannelTextMessageTypeNormal);
-        partList << header << body;
-        m_messagesIface->messageSent(partList, 0, message.id());
+    storeMessage(message, self, /* outgoing */ true);
+}
+
+void TextChannel::resendMessage(const QString &messageToken, const QString &content)
+{
+    OutboundStanza message = OutboundStanza::chatMessage(content, /* requestReceipt */ true);
+    message.setTo(targetJid());
+    message.setFrom(selfJid());
+    message.setId(messageToken);
+
+    sendStanza(message);
+}
+
+void TextChannel::addDeliveryReport(const QString &messageToken, uint status, const QString &errorMessage)
+{
+    MessagePartsBuilder builder;
+    builder.setToken(m_connection->nextStanzaId())
+           .setReceived(QDateTime::currentMSecsSinceEpoch() / 1000)
+           .setSender(m_targetHandle, m_targetJid)
+           .setType(Tp::ChannelTextMessageTypeDeliveryReport)
+           .setDeliveryStatus(status)
+           .setDeliveryToken(messageToken);
+    if (!errorMessage.isEmpty()) {
+        builder.setDeliveryErrorMessage(errorMessage);
+    }
+
+    addPendingMessage(builder.take());
+}
+
+void TextChannel::storeMessage(const QXmppMessage &message, const QString &senderID, bool outgoing)
+{
+    const qint64 timestamp = message.stamp().isValid() ? message.stamp().toMSecsSinceEpoch() : QDateTime::currentMSecsSinceEpoch();
+    storeMessage(message.id(), timestamp, senderID, message.body(), outgoing);
+}
+
+void TextChannel::storeMessage(const QString &id, qint64 timestamp, const QString &senderID, const QString &body, bool outgoing)
+{
+    StoredMessage storedMessage;
+    storedMessage.conversation = m_targetJid;
+    storedMessage.id = id;
+    storedMessage.timestamp = timestamp;
+    storedMessage.flags = outgoing ? StoredMessage::Outgoing : 0;
+    storedMessage.senderId = outgoing ? QXmppUtils::jidToBareJid(senderID) : senderID;
+    storedMessage.body = body;
+
+    if (m_connection->messageStore()->append(storedMessage) && !storedMessage.id.isEmpty()) {
+        m_connection->searchIndex()->addDocument(storedMessage.conversation, storedMessage.id, storedMessage.body);
+    }
+}
+
+Tp::MessagePartListList TextChannel::storedMessagesByTime(qint64 from, qint64 to, uint limit)
+{
+    Tp::MessagePartListList result;
+
+    /* Telepathy timestamps are in seconds, the store uses milliseconds.
+     * Clients pass the extremes for open ranges, which must not overflow. */
+    const qint64 minSeconds = std::numeric_limits<qint64>::min() / 1000;
+    const qint64 maxSeconds = (std::numeric_limits<qint64>::max() - 999) / 1000;
+    from = qBound(minSeconds, from, maxSeconds);
+    to = qBound(minSeconds, to, maxSeconds);
+
+    const QList<StoredMessage> messages = m_connection->messageStore()->messagesByTime(m_targetJid, from * 1000, to * 1000 + 999,
+                                                                                      Common::clampLimit(limit));
+    for (const StoredMessage &message : messages) {
+        result << m_connection->storedMessageToParts(message);
+    }
+
+    return result;
+}
+
+Tp::MessagePartListList TextChannel::storedMessagesBefore(const QString &messageToken, uint limit)
+{
+    Tp::MessagePartListList result;
+
+    const QList<StoredMessage> messages = m_connection->messageStore()->messagesBefore(m_targetJid, messageToken, Common::clampLimit(limit));
+    for (const StoredMessage &message : messages) {
+        result << m_connection->storedMessageToParts(message);
     }
+
+    return result;
 }
 
-bool TextChannel::sendQXmppMessage(QXmppMessage &message)
+bool TextChannel::sendStanza(OutboundStanza &stanza)
 {
-    return m_connection->qxmppClient()->sendPacket(message);
+    const OutboundQueue::Priority priority = stanza.kind() == OutboundStanza::ChatMessage ? OutboundQueue::Interactive
+                                                                                          : OutboundQueue::Markers;
+    return m_connection->sendStanza(stanza, priority);
 }
 
 QString TextChannel::targetJid() const
@@ -298,45 +485,131 @@ QString TextChannel::selfJid() const
 
 void TextChannel::messageAcknowledged(const QString &messageId)
 {
-    QUuid messageToken = QUuid::createUuid();
-    QXmppMessage message;
-    message.setMarker(QXmppMessage::Displayed);
-    message.setTo(targetJid()); //TODO: Should we make sure that we send the "displayed" ack to the same resource as the "received" ack?
+    if (m_pendingCount > 0) {
+        --m_pendingCount;
+    }
+    m_pendingSpool.acknowledge(messageId);
+    if (!m_pendingSpool.isEmpty()) {
+        /* We are called while Tp still iterates over its pending messages */
+        QMetaObject::invokeMethod(this, "pageInSpooledMessages", Qt::QueuedConnection);
+    }
+
+    //TODO: Should we make sure that we send the "displayed" ack to the same resource as the "received" ack?
+    m_markers.addDisplayed(targetJid(), messageId);
+}
+
+void TextChannel::sendMarker(QXmppMessage::Marker marker, const QString &to, const QString &markerId)
+{
+    OutboundStanza message = OutboundStanza::marker(marker, markerId);
+    message.setTo(to);
     message.setFrom(selfJid());
-    message.setId(messageToken.toString());
-    message.setMarkerId(messageId);
+    message.setId(m_connection->nextStanzaId());
 
-    sendQXmppMessage(message);
+    sendStanza(message);
 }
 
 void TextChannel::setChatState(uint state, Tp::DBusError *error)
 {
     Q_UNUSED(error);
 
-    QUuid messageToken = QUuid::createUuid();
-    QXmppMessage message;
+    QXmppMessage::State xmppState = QXmppMessage::None;
     switch (state) {
     case Tp::ChannelChatStateActive:
-        message.setState(QXmppMessage::Active);
+        xmppState = QXmppMessage::Active;
         break;
     case Tp::ChannelChatStateComposing:
-        message.setState(QXmppMessage::Composing);
+        xmppState = QXmppMessage::Composing;
         break;
     case Tp::ChannelChatStateGone:
-        message.setState(QXmppMessage::Gone);
+        xmppState = QXmppMessage::Gone;
         break;
     case Tp::ChannelChatStateInactive:
-        message.setState(QXmppMessage::Inactive);
+        xmppState = QXmppMessage::Inactive;
         break;
     case Tp::ChannelChatStatePaused:
-        message.setState(QXmppMessage::Paused);
+        xmppState = QXmppMessage::Paused;
         break;
     default:
         Q_ASSERT(0);
     }
+
+    m_chatStates.setState(xmppState);
+}
+
+void TextChannel::sendChatState(QXmppMessage::State state)
+{
+    OutboundStanza message = OutboundStanza::chatState(state);
     message.setTo(targetJid());
     message.setFrom(selfJid());
-    message.setId(messageToken.toString());
+    message.setId(m_connection->nextStanzaId());
+
+    sendStanza(message);
+}
+
+QString TextChannel::pendingSpoolFileName() const
+{
+    return Common::accountDataPath(m_connection->qxmppClient()->configuration().jidBare()) + QLatin1String("/pending/")
+            + Tp::escapeAsIdentifier(m_targetJid) + QLatin1String(".spool");
+}
+
+bool TextChannel::openPendingSpool()
+{
+    const QString fileName = pendingSpoolFileName();
+    QDir().mkpath(QFileInfo(fileName).path());
+    return m_pendingSpool.open(fileName);
+}
+
+void TextChannel::addPendingMessage(const Tp::MessagePartList &message)
+{
+    addPendingMessages(Tp::MessagePartListList() << message);
+}
+
+void TextChannel::addPendingMessages(const Tp::MessagePartListList &messages)
+{
+    const uint limit = m_connection->pendingMessageLimit();
+
+    /* Once something is spooled, everything newer has to queue up behind it */
+    int queued = 0;
+    if (limit == 0) {
+        queued = messages.count();
+    } else if (m_pendingSpool.isEmpty() && m_pendingCount < limit) {
+        queued = qMin<int>(messages.count(), limit - m_pendingCount);
+    }
 
-    sendQXmppMessage(message);
+    for (int i = 0; i < queued; ++i) {
+        addReceivedMessage(messages.at(i));
+    }
+    m_pendingCount += queued;
+
+    if (queued == messages.count()) {
+        return;
+    }
+
+    /* The rest goes to disk in a single write */
+    const Tp::MessagePartListList spilled = messages.mid(queued);
+    if ((!m_pendingSpool.isOpen() && !openPendingSpool()) || !m_pendingSpool.enqueue(spilled)) {
+        /* Better keep them in memory than lose them */
+        for (const Tp::MessagePartList &message : spilled) {
+            addReceivedMessage(message);
+        }
+        m_pendingCount += spilled.count();
+        return;
+    }
+
+    qCDebug(general) << "Spooled" << spilled.count() << "pending messages," << m_pendingSpool.count() << "messages on disk for" << m_targetJid;
+}
+
+void TextChannel::pageInSpooledMessages()
+{
+    const uint limit = m_connection->pendingMessageLimit();
+
+    while (!m_pendingSpool.isEmpty() && (limit == 0 || m_pendingCount < limit)) {
+        const Tp::MessagePartList message = m_pendingSpool.dequeue();
+        if (message.isEmpty()) {
+            continue;
+        }
+
+        addReceivedMessage(message);
+        ++m_pendingCount;
+    }
 }
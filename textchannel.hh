@@ -24,6 +24,12 @@
 
 #include <QXmppMessage.h>
 
+#include "chatstatethrottle.hh"
+#include "historyinterface.hh"
+#include "markeraggregator.hh"
+#include "outboundstanza.hh"
+#include "pendingspool.hh"
+
 class TextChannel;
 class Connection;
 
@@ -33,12 +39,27 @@ class TextChannel : public Tp::BaseChannelTextType
 {
     Q_OBJECT
 public:
+    ~TextChannel();
+
     static TextChannelPtr create(Connection *connection, Tp::BaseChannel *baseChannel);
 
+    void processArchivedMessages(const QList<QXmppMessage> &messages);
+
+    void resendMessage(const QString &messageToken, const QString &content);
+    void addDeliveryReport(const QString &messageToken, uint status, const QString &errorMessage = QString());
+
+    Tp::MessagePartListList storedMessagesByTime(qint64 from, qint64 to, uint limit);
+    Tp::MessagePartListList storedMessagesBefore(const QString &messageToken, uint limit);
+
 public slots:
     virtual void onMessageReceived(const QXmppMessage &message);
     void onCarbonMessageSent(const QXmppMessage &message);
 
+private slots:
+    void pageInSpooledMessages();
+    void sendChatState(QXmppMessage::State state);
+    void sendMarker(QXmppMessage::Marker marker, const QString &to, const QString &markerId);
+
 protected:
     TextChannel(Connection *connection, Tp::BaseChannel *baseChannel);
     QString sendMessage(const Tp::MessagePartList &messageParts, uint flags, Tp::DBusError *error);
@@ -46,18 +67,34 @@ protected:
     void messageAcknowledged(const QString &messageId);
 
     void processReceivedMessage(const QXmppMessage &message, uint senderHandle, const QString &senderID);
+    void storeMessage(const QXmppMessage &message, const QString &senderID, bool outgoing);
+    void storeMessage(const QString &id, qint64 timestamp, const QString &senderID, const QString &body, bool outgoing);
+    void addPendingMessage(const Tp::MessagePartList &message);
+    void addPendingMessages(const Tp::MessagePartListList &messages);
+    QString pendingSpoolFileName() const;
+    bool openPendingSpool();
 
-    virtual bool sendQXmppMessage(QXmppMessage &message);
+    virtual bool sendStanza(OutboundStanza &stanza);
     virtual QString targetJid() const;
     virtual QString selfJid() const;
 
 protected:
     Tp::BaseChannelMessagesInterfacePtr m_messagesIface;
     Tp::BaseChannelChatStateInterfacePtr m_chatStateIface;
+    HistoryInterfacePtr m_historyIface;
 
     Connection *m_connection;
     uint m_targetHandle;
     QString m_targetJid;
+
+    ChatStateThrottle m_chatStates;
+    MarkerAggregator m_markers;
+
+    /* Received messages beyond the pending message limit wait on disk */
+    PendingSpool m_pendingSpool;
+    uint m_pendingCount;
+
+    bool m_trackDelivery;
 };
 
 #endif // TEXTCHANNEL_HH
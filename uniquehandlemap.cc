@@ -31,13 +31,16 @@ const QString UniqueHandleMap::operator[] (const uint handle) const
 
 uint UniqueHandleMap::operator[] (const QString &bareJid)
 {
-    int idx = m_knownHandles.indexOf(bareJid);
-    if (idx != -1) {
-        return idx + 1;
+    const uint knownHandle = handle(bareJid);
+    if (knownHandle) {
+        return knownHandle;
     }
 
     m_knownHandles.append(bareJid);
-    return m_knownHandles.size();
+    const uint newHandle = m_knownHandles.size();
+    m_handles.insert(bareJid, newHandle);
+    m_foldedIds.insert(bareJid.toCaseFolded());
+    return newHandle;
 }
 
 bool UniqueHandleMap::contains(const uint handle) const
@@ -47,5 +50,10 @@ bool UniqueHandleMap::contains(const uint handle) const
 
 bool UniqueHandleMap::contains(const QString &bareJid) const
 {
-    return m_knownHandles.contains(bareJid, Qt::CaseInsensitive);
+    return m_foldedIds.contains(bareJid.toCaseFolded());
+}
+
+uint UniqueHandleMap::handle(const QString &bareJid) const
+{
+    return m_handles.value(bareJid);
 }
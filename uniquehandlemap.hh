@@ -19,6 +19,8 @@
 #ifndef UNIQUEHANDLEMAP_HH
 #define UNIQUEHANDLEMAP_HH
 
+#include <QHash>
+#include <QSet>
 #include <QStringList>
 
 class UniqueHandleMap
@@ -32,8 +34,13 @@ public:
     bool contains(const uint handle) const;
     bool contains(const QString &bareJid) const;
 
+    /* Returns 0 for identifiers that do not have a handle yet */
+    uint handle(const QString &bareJid) const;
+
 private:
     QStringList m_knownHandles;
+    QHash<QString, uint> m_handles;
+    QSet<QString> m_foldedIds;
 };
 
 #endif // UNIQUEHANDLEMAP_HH